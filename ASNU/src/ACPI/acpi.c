@@ -0,0 +1,90 @@
+#include "acpi.h"
+#include <string.h>
+#include <VMM/vmm.h>
+#include <Serial/serial.h>
+
+typedef struct __attribute__((packed)) {
+    char Signature[8];          /* "RSD PTR " */
+    uint8_t Checksum;
+    char OemId[6];
+    uint8_t Revision;           /* 0: ACPI 1.0, RSDT only */
+    uint32_t RsdtAddress;
+    /* Revision 2 and up */
+    uint32_t Length;
+    uint64_t XsdtAddress;
+    uint8_t ExtendedChecksum;
+    uint8_t Reserved[3];
+} AcpiRsdp;
+
+#define ACPI_MAX_TABLES 64
+
+/* Signatures and addresses of the tables the root table lists, read once */
+static struct {
+    char Signature[4];
+    uint64_t Phys;
+} acpi_tables[ACPI_MAX_TABLES];
+static uint32_t acpi_table_count = 0;
+
+static bool acpi_checksum_ok(const void *p, uint32_t len) {
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < len; i++) sum += ((const uint8_t*)p)[i];
+    return sum == 0;
+}
+
+/* Map the header to learn the length, then the whole table */
+static const AcpiSdtHeader *acpi_map_table(uint64_t phys) {
+    const AcpiSdtHeader *h = (const AcpiSdtHeader*)vmm_map_mmio(phys, sizeof(AcpiSdtHeader));
+    if (!h || h->Length < sizeof(AcpiSdtHeader)) return NULL;
+    uint32_t len = h->Length;
+    h = (const AcpiSdtHeader*)vmm_map_mmio(phys, len);
+    if (!h || !acpi_checksum_ok(h, len)) return NULL;
+    return h;
+}
+
+bool acpi_init(uint64_t rsdp_phys) {
+    if (!rsdp_phys) return false;
+    const AcpiRsdp *rsdp = (const AcpiRsdp*)vmm_map_mmio(rsdp_phys, sizeof(AcpiRsdp));
+    if (!rsdp || memcmp(rsdp->Signature, "RSD PTR ", 8) != 0 || !acpi_checksum_ok(rsdp, 20)) {
+        serial_fwrite("ACPI: bad RSDP");
+        return false;
+    }
+
+    /* The root table: 64-bit entries in an XSDT, 32-bit in an RSDT */
+    const AcpiSdtHeader *root = NULL;
+    uint32_t entry_size = 8;
+    if (rsdp->Revision >= 2 && rsdp->XsdtAddress && acpi_checksum_ok(rsdp, rsdp->Length))
+        root = acpi_map_table(rsdp->XsdtAddress);
+    if (!root) {
+        root = acpi_map_table(rsdp->RsdtAddress);
+        entry_size = 4;
+    }
+    if (!root) {
+        serial_fwrite("ACPI: no valid root table");
+        return false;
+    }
+
+    const uint8_t *entries = (const uint8_t*)root + sizeof(AcpiSdtHeader);
+    uint32_t count = (root->Length - sizeof(AcpiSdtHeader)) / entry_size;
+    for (uint32_t i = 0; i < count && acpi_table_count < ACPI_MAX_TABLES; i++) {
+        uint64_t phys = 0;
+        memcpy(&phys, entries + i * entry_size, entry_size);
+        if (!phys) continue;
+        const AcpiSdtHeader *h = (const AcpiSdtHeader*)vmm_map_mmio(phys, sizeof(AcpiSdtHeader));
+        if (!h) break;
+        memcpy(acpi_tables[acpi_table_count].Signature, h->Signature, 4);
+        acpi_tables[acpi_table_count].Phys = phys;
+        acpi_table_count++;
+    }
+
+    serial_fwrite("ACPI: revision %u, %s with %u tables", rsdp->Revision, entry_size == 8 ? "XSDT" : "RSDT", acpi_table_count);
+    return true;
+}
+
+const AcpiSdtHeader *acpi_find_table(const char *signature, uint32_t index) {
+    for (uint32_t i = 0; i < acpi_table_count; i++) {
+        if (memcmp(acpi_tables[i].Signature, signature, 4) != 0) continue;
+        if (index--) continue;
+        return acpi_map_table(acpi_tables[i].Phys);
+    }
+    return NULL;
+}
@@ -0,0 +1,81 @@
+#ifndef ACPI_H
+#define ACPI_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Static ACPI tables, found through the RSDP the bootloader hands over.
+ * Tables live outside the higher-half direct map, so a table is mapped
+ * into the MMIO window when it is looked up; callers look each up once.
+ */
+
+typedef struct __attribute__((packed)) {
+    char Signature[4];
+    uint32_t Length;
+    uint8_t Revision;
+    uint8_t Checksum;
+    char OemId[6];
+    char OemTableId[8];
+    uint32_t OemRevision;
+    uint32_t CreatorId;
+    uint32_t CreatorRevision;
+} AcpiSdtHeader;
+
+/* Generic Address Structure */
+typedef struct __attribute__((packed)) {
+    uint8_t AddressSpaceId;     /* 0: system memory, 1: system I/O */
+    uint8_t RegisterBitWidth;
+    uint8_t RegisterBitOffset;
+    uint8_t AccessSize;
+    uint64_t Address;
+} AcpiGas;
+
+#define ACPI_SPACE_MEMORY   0
+
+typedef struct __attribute__((packed)) {
+    AcpiSdtHeader Header;
+    uint32_t EventTimerBlockId;
+    AcpiGas Address;
+    uint8_t HpetNumber;
+    uint16_t MinimumTick;
+    uint8_t PageProtection;
+} AcpiHpet;
+
+/* Multiple APIC Description Table, "APIC": a header, then variable-length entries */
+typedef struct __attribute__((packed)) {
+    AcpiSdtHeader Header;
+    uint32_t LocalApicAddress;
+    uint32_t Flags;             /* bit 0: dual 8259s are present as well */
+} AcpiMadt;
+
+typedef struct __attribute__((packed)) {
+    uint8_t Type;
+    uint8_t Length;
+} AcpiMadtEntry;
+
+#define ACPI_MADT_PCAT_COMPAT       (1 << 0)
+
+#define ACPI_MADT_LOCAL_APIC        0
+#define ACPI_MADT_IO_APIC           1
+#define ACPI_MADT_OVERRIDE          2
+#define ACPI_MADT_LOCAL_APIC_NMI    4
+#define ACPI_MADT_LOCAL_APIC_ADDR   5
+#define ACPI_MADT_LOCAL_X2APIC      9
+#define ACPI_MADT_LOCAL_X2APIC_NMI  10
+
+/* MPS INTI flags on overrides and NMI entries; 0 in a field means "as the bus does" */
+#define ACPI_INTI_POLARITY_MASK     0x3
+#define ACPI_INTI_POLARITY_HIGH     0x1
+#define ACPI_INTI_POLARITY_LOW      0x3
+#define ACPI_INTI_TRIGGER_MASK      0xC
+#define ACPI_INTI_TRIGGER_EDGE      0x4
+#define ACPI_INTI_TRIGGER_LEVEL     0xC
+
+/* rsdp_phys as the bootloader reports it; false if there is no usable root table */
+bool acpi_init(uint64_t rsdp_phys);
+
+/* The index-th table with this signature, mapped; NULL if there is none or its checksum is bad */
+const AcpiSdtHeader *acpi_find_table(const char *signature, uint32_t index);
+
+#endif /* ACPI_H */
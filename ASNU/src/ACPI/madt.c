@@ -0,0 +1,117 @@
+#include "madt.h"
+#include "acpi.h"
+#include <string.h>
+#include <Serial/serial.h>
+
+static MadtInfo madt_info;
+static bool madt_valid = false;
+
+static void madt_add_cpu(uint32_t uid, uint32_t apic_id, uint32_t flags) {
+    /* bit 0 enabled, bit 1 online capable: neither means the entry is a placeholder */
+    if (!(flags & 0x3) || madt_info.CpuCount >= MADT_MAX_CPUS) return;
+    madt_info.Cpus[madt_info.CpuCount].Uid = uid;
+    madt_info.Cpus[madt_info.CpuCount].ApicId = apic_id;
+    madt_info.CpuCount++;
+}
+
+static void madt_add_nmi(uint32_t uid, uint8_t lint, uint16_t flags) {
+    if (madt_info.NmiCount >= MADT_MAX_NMIS) return;
+    madt_info.Nmis[madt_info.NmiCount].Uid = uid;
+    madt_info.Nmis[madt_info.NmiCount].Lint = lint;
+    madt_info.Nmis[madt_info.NmiCount].Flags = flags;
+    madt_info.NmiCount++;
+}
+
+bool madt_init(void) {
+    const AcpiMadt *madt = (const AcpiMadt*)acpi_find_table("APIC", 0);
+    if (!madt) {
+        serial_fwrite("MADT: not present");
+        return false;
+    }
+
+    madt_info.LapicPhys = madt->LocalApicAddress;
+    madt_info.PcatCompat = madt->Flags & ACPI_MADT_PCAT_COMPAT;
+    /* Identity until an override says otherwise, with ISA polarity and trigger */
+    for (uint32_t irq = 0; irq < 16; irq++) {
+        madt_info.Isa[irq].Gsi = irq;
+        madt_info.Isa[irq].Flags = 0;
+    }
+
+    /* Entries are unaligned; copy fields out rather than cast */
+    const uint8_t *p = (const uint8_t*)madt + sizeof(AcpiMadt);
+    const uint8_t *end = (const uint8_t*)madt + madt->Header.Length;
+    while (p + sizeof(AcpiMadtEntry) <= end) {
+        const AcpiMadtEntry *e = (const AcpiMadtEntry*)p;
+        if (e->Length < sizeof(AcpiMadtEntry) || p + e->Length > end) break;
+
+        uint32_t a = 0, b = 0, c = 0;
+        uint16_t flags = 0;
+        switch (e->Type) {
+        case ACPI_MADT_LOCAL_APIC:
+            if (e->Length < 8) break;
+            memcpy(&a, p + 4, 4);
+            madt_add_cpu(p[2], p[3], a);
+            break;
+        case ACPI_MADT_IO_APIC:
+            if (e->Length < 12 || madt_info.IoApicCount >= MADT_MAX_IOAPICS) break;
+            memcpy(&a, p + 4, 4);
+            memcpy(&b, p + 8, 4);
+            madt_info.IoApics[madt_info.IoApicCount].Id = p[2];
+            madt_info.IoApics[madt_info.IoApicCount].Phys = a;
+            madt_info.IoApics[madt_info.IoApicCount].GsiBase = b;
+            madt_info.IoApicCount++;
+            break;
+        case ACPI_MADT_OVERRIDE:
+            /* Bus 0 is ISA, the only bus the table describes */
+            if (e->Length < 10 || p[2] != 0 || p[3] >= 16) break;
+            memcpy(&a, p + 4, 4);
+            memcpy(&flags, p + 8, 2);
+            madt_info.Isa[p[3]].Gsi = a;
+            madt_info.Isa[p[3]].Flags = flags;
+            break;
+        case ACPI_MADT_LOCAL_APIC_NMI:
+            if (e->Length < 6) break;
+            memcpy(&flags, p + 3, 2);
+            madt_add_nmi(p[2] == 0xFF ? MADT_ALL_CPUS : p[2], p[5], flags);
+            break;
+        case ACPI_MADT_LOCAL_APIC_ADDR:
+            if (e->Length < 12) break;
+            memcpy(&madt_info.LapicPhys, p + 4, 8);
+            break;
+        case ACPI_MADT_LOCAL_X2APIC:
+            if (e->Length < 16) break;
+            memcpy(&a, p + 4, 4);
+            memcpy(&c, p + 8, 4);
+            memcpy(&b, p + 12, 4);
+            madt_add_cpu(b, a, c);
+            break;
+        case ACPI_MADT_LOCAL_X2APIC_NMI:
+            if (e->Length < 12) break;
+            memcpy(&flags, p + 2, 2);
+            memcpy(&a, p + 4, 4);
+            madt_add_nmi(a, p[8], flags);
+            break;
+        }
+        p += e->Length;
+    }
+
+    madt_valid = true;
+    uint32_t overrides = 0;
+    for (uint32_t irq = 0; irq < 16; irq++)
+        if (madt_info.Isa[irq].Gsi != irq || madt_info.Isa[irq].Flags) overrides++;
+    serial_fwrite("MADT: %u CPUs, %u IOAPICs, %u ISA overrides, %u NMI pins%s",
+                  madt_info.CpuCount, madt_info.IoApicCount, overrides, madt_info.NmiCount,
+                  madt_info.PcatCompat ? ", 8259s present" : "");
+    return true;
+}
+
+const MadtInfo *madt_get(void) {
+    return madt_valid ? &madt_info : NULL;
+}
+
+uint32_t madt_cpu_uid(uint32_t apic_id) {
+    if (!madt_valid) return MADT_ALL_CPUS;
+    for (uint32_t i = 0; i < madt_info.CpuCount; i++)
+        if (madt_info.Cpus[i].ApicId == apic_id) return madt_info.Cpus[i].Uid;
+    return MADT_ALL_CPUS;
+}
@@ -0,0 +1,61 @@
+#ifndef MADT_H
+#define MADT_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Interrupt controller layout from the MADT: the local APIC of each CPU,
+ * the IOAPICs and the GSIs (global system interrupts) they cover, where the
+ * ISA IRQs really land, and which local APIC pin carries the NMI. The table
+ * is read once at boot and kept here, already decoded.
+ */
+
+#define MADT_MAX_IOAPICS    8
+#define MADT_MAX_CPUS       256
+#define MADT_MAX_NMIS       16
+#define MADT_ALL_CPUS       0xFFFFFFFF
+
+typedef struct {
+    uint32_t Id;
+    uint64_t Phys;
+    uint32_t GsiBase;
+} MadtIoApic;
+
+typedef struct {
+    uint32_t Uid;               /* ACPI processor UID, what NMI entries name */
+    uint32_t ApicId;
+} MadtCpu;
+
+typedef struct {
+    uint32_t Uid;               /* MADT_ALL_CPUS for every processor */
+    uint8_t Lint;               /* local APIC pin, 0 or 1 */
+    uint16_t Flags;             /* ACPI_INTI_* */
+} MadtNmi;
+
+/* Where an ISA IRQ arrives: the GSI and its ACPI_INTI_* polarity and trigger */
+typedef struct {
+    uint32_t Gsi;
+    uint16_t Flags;
+} MadtIsaRoute;
+
+typedef struct {
+    uint64_t LapicPhys;
+    bool PcatCompat;
+    uint32_t IoApicCount;
+    MadtIoApic IoApics[MADT_MAX_IOAPICS];
+    uint32_t CpuCount;
+    MadtCpu Cpus[MADT_MAX_CPUS];
+    uint32_t NmiCount;
+    MadtNmi Nmis[MADT_MAX_NMIS];
+    MadtIsaRoute Isa[16];
+} MadtInfo;
+
+/* After acpi_init(); false if there is no MADT, and madt_get() stays NULL */
+bool madt_init(void);
+const MadtInfo *madt_get(void);
+
+/* The processor UID of a local APIC, MADT_ALL_CPUS if the table does not list it */
+uint32_t madt_cpu_uid(uint32_t apic_id);
+
+#endif /* MADT_H */
@@ -0,0 +1,25 @@
+#ifndef HPET_H
+#define HPET_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time/clocksource.h>
+#include <time/clockevent.h>
+
+/*
+ * High Precision Event Timer, located through the ACPI HPET table. Its
+ * main counter is a clock source; its comparators become one-shot
+ * timers for single CPUs whose local APIC timer is the weaker choice.
+ * A comparator sends an FSB (MSI) message where it can, otherwise an
+ * edge on a free IOAPIC pin, to the CPU's timer vector.
+ */
+
+/* Map and start the timer block, register the clock source; false if there is none */
+bool hpet_init(void);
+
+/* Give the calling CPU a comparator of its own if that beats a timer rated min_rating; NULL otherwise */
+const ClockEvent* hpet_claim_clock_event(uint32_t min_rating);
+
+extern ClockSource HpetClockSource;
+
+#endif /* HPET_H */
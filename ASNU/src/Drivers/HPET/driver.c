@@ -0,0 +1,206 @@
+#include "../HPET.h"
+#include <ACPI/acpi.h>
+#include <VMM/vmm.h>
+#include <Serial/serial.h>
+#include <sync/spinlock.h>
+#include <smp/smp.h>
+#include <Drivers/LAPIC.h>
+#include <Drivers/IOAPIC.h>
+
+#define HPET_REG_CAP				0x000
+#define HPET_REG_CONFIG				0x010
+#define HPET_REG_COUNTER			0x0F0
+#define HPET_TIMER_CONFIG(n)		(0x100 + 0x20 * (n))
+#define HPET_TIMER_COMPARATOR(n)	(0x108 + 0x20 * (n))
+#define HPET_TIMER_FSB_ROUTE(n)		(0x110 + 0x20 * (n))
+
+#define HPET_CAP_COUNT_64			(1ULL << 13)
+#define HPET_CONFIG_ENABLE			(1ULL << 0)
+#define HPET_CONFIG_LEGACY			(1ULL << 1)
+
+#define HPET_TN_LEVEL				(1ULL << 1)
+#define HPET_TN_INT_ENABLE			(1ULL << 2)
+#define HPET_TN_PERIODIC			(1ULL << 3)
+#define HPET_TN_SIZE_64				(1ULL << 5)
+#define HPET_TN_32BIT				(1ULL << 8)
+#define HPET_TN_ROUTE_SHIFT			9
+#define HPET_TN_ROUTE_MASK			(0x1FULL << HPET_TN_ROUTE_SHIFT)
+#define HPET_TN_FSB_ENABLE			(1ULL << 14)
+#define HPET_TN_FSB_CAP				(1ULL << 15)
+
+#define HPET_MAX_PERIOD_FS			100000000ULL	/* the spec requires at least 10 MHz */
+#define HPET_MIN_DELTA_TICKS		64		/* closer than this the counter may pass the comparator before it is written */
+
+#define HPET_CLOCKSOURCE_RATING		250
+#define HPET_CLOCKEVENT_RATING		80		/* above a local APIC timer that may stop in C-states, below one that does not */
+
+static volatile uint8_t* HpetBase = NULL;
+static uint64_t HpetPeriodFs = 0;
+static uint32_t HpetTimerCount = 0;
+static bool HpetCounter64 = false;
+
+static Spinlock HpetClaimLock = SPINLOCK_INIT;
+static uint32_t HpetClaimed = 0;		/* bitmap of comparators handed to CPUs */
+static int8_t HpetCpuTimer[SMP_MAX_CPUS];
+static bool HpetTimerWide[32];
+static bool HpetTimerArmed[32];
+
+static inline uint64_t hpet_read(uint32_t Reg) {
+	return *(volatile uint64_t*)(HpetBase + Reg);
+}
+
+static inline void hpet_write(uint32_t Reg, uint64_t Value) {
+	*(volatile uint64_t*)(HpetBase + Reg) = Value;
+}
+
+static uint64_t hpet_read_counter(void) {
+	if (HpetCounter64) return hpet_read(HPET_REG_COUNTER);
+	return *(volatile uint32_t*)(HpetBase + HPET_REG_COUNTER);
+}
+
+ClockSource HpetClockSource = {
+	.name = "hpet",
+	.rating = HPET_CLOCKSOURCE_RATING,
+	.read = hpet_read_counter,
+	.mask = ~0ULL,
+	.freq_hz = 0,
+};
+
+/* a at or past b, in the comparator's width */
+static inline bool hpet_reached(uint32_t Timer, uint64_t a, uint64_t b) {
+	if (HpetTimerWide[Timer]) return (int64_t)(a - b) >= 0;
+	return (int32_t)(uint32_t)(a - b) >= 0;
+}
+
+/* One-shot on the calling CPU's comparator; the message lands on the local APIC timer vector */
+static void hpet_set_oneshot(uint64_t DeltaNs) {
+	uint32_t n = (uint32_t)HpetCpuTimer[this_cpu()->cpu_id];
+	uint64_t ticks = (DeltaNs * 1000000ULL) / HpetPeriodFs;
+	if (ticks < HPET_MIN_DELTA_TICKS) ticks = HPET_MIN_DELTA_TICKS;
+
+	if (!HpetTimerArmed[n]) {
+		hpet_write(HPET_TIMER_CONFIG(n), hpet_read(HPET_TIMER_CONFIG(n)) | HPET_TN_INT_ENABLE);
+		HpetTimerArmed[n] = true;
+	}
+
+	/* Matches only fire on equality: a comparator the counter already passed would wait for a wrap */
+	for (;;) {
+		uint64_t cmp = hpet_read_counter() + ticks;
+		hpet_write(HPET_TIMER_COMPARATOR(n), cmp);
+		if (!hpet_reached(n, hpet_read_counter(), cmp)) break;
+		ticks *= 2;
+	}
+}
+
+static void hpet_shutdown(void) {
+	uint32_t n = (uint32_t)HpetCpuTimer[this_cpu()->cpu_id];
+	hpet_write(HPET_TIMER_CONFIG(n), hpet_read(HPET_TIMER_CONFIG(n)) & ~HPET_TN_INT_ENABLE);
+	HpetTimerArmed[n] = false;
+}
+
+static ClockEvent HpetClockEvent = {
+	.name = "hpet",
+	.rating = HPET_CLOCKEVENT_RATING,
+	.max_delta_ns = 0,
+	.set_periodic = NULL,
+	.set_oneshot = hpet_set_oneshot,
+	.shutdown = hpet_shutdown,
+};
+
+/* Give comparator n an IOAPIC pin from its Tn_INT_ROUTE_CAP that nothing else holds; the GSI, or -1 */
+static int32_t hpet_route_ioapic(uint32_t n, uint32_t ApicId) {
+	uint32_t cap = (uint32_t)(hpet_read(HPET_TIMER_CONFIG(n)) >> 32);
+	for (uint32_t gsi = 0; gsi < 32; gsi++)
+		if ((cap & (1U << gsi)) && ioapic_route_gsi(gsi, LAPIC_TIMER_VECTOR, ApicId, 0))
+			return (int32_t)gsi;
+	return -1;
+}
+
+const ClockEvent* hpet_claim_clock_event(uint32_t min_rating) {
+	if (!HpetBase || HpetClockEvent.rating <= min_rating) return NULL;
+
+	/* MSI addresses and IOAPIC destinations have room for an 8-bit APIC ID only */
+	PerCpu* cpu = this_cpu();
+	if (cpu->lapic_id > 0xFF) return NULL;
+	uint64_t flags = spin_lock_irqsave(&HpetClaimLock);
+	int32_t found = -1, gsi = -1;
+	for (uint32_t n = 0; n < HpetTimerCount && n < 32; n++) {
+		if (HpetClaimed & (1U << n)) continue;
+		if (!(hpet_read(HPET_TIMER_CONFIG(n)) & HPET_TN_FSB_CAP)) continue;
+		found = (int32_t)n;
+		break;
+	}
+	/* Without FSB delivery a comparator raises an edge on an IOAPIC pin, sent on to this CPU */
+	for (uint32_t n = 0; found < 0 && ioapic_active() && n < HpetTimerCount && n < 32; n++) {
+		if (HpetClaimed & (1U << n)) continue;
+		gsi = hpet_route_ioapic(n, cpu->lapic_id);
+		if (gsi >= 0) found = (int32_t)n;
+	}
+	if (found >= 0) HpetClaimed |= 1U << found;
+	spin_unlock_irqrestore(&HpetClaimLock, flags);
+	if (found < 0) return NULL;
+
+	uint32_t n = (uint32_t)found;
+	uint64_t config = hpet_read(HPET_TIMER_CONFIG(n));
+	HpetTimerWide[n] = HpetCounter64 && (config & HPET_TN_SIZE_64);
+	config &= ~(HPET_TN_LEVEL | HPET_TN_INT_ENABLE | HPET_TN_PERIODIC | HPET_TN_32BIT |
+				HPET_TN_FSB_ENABLE | HPET_TN_ROUTE_MASK);
+	if (!HpetTimerWide[n]) config |= HPET_TN_32BIT;
+
+	if (gsi < 0) {
+		/* FSB route: an MSI to this CPU's local APIC, fixed delivery, edge */
+		uint64_t address = 0xFEE00000ULL | ((uint64_t)cpu->lapic_id << 12);
+		hpet_write(HPET_TIMER_FSB_ROUTE(n), (address << 32) | LAPIC_TIMER_VECTOR);
+		config |= HPET_TN_FSB_ENABLE;
+	} else {
+		config |= (uint64_t)gsi << HPET_TN_ROUTE_SHIFT;
+	}
+	hpet_write(HPET_TIMER_CONFIG(n), config);
+	HpetCpuTimer[cpu->cpu_id] = (int8_t)n;
+	return &HpetClockEvent;
+}
+
+bool hpet_init(void) {
+	const AcpiHpet* table = (const AcpiHpet*)acpi_find_table("HPET", 0);
+	if (!table || table->Address.AddressSpaceId != ACPI_SPACE_MEMORY || !table->Address.Address) {
+		serial_fwrite("HPET: not present");
+		return false;
+	}
+
+	volatile uint8_t* base = (volatile uint8_t*)vmm_map_mmio(table->Address.Address, 0x400);
+	if (!base) return false;
+
+	uint64_t cap = *(volatile uint64_t*)(base + HPET_REG_CAP);
+	uint64_t period = cap >> 32;
+	if (!period || period > HPET_MAX_PERIOD_FS) {
+		serial_fwrite("HPET: bad counter period %llu fs", period);
+		return false;
+	}
+
+	HpetBase = base;
+	HpetPeriodFs = period;
+	HpetTimerCount = (uint32_t)((cap >> 8) & 0x1F) + 1;
+	HpetCounter64 = (cap & HPET_CAP_COUNT_64) != 0;
+
+	/* Counter from zero, no legacy replacement routing: the PIT keeps IRQ 0 */
+	hpet_write(HPET_REG_CONFIG, hpet_read(HPET_REG_CONFIG) & ~(HPET_CONFIG_ENABLE | HPET_CONFIG_LEGACY));
+	hpet_write(HPET_REG_COUNTER, 0);
+	for (uint32_t n = 0; n < HpetTimerCount; n++)
+		hpet_write(HPET_TIMER_CONFIG(n), hpet_read(HPET_TIMER_CONFIG(n)) & ~HPET_TN_INT_ENABLE);
+	hpet_write(HPET_REG_CONFIG, hpet_read(HPET_REG_CONFIG) | HPET_CONFIG_ENABLE);
+
+	uint64_t hz = 1000000000000000ULL / period;
+	uint32_t fsb = 0;
+	for (uint32_t n = 0; n < HpetTimerCount; n++)
+		if (hpet_read(HPET_TIMER_CONFIG(n)) & HPET_TN_FSB_CAP) fsb++;
+
+	HpetClockSource.freq_hz = hz;
+	if (!HpetCounter64) HpetClockSource.mask = 0xFFFFFFFFULL;
+	/* 32-bit comparators wrap after 2^32 ticks; stay well inside half of that */
+	HpetClockEvent.max_delta_ns = HpetCounter64 ? (1ULL << 42) : ((1ULL << 30) * period) / 1000000ULL;
+
+	serial_fwrite("HPET: %llu Hz, %u-bit counter, %u comparators, %u with FSB delivery",
+				  hz, HpetCounter64 ? 64 : 32, HpetTimerCount, fsb);
+	clocksource_register(&HpetClockSource);
+	return true;
+}
@@ -0,0 +1,31 @@
+#ifndef IOAPIC_H
+#define IOAPIC_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * IOAPICs, as listed in the MADT. Once they are set up the ISA IRQs go
+ * through them instead of the 8259 PICs: each IRQ keeps its vector
+ * (0x20 + irq) but arrives on the GSI the interrupt source overrides
+ * name, with their polarity and trigger mode, at the boot CPU. The PICs
+ * are masked for good and an interrupt is acknowledged at the local APIC.
+ */
+
+/* After lapic_init() and madt_init(); false leaves the PICs in charge */
+bool ioapic_init(void);
+
+/* Whether legacy IRQs are routed through the IOAPICs */
+bool ioapic_active(void);
+
+/* Mask or unmask the GSI an ISA IRQ was routed to */
+void ioapic_irq_set_mask(uint8_t Irq, bool Masked);
+
+/*
+ * Route a GSI no ISA IRQ or other driver holds to Vector on the CPU with
+ * ApicId, unmasked, with ACPI_INTI_* polarity and trigger (0 is active
+ * high, edge). False if the GSI is taken or no active IOAPIC covers it.
+ */
+bool ioapic_route_gsi(uint32_t Gsi, uint8_t Vector, uint32_t ApicId, uint16_t Inti);
+
+#endif /* IOAPIC_H */
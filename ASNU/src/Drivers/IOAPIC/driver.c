@@ -0,0 +1,165 @@
+#include "../IOAPIC.h"
+#include <ACPI/acpi.h>
+#include <ACPI/madt.h>
+#include <VMM/vmm.h>
+#include <IDT/idt.h>
+#include <Serial/serial.h>
+#include <sync/spinlock.h>
+#include <Drivers/LAPIC.h>
+
+#define IOAPIC_REGSEL			0x00
+#define IOAPIC_WINDOW			0x10
+
+#define IOAPIC_REG_ID			0x00
+#define IOAPIC_REG_VERSION		0x01
+#define IOAPIC_REG_REDIR(n)		(0x10 + 2 * (n))
+
+#define IOAPIC_REDIR_POLARITY_LOW	(1 << 13)
+#define IOAPIC_REDIR_LEVEL			(1 << 15)
+#define IOAPIC_REDIR_MASKED			(1 << 16)
+
+#define IOAPIC_IRQ_VECTOR_BASE	0x20	/* where idt_pic_remap() put the ISA IRQs */
+
+typedef struct {
+	volatile uint32_t* Base;
+	uint32_t GsiBase;
+	uint32_t Pins;
+	uint32_t Used[8];		/* bitmap of pins routed to something, 256 at most */
+} IoApic;
+
+static IoApic IoApics[MADT_MAX_IOAPICS];
+static uint32_t IoApicCount = 0;
+static bool IoApicActive = false;
+
+/* Register select and window are one shared pair per IOAPIC */
+static Spinlock IoApicLock = SPINLOCK_INIT;
+
+static int8_t IsaIoApic[16];		/* which IOAPIC, -1 if no IOAPIC covers the GSI */
+static uint8_t IsaPin[16];
+
+static inline uint32_t ioapic_read(const IoApic* Io, uint32_t Reg) {
+	Io->Base[IOAPIC_REGSEL / 4] = Reg;
+	return Io->Base[IOAPIC_WINDOW / 4];
+}
+
+static inline void ioapic_write(const IoApic* Io, uint32_t Reg, uint32_t Value) {
+	Io->Base[IOAPIC_REGSEL / 4] = Reg;
+	Io->Base[IOAPIC_WINDOW / 4] = Value;
+}
+
+bool ioapic_active(void) {
+	return IoApicActive;
+}
+
+void ioapic_irq_set_mask(uint8_t Irq, bool Masked) {
+	if (Irq >= 16 || IsaIoApic[Irq] < 0) return;
+	const IoApic* io = &IoApics[IsaIoApic[Irq]];
+	uint32_t reg = IOAPIC_REG_REDIR(IsaPin[Irq]);
+
+	uint64_t flags = spin_lock_irqsave(&IoApicLock);
+	uint32_t low = ioapic_read(io, reg);
+	if (Masked) low |= IOAPIC_REDIR_MASKED;
+	else low &= ~IOAPIC_REDIR_MASKED;
+	ioapic_write(io, reg, low);
+	spin_unlock_irqrestore(&IoApicLock, flags);
+}
+
+static int32_t ioapic_for_gsi(uint32_t Gsi) {
+	for (uint32_t i = 0; i < IoApicCount; i++)
+		if (Gsi >= IoApics[i].GsiBase && Gsi < IoApics[i].GsiBase + IoApics[i].Pins)
+			return (int32_t)i;
+	return -1;
+}
+
+/* Fixed delivery, physical destination; active high and edge triggered unless the flags say otherwise */
+static uint32_t ioapic_redir_low(uint8_t Vector, uint16_t Inti) {
+	uint32_t low = Vector;
+	if ((Inti & ACPI_INTI_POLARITY_MASK) == ACPI_INTI_POLARITY_LOW) low |= IOAPIC_REDIR_POLARITY_LOW;
+	if ((Inti & ACPI_INTI_TRIGGER_MASK) == ACPI_INTI_TRIGGER_LEVEL) low |= IOAPIC_REDIR_LEVEL;
+	return low;
+}
+
+bool ioapic_init(void) {
+	const MadtInfo* madt = madt_get();
+	if (!madt || !madt->IoApicCount) {
+		serial_fwrite("IOAPIC: none, staying on the 8259 PICs");
+		return false;
+	}
+
+	for (uint32_t i = 0; i < madt->IoApicCount; i++) {
+		volatile uint32_t* base = (volatile uint32_t*)vmm_map_mmio(madt->IoApics[i].Phys, 0x20);
+		if (!base) continue;
+		IoApic* io = &IoApics[IoApicCount++];
+		io->Base = base;
+		io->GsiBase = madt->IoApics[i].GsiBase;
+		io->Pins = ((ioapic_read(io, IOAPIC_REG_VERSION) >> 16) & 0xFF) + 1;
+
+		/* Nothing the firmware left behind fires until a driver asks for it */
+		for (uint32_t pin = 0; pin < io->Pins; pin++)
+			ioapic_write(io, IOAPIC_REG_REDIR(pin), IOAPIC_REDIR_MASKED);
+
+		serial_fwrite("IOAPIC: id %u, GSIs %u-%u", madt->IoApics[i].Id, io->GsiBase, io->GsiBase + io->Pins - 1);
+	}
+	if (!IoApicCount) return false;
+
+	/* The destination field holds an 8-bit APIC ID; a higher one would need interrupt remapping */
+	uint32_t bsp = lapic_get_id();
+	if (bsp > 0xFF) {
+		serial_fwrite("IOAPIC: boot CPU APIC ID %u is out of reach, staying on the 8259 PICs", bsp);
+		return false;
+	}
+
+	uint64_t flags = irq_save();
+
+	/* Lines the PICs had open stay open; then the PICs go quiet for good */
+	uint16_t open = (uint16_t)~idt_pic_disable();
+
+	/* An override moves an IRQ onto another's GSI (IRQ 0 onto 2, typically); that GSI is then taken */
+	uint32_t taken = 0;
+	for (uint8_t irq = 0; irq < 16; irq++)
+		if (madt->Isa[irq].Gsi != irq && madt->Isa[irq].Gsi < 16) taken |= 1U << madt->Isa[irq].Gsi;
+
+	for (uint8_t irq = 0; irq < 16; irq++) {
+		const MadtIsaRoute* route = &madt->Isa[irq];
+		/* The cascade input has no device behind it */
+		int32_t n = -1;
+		if (irq != 2 && !(route->Gsi == irq && (taken & (1U << irq))))
+			n = ioapic_for_gsi(route->Gsi);
+		IsaIoApic[irq] = (int8_t)n;
+		if (n < 0) continue;
+
+		const IoApic* io = &IoApics[n];
+		IsaPin[irq] = (uint8_t)(route->Gsi - io->GsiBase);
+		IoApics[n].Used[IsaPin[irq] / 32] |= 1U << (IsaPin[irq] % 32);
+		uint32_t low = ioapic_redir_low(IOAPIC_IRQ_VECTOR_BASE + irq, route->Flags);
+		if (!(open & (1 << irq))) low |= IOAPIC_REDIR_MASKED;
+		ioapic_write(io, IOAPIC_REG_REDIR(IsaPin[irq]) + 1, bsp << 24);
+		ioapic_write(io, IOAPIC_REG_REDIR(IsaPin[irq]), low);
+	}
+
+	IoApicActive = true;
+	/* The PICs reach the local APIC through LINT0 as ExtINT; that path is shut now */
+	lapic_setup_lint();
+
+	irq_restore(flags);
+	serial_fwrite("IOAPIC: ISA IRQs routed to APIC ID %u, 8259 PICs masked", bsp);
+	return true;
+}
+
+bool ioapic_route_gsi(uint32_t Gsi, uint8_t Vector, uint32_t ApicId, uint16_t Inti) {
+	if (!IoApicActive || ApicId > 0xFF) return false;
+	int32_t n = ioapic_for_gsi(Gsi);
+	if (n < 0) return false;
+	IoApic* io = &IoApics[n];
+	uint32_t pin = Gsi - io->GsiBase;
+
+	uint64_t flags = spin_lock_irqsave(&IoApicLock);
+	bool free = !(io->Used[pin / 32] & (1U << (pin % 32)));
+	if (free) {
+		io->Used[pin / 32] |= 1U << (pin % 32);
+		ioapic_write(io, IOAPIC_REG_REDIR(pin) + 1, ApicId << 24);
+		ioapic_write(io, IOAPIC_REG_REDIR(pin), ioapic_redir_low(Vector, Inti));
+	}
+	spin_unlock_irqrestore(&IoApicLock, flags);
+	return free;
+}
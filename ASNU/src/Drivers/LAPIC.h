@@ -0,0 +1,57 @@
+#ifndef LAPIC_H
+#define LAPIC_H 1
+
+#include <KiSimple.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time/clockevent.h>
+
+/* xAPIC register offsets; in x2APIC mode register r is MSR 0x800 + r / 16 */
+#define LAPIC_REG_ID			0x020
+#define LAPIC_REG_TPR			0x080
+#define LAPIC_REG_EOI			0x0B0
+#define LAPIC_REG_SVR			0x0F0
+#define LAPIC_REG_ICR_LOW		0x300
+#define LAPIC_REG_ICR_HIGH		0x310
+#define LAPIC_REG_LVT_TIMER		0x320
+#define LAPIC_REG_LVT_LINT0		0x350
+#define LAPIC_REG_LVT_LINT1		0x360
+#define LAPIC_REG_TIMER_INIT	0x380
+#define LAPIC_REG_TIMER_CUR		0x390
+#define LAPIC_REG_TIMER_DIV		0x3E0
+
+#define LAPIC_SVR_ENABLE		(1 << 8)
+#define LAPIC_LVT_MASKED		(1 << 16)
+#define LAPIC_TIMER_PERIODIC	(1 << 17)
+#define LAPIC_TIMER_TSC_DEADLINE	(2 << 17)
+#define LAPIC_ICR_PENDING		(1 << 12)
+#define LAPIC_LVT_NMI			(4 << 8)
+#define LAPIC_LVT_ACTIVE_LOW	(1 << 13)
+
+#define LAPIC_BASE_ENABLE		(1 << 11)
+#define LAPIC_BASE_X2APIC		(1 << 10)
+#define LAPIC_X2APIC_MSR_BASE	0x800
+
+/* Vectors above the legacy IRQ range, see IDT_APIC_VECTOR_BASE */
+#define LAPIC_TIMER_VECTOR		0xEF
+#define LAPIC_RESCHED_VECTOR	0xF0
+#define LAPIC_SPURIOUS_VECTOR	0xFF
+
+void lapic_init(void);
+void lapic_init_ap(void);
+uint32_t lapic_get_id(void);
+/* LINT0 masked once the IOAPICs carry the ISA IRQs, LINT1 (or whichever the MADT names) as NMI */
+void lapic_setup_lint(void);
+void lapic_eoi(void);
+void lapic_send_ipi(uint32_t LapicId, uint8_t Vector);
+void lapic_timer_periodic(uint32_t Freq);
+void lapic_timer_oneshot(uint64_t DeltaNs);
+void lapic_timer_stop(void);
+
+extern ClockEvent LapicClockEvent;
+extern ClockEvent LapicDeadlineClockEvent;
+
+/* TSC-deadline mode where the CPU has it, else the one-shot timer calibrated against the PIT */
+const ClockEvent* lapic_clock_event(void);
+
+#endif /* LAPIC_H */
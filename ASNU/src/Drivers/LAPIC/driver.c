@@ -0,0 +1,230 @@
+#include "../LAPIC.h"
+#include <Drivers/PIT.h>
+#include <VMM/vmm.h>
+#include <IDT/idt.h>
+#include <Serial/serial.h>
+#include <time/tick.h>
+#include <time/clocksource.h>
+#include <ACPI/acpi.h>
+#include <ACPI/madt.h>
+#include <Drivers/IOAPIC.h>
+
+static volatile uint32_t* LapicBase = NULL;
+
+/* CPUID.1:ECX[21]: registers are MSRs, APIC IDs are 32 bits wide and the ICR is one write */
+static bool LapicX2 = false;
+
+/* Timer input clock, timer ticks per millisecond at divide-by-16 */
+static uint32_t LapicTicksPerMs = 0;
+
+/* CPUID.1:ECX[24], the timer can fire at an absolute TSC value */
+static bool LapicTscDeadline = false;
+
+/* Without CPUID.6:EAX[2] (always running APIC timer) the timer may stop in C-states below C1 */
+#define LAPIC_RATING_DEADLINE	150
+#define LAPIC_RATING_ARAT		100
+#define LAPIC_RATING_NO_ARAT	60
+
+#define LAPIC_CALIBRATE_TICKS 10
+
+static inline uint32_t lapic_read(uint32_t Reg) {
+	if (LapicX2) return (uint32_t)rdmsr(LAPIC_X2APIC_MSR_BASE + Reg / 16);
+	return LapicBase[Reg / 4];
+}
+
+static inline void lapic_write(uint32_t Reg, uint32_t Value) {
+	if (LapicX2) wrmsr(LAPIC_X2APIC_MSR_BASE + Reg / 16, Value);
+	else LapicBase[Reg / 4] = Value;
+}
+
+uint32_t lapic_get_id(void) {
+	if (LapicX2) return lapic_read(LAPIC_REG_ID);
+	return lapic_read(LAPIC_REG_ID) >> 24;
+}
+
+void lapic_eoi(void) {
+	lapic_write(LAPIC_REG_EOI, 0);
+}
+
+void lapic_send_ipi(uint32_t LapicId, uint8_t Vector) {
+	/* Destination in the high half; there is no delivery status to wait on */
+	if (LapicX2) {
+		wrmsr(LAPIC_X2APIC_MSR_BASE + LAPIC_REG_ICR_LOW / 16, ((uint64_t)LapicId << 32) | Vector);
+		return;
+	}
+
+	uint64_t flags = irq_save();
+	while (lapic_read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING)
+		asm volatile ("pause");
+	lapic_write(LAPIC_REG_ICR_HIGH, LapicId << 24);
+	lapic_write(LAPIC_REG_ICR_LOW, Vector);	/* fixed delivery, physical destination */
+	irq_restore(flags);
+}
+
+static void lapic_timer_handler(TrapFrame* frame) {
+	(void)frame;
+
+	/* Acknowledge first: the tick may switch away and resume another task */
+	lapic_eoi();
+
+	tick_handle();
+}
+
+static void lapic_resched_handler(TrapFrame* frame) {
+	(void)frame;
+
+	/* The remote CPU already set need_resched; irq_dispatch acts on it */
+	lapic_eoi();
+}
+
+static void lapic_spurious_handler(TrapFrame* frame) {
+	(void)frame;	/* spurious interrupts are not acknowledged */
+}
+
+/* x2APIC mode can only be entered from the enabled xAPIC state, never left without a reset */
+static void lapic_enable(void) {
+	uint64_t base = rdmsr(MSR_APIC_BASE);
+	if (!(base & LAPIC_BASE_ENABLE)) {
+		base |= LAPIC_BASE_ENABLE;
+		wrmsr(MSR_APIC_BASE, base);
+	}
+	if (LapicX2 && !(base & LAPIC_BASE_X2APIC))
+		wrmsr(MSR_APIC_BASE, base | LAPIC_BASE_X2APIC);
+	lapic_write(LAPIC_REG_TPR, 0);
+	lapic_write(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+void lapic_setup_lint(void) {
+	if (ioapic_active())
+		lapic_write(LAPIC_REG_LVT_LINT0, LAPIC_LVT_MASKED);
+
+	const MadtInfo* madt = madt_get();
+	if (!madt) return;
+	uint32_t uid = madt_cpu_uid(lapic_get_id());
+	for (uint32_t i = 0; i < madt->NmiCount; i++) {
+		const MadtNmi* nmi = &madt->Nmis[i];
+		if ((nmi->Uid != MADT_ALL_CPUS && nmi->Uid != uid) || nmi->Lint > 1) continue;
+		uint32_t lvt = LAPIC_LVT_NMI;	/* NMIs are always edge triggered */
+		if ((nmi->Flags & ACPI_INTI_POLARITY_MASK) == ACPI_INTI_POLARITY_LOW) lvt |= LAPIC_LVT_ACTIVE_LOW;
+		lapic_write(nmi->Lint ? LAPIC_REG_LVT_LINT1 : LAPIC_REG_LVT_LINT0, lvt);
+	}
+}
+
+/* Count timer ticks over a few PIT periods; needs the PIT interrupt running */
+static void lapic_timer_calibrate(void) {
+	uint32_t freq = pit_get_frequency();
+	if (!freq) return;
+
+	lapic_write(LAPIC_REG_TIMER_DIV, 0x3);	/* divide by 16 */
+	lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED);
+
+	pit_spin_ticks(1);
+	lapic_write(LAPIC_REG_TIMER_INIT, 0xFFFFFFFF);
+	pit_spin_ticks(LAPIC_CALIBRATE_TICKS);
+	uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_REG_TIMER_CUR);
+	lapic_write(LAPIC_REG_TIMER_INIT, 0);
+
+	LapicTicksPerMs = (uint32_t)(((uint64_t)elapsed * freq) / (LAPIC_CALIBRATE_TICKS * 1000ULL));
+	if (LapicTicksPerMs)
+		LapicClockEvent.max_delta_ns = (0xFFFFFFFFULL * 1000000ULL) / LapicTicksPerMs;
+	serial_fwrite("LAPIC timer: %u ticks/ms", LapicTicksPerMs);
+}
+
+/* Boot CPU: pick x2APIC or map the registers, enable the local APIC and calibrate its timer */
+void lapic_init(void) {
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+	LapicTscDeadline = (ecx >> 24) & 1;
+	/* The bootloader may have switched already, and there is no way back */
+	LapicX2 = ((ecx >> 21) & 1) || (rdmsr(MSR_APIC_BASE) & LAPIC_BASE_X2APIC);
+
+	if (!LapicX2) {
+		uint64_t phys = rdmsr(MSR_APIC_BASE) & 0xFFFFF000ULL;
+		LapicBase = (volatile uint32_t*)vmm_map_mmio(phys, 0x1000);
+	}
+
+	idt_set_vector_handler(LAPIC_TIMER_VECTOR, lapic_timer_handler);
+	idt_set_vector_handler(LAPIC_RESCHED_VECTOR, lapic_resched_handler);
+	idt_set_vector_handler(LAPIC_SPURIOUS_VECTOR, lapic_spurious_handler);
+
+	lapic_enable();
+	lapic_setup_lint();
+	lapic_timer_calibrate();
+	serial_fwrite("LAPIC: %s mode, APIC ID %u", LapicX2 ? "x2APIC" : "xAPIC", lapic_get_id());
+
+	bool arat = false;
+	cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+	if (eax >= 6) {
+		cpuid(6, 0, &eax, &ebx, &ecx, &edx);
+		arat = (eax >> 2) & 1;
+	}
+	if (LapicTicksPerMs)
+		LapicClockEvent.rating = arat ? LAPIC_RATING_ARAT : LAPIC_RATING_NO_ARAT;
+}
+
+/* Application processors: same mode, register page and calibration as the boot CPU */
+void lapic_init_ap(void) {
+	lapic_enable();
+	lapic_setup_lint();
+}
+
+void lapic_timer_periodic(uint32_t Freq) {
+	if (!Freq || !LapicTicksPerMs) return;
+	lapic_write(LAPIC_REG_TIMER_DIV, 0x3);
+	lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_PERIODIC | LAPIC_TIMER_VECTOR);
+	lapic_write(LAPIC_REG_TIMER_INIT, (uint32_t)(((uint64_t)LapicTicksPerMs * 1000) / Freq));
+}
+
+void lapic_timer_oneshot(uint64_t DeltaNs) {
+	uint64_t count = (DeltaNs * LapicTicksPerMs) / 1000000ULL;
+	if (DeltaNs > LapicClockEvent.max_delta_ns || count > 0xFFFFFFFF) count = 0xFFFFFFFF;
+	if (count == 0) count = 1;
+	lapic_write(LAPIC_REG_TIMER_DIV, 0x3);
+	lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_VECTOR);
+	lapic_write(LAPIC_REG_TIMER_INIT, (uint32_t)count);
+}
+
+void lapic_timer_stop(void) {
+	lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED);
+	lapic_write(LAPIC_REG_TIMER_INIT, 0);
+}
+
+/*
+ * TSC-deadline mode: the timer fires once the TSC reaches the value in
+ * IA32_TSC_DEADLINE, so a one-shot is a single MSR write with TSC
+ * resolution and no divider or 32-bit count to run out. There is no
+ * periodic mode; the tick re-arms it every period instead.
+ */
+static void lapic_deadline_oneshot(uint64_t DeltaNs) {
+	lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_TSC_DEADLINE | LAPIC_TIMER_VECTOR);
+	/* The mode switch must land before the MSR write arms the timer */
+	asm volatile ("mfence" : : : "memory");
+	wrmsr(MSR_TSC_DEADLINE, rdtsc() + tick_ns_to_tsc(DeltaNs));
+}
+
+static void lapic_deadline_stop(void) {
+	wrmsr(MSR_TSC_DEADLINE, 0);
+	lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED);
+}
+
+const ClockEvent* lapic_clock_event(void) {
+	return LapicTscDeadline && clocksource_tsc_stable() ? &LapicDeadlineClockEvent : &LapicClockEvent;
+}
+
+ClockEvent LapicDeadlineClockEvent = {
+	.name = "lapic-deadline",
+	.rating = LAPIC_RATING_DEADLINE,
+	.max_delta_ns = 1ULL << 42,	/* over an hour; keeps the TSC conversion far from overflow */
+	.set_periodic = NULL,
+	.set_oneshot = lapic_deadline_oneshot,
+	.shutdown = lapic_deadline_stop,
+};
+
+ClockEvent LapicClockEvent = {
+	.name = "lapic",
+	.rating = 0,		/* set once calibrated */
+	.max_delta_ns = 0,
+	.set_periodic = lapic_timer_periodic,
+	.set_oneshot = lapic_timer_oneshot,
+	.shutdown = lapic_timer_stop,
+};
@@ -4,16 +4,25 @@
 #include <KiSimple.h>
 #include <IDT/idt.h>
 #include <stdint.h>
+#include <time/clocksource.h>
 
 #define PIT_FREQ			1193182
 #define PIT_CMD_PORT		0x43
 #define PIT_CHANNEL0_PORT	0x40
 
 void pit_init(uint32_t Freq);
+void pit_stop(void);
+void pit_resume(void);
 uint64_t pit_get_ticks();
+uint32_t pit_get_frequency();
+uint64_t pit_spin_ticks(uint64_t Ticks);
 uint64_t pit_wait_ticks(uint64_t Ticks);
 void pit_wait_ms(uint64_t Ms);
 
-__attribute__((interrupt)) void pit_handler(int *__unused);
+/* Periods counted by the interrupt plus the latched count: the clock of last resort */
+extern ClockSource PitClockSource;
+
+struct TrapFrame;
+void pit_handler(struct TrapFrame* frame);
 
 #endif /* PIT_H */
@@ -1,39 +1,105 @@
 #include "../PIT.h"
-#include <sched/scheduler.h>
+#include <time/tick.h>
+#include <time/timer.h>
+#include <sync/spinlock.h>
 
 static volatile uint64_t PitTicks = 0;
 
-__attribute__((interrupt)) void pit_handler(int *__unused) {
-	(void)__unused;
+void pit_handler(TrapFrame* frame) {
+	(void)frame;
 
 	PitTicks++;
 
-	scheduler_tick();
-
-	idt_pic_send_eoi(0);
+	idt_irq_eoi(0);
 }
 
 static volatile uint64_t PitTickFreq = 0;
+static volatile uint32_t PitDivisor = 0;
 
-void pit_init(uint32_t Freq) {
-	uint32_t divisor = PIT_FREQ / Freq;
-	outb(PIT_CMD_PORT, 0x36);
+static Spinlock PitLock = SPINLOCK_INIT;
+static uint64_t PitLastCycles = 0;
+
+/* Mode 2, rate generator: unlike the square wave mode the count falls by one per input cycle */
+static void pit_program(uint32_t divisor) {
+	outb(PIT_CMD_PORT, 0x34);
 	outb(PIT_CHANNEL0_PORT, (uint8_t)(divisor & 0xFF));
 	outb(PIT_CHANNEL0_PORT, (uint8_t)((divisor >> 8) & 0xFF));
+}
+
+void pit_init(uint32_t Freq) {
+	PitDivisor = PIT_FREQ / Freq;
+	pit_program(PitDivisor);
 	PitTickFreq = Freq;
+	clocksource_register(&PitClockSource);
+}
+
+/* Once the local APIC timers drive the tick the PIT is only needed for calibration */
+void pit_stop(void) {
+	idt_irq_set_mask(0);
+	outb(PIT_CMD_PORT, 0x30);	/* channel 0, mode 0: one interrupt at terminal count, then silent */
+	outb(PIT_CHANNEL0_PORT, 0);
+	outb(PIT_CHANNEL0_PORT, 0);
+}
+
+/* Back to periodic interrupts, for when the PIT has to be the kernel clock again */
+void pit_resume(void) {
+	if (!PitDivisor) return;
+	pit_program(PitDivisor);
+	idt_irq_clear_mask(0);
 }
 
+/* Input clock cycles: whole periods counted by the interrupt plus the way into the current one */
+static uint64_t pit_clocksource_read(void) {
+	uint64_t flags = spin_lock_irqsave(&PitLock);
+	uint64_t ticks;
+	uint16_t count;
+	do {
+		ticks = PitTicks;
+		outb(PIT_CMD_PORT, 0x00);	/* latch channel 0 */
+		count = inb(PIT_CHANNEL0_PORT);
+		count |= (uint16_t)inb(PIT_CHANNEL0_PORT) << 8;
+	} while (ticks != PitTicks);
+
+	uint64_t cycles = ticks * PitDivisor + (PitDivisor - count);
+	/* A wrap whose interrupt is still pending reads a period short: never go back */
+	if (cycles < PitLastCycles) cycles = PitLastCycles;
+	PitLastCycles = cycles;
+	spin_unlock_irqrestore(&PitLock, flags);
+	return cycles;
+}
+
+ClockSource PitClockSource = {
+	.name = "pit",
+	.rating = 100,
+	.read = pit_clocksource_read,
+	.mask = ~0ULL,
+	.freq_hz = PIT_FREQ,
+	.enable = pit_resume,
+};
+
 uint64_t pit_get_ticks() {
 	return PitTicks;
 }
 
-uint64_t pit_wait_ticks(uint64_t Ticks) {
+uint32_t pit_get_frequency() {
+	return (uint32_t)PitTickFreq;
+}
+
+/* Busy-waits on PIT interrupts; only for calibrating other clocks before pit_stop() */
+uint64_t pit_spin_ticks(uint64_t Ticks) {
 	uint64_t start = pit_get_ticks();
-	while ((pit_get_ticks() - start) < Ticks);
+	while ((pit_get_ticks() - start) < Ticks)
+		asm volatile ("pause");
 	return pit_get_ticks();
 }
 
+/* Both sleep on a kernel timer now; counted in jiffies, which keep going after pit_stop() */
+uint64_t pit_wait_ticks(uint64_t Ticks) {
+	if (PitTickFreq)
+		sleep_ns(Ticks * (1000000000ULL / PitTickFreq));
+	return tick_get_jiffies();
+}
+
 void pit_wait_ms(uint64_t Ms) {
-	uint64_t ticks = (Ms * PitTickFreq) / 1000;
-	pit_wait_ticks(ticks);
+	sleep_ns(Ms * 1000000ULL);
 }
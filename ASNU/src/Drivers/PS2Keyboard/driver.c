@@ -1,6 +1,7 @@
 #include <KiSimple.h>
 #include <PMM/pmm.h>
 #include <IDT/idt.h>
+#include <sync/waitqueue.h>
 
 #define KBD_BUF_SIZE 65535
 
@@ -9,10 +10,11 @@ volatile uint16_t kbd_buf_head = 0;
 volatile uint16_t kbd_buf_tail = 0;
 bool buffering_read = false;
 int cursor_read = 0;
+static WaitQueue kbd_wait = WAITQUEUE_INIT;
 
 int kbd_getc() {
     buffering_read = true;
-    while (kbd_buf_head == kbd_buf_tail);
+    wait_event(&kbd_wait, kbd_buf_head != kbd_buf_tail);
     char c = kbd_drvr_buf[kbd_buf_tail];
     kbd_buf_tail = (kbd_buf_tail + 1) % KBD_BUF_SIZE;
     buffering_read = false;
@@ -67,6 +69,7 @@ static void KbdPushback(char c) {
     if (next != kbd_buf_tail) {
         kbd_drvr_buf[kbd_buf_head] = c;
         kbd_buf_head = next;
+        wake_up_all(&kbd_wait);
     } else {
         OverflowKbdBfr();
     }
@@ -3,10 +3,10 @@
 #include <KiSimple.h>
 #include <IDT/idt.h>
 #include <VMM/vmm.h>
+#include <sched/coroutine.h>
 #include <stdint.h>
 #include <stddef.h>
 
-#define XHCI_IRQ_VECTOR        0x51
 #define XHCI_CAPLENGTH         0x00
 #define XHCI_DBOFF             0x14
 #define XHCI_RTSOFF            0x18
@@ -18,6 +18,10 @@
 #define XHCI_PORT_COUNT        8
 #define XHCI_TRB_RING_SIZE     16
 
+#define XHCI_CMD_RUN           (1 << 0)
+#define XHCI_STS_HCH           (1 << 0)
+#define XHCI_HALT_TIMEOUT_NS   16000000ULL  /* the spec allows 16 ms to halt or start */
+
 #define TRB_TYPE_PORT_STATUS_CHANGE 0x20
 #define TRB_TYPE_TRANSFER_EVENT     0x21
 
@@ -45,6 +49,7 @@ static TrbRing_t EventRing;
 static ErstEntry_t ErstTable __attribute__((aligned(64)));
 static uint8_t HaveKeyboard = 0;
 static uint8_t HaveMouse = 0;
+static Coroutine XhciStartCo;
 
 static inline void MmioWrite32(uint32_t offset, uint32_t val) {
     *(volatile uint32_t*)((uintptr_t)XhciMmioBase + offset) = val;
@@ -65,7 +70,7 @@ static const char* DecodePortSpeed(uint32_t speed) {
     }
 }
 
-static void XhciIrqHandler(void) {
+static void XhciHandleEvent(void) {
     volatile uint64_t* trb = &EventRing.ring[EventRing.index];
     uint32_t trbType = (trb[2] >> 10) & 0x3F;
     uint8_t cycle = trb[2] & 1;
@@ -103,28 +108,27 @@ static void XhciIrqHandler(void) {
 
     volatile uint32_t* iman = (volatile uint32_t*)((uintptr_t)XhciRuntimeBase + 0x20);
     iman[0] |= 0x1;
-
-    KiPicSendEoi(XhciIrqLine);
 }
 
-void xHciInit(PciDevice_t* UsbController) {
-    XhciMmioBase = UsbController->MMIOBase;
-    XhciIrqLine = UsbController->interrupt_line;
-
-    for (uintptr_t addr = (uintptr_t)XhciMmioBase; addr < (uintptr_t)XhciMmioBase + 0x10000; addr += 0x1000)
-        KiMMap((void*)addr, (void*)addr, PAGE_PRESENT | PAGE_RW);
-
-    uint32_t capLength = *(volatile uint8_t*)(XhciMmioBase + XHCI_CAPLENGTH);
-    uint32_t dboff = *(volatile uint32_t*)(XhciMmioBase + XHCI_DBOFF);
-    uint32_t rtsoff = *(volatile uint32_t*)(XhciMmioBase + XHCI_RTSOFF);
-
-    XhciRuntimeBase = (void*)((uintptr_t)XhciMmioBase + (rtsoff & ~0x1F));
-    XhciDoorbellBase = (void*)((uintptr_t)XhciMmioBase + (dboff & ~0x3));
-
-    printk("xHCI MMIO = %p, RT = %p, DB = %p, IRQ = %u\n", XhciMmioBase, XhciRuntimeBase, XhciDoorbellBase, XhciIrqLine);
+static void XhciIrqHandler(TrapFrame* frame) {
+    (void)frame;
+    XhciHandleEvent();
+    idt_irq_eoi(XhciIrqLine);
+}
 
-    MmioWrite32(XHCI_USBCMD, MmioRead32(XHCI_USBCMD) & ~1);
-    while (MmioRead32(XHCI_USBSTS) & 1);
+/*
+ * Bring-up after the registers are mapped: halt, program the event ring,
+ * run. Waiting on the halted bit is a coroutine so boot goes on meanwhile.
+ */
+static int XhciStart(Coroutine* co) {
+    CO_BEGIN(co);
+
+    MmioWrite32(XHCI_USBCMD, MmioRead32(XHCI_USBCMD) & ~XHCI_CMD_RUN);
+    co_await_timeout(co, NULL, MmioRead32(XHCI_USBSTS) & XHCI_STS_HCH, XHCI_HALT_TIMEOUT_NS);
+    if (co->timed_out) {
+        printk("xHCI controller did not halt\n");
+        CO_EXIT(co);
+    }
 
     EventRing.phys = (uintptr_t)&EventRing.ring;
     EventRing.cycle = 1;
@@ -148,10 +152,39 @@ void xHciInit(PciDevice_t* UsbController) {
     MmioWrite32(XHCI_DCBAAP + 4, 0);
 
     MmioWrite32(XHCI_CONFIG, 1);
-    MmioWrite32(XHCI_USBCMD, MmioRead32(XHCI_USBCMD) | 1);
+    MmioWrite32(XHCI_USBCMD, MmioRead32(XHCI_USBCMD) | XHCI_CMD_RUN);
+
+    /* The firmware's PIC-mode line; only the ISA range has a vector */
+    if (XhciIrqLine < 16) {
+        idt_set_irq_handler(XhciIrqLine, XhciIrqHandler);
+        idt_irq_clear_mask(XhciIrqLine);
+    }
 
-    idt_set_desc(XHCI_IRQ_VECTOR, XhciIrqHandler, 0x8E);
-    idt_irq_clear_mask(XHCI_IRQ_VECTOR);
+    co_await_timeout(co, NULL, !(MmioRead32(XHCI_USBSTS) & XHCI_STS_HCH), XHCI_HALT_TIMEOUT_NS);
+    if (co->timed_out) {
+        printk("xHCI controller did not start\n");
+        CO_EXIT(co);
+    }
 
     printk("xHCI controller started\n");
+    CO_END(co);
+}
+
+void xHciInit(PciDevice_t* UsbController) {
+    XhciMmioBase = UsbController->MMIOBase;
+    XhciIrqLine = UsbController->interrupt_line;
+
+    for (uintptr_t addr = (uintptr_t)XhciMmioBase; addr < (uintptr_t)XhciMmioBase + 0x10000; addr += 0x1000)
+        KiMMap((void*)addr, (void*)addr, PAGE_PRESENT | PAGE_RW);
+
+    uint32_t capLength = *(volatile uint8_t*)(XhciMmioBase + XHCI_CAPLENGTH);
+    uint32_t dboff = *(volatile uint32_t*)(XhciMmioBase + XHCI_DBOFF);
+    uint32_t rtsoff = *(volatile uint32_t*)(XhciMmioBase + XHCI_RTSOFF);
+
+    XhciRuntimeBase = (void*)((uintptr_t)XhciMmioBase + (rtsoff & ~0x1F));
+    XhciDoorbellBase = (void*)((uintptr_t)XhciMmioBase + (dboff & ~0x3));
+
+    printk("xHCI MMIO = %p, RT = %p, DB = %p, IRQ = %u\n", XhciMmioBase, XhciRuntimeBase, XhciDoorbellBase, XhciIrqLine);
+
+    co_start(&XhciStartCo, XhciStart, NULL);
 }
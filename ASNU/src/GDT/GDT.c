@@ -1,4 +1,5 @@
 #include "GDT.h"
+#include <string.h>
 
 __attribute__((aligned(0x1000)))
 GDT DefaultGDT = {
@@ -8,12 +9,53 @@ GDT DefaultGDT = {
     {0, 0, 0, 0x00, 0x00, 0}, // 0x18: Null
     {0, 0, 0, 0xFA, 0x20, 0}, // 0x20: User Code (exec, ring 3)
     {0, 0, 0, 0xF2, 0x20, 0}, // 0x28: User Data (rw, ring 3)
+    {0, 0, 0, 0x00, 0x00, 0}, // 0x30: TSS, filled in by gdt_init_cpu()
+    {0, 0, 0, 0x00, 0x00, 0},
 };
 
-__attribute__((aligned(0x1000))) GDTDescriptor gdtDescriptor;
+/* The boot CPU's TSS; application processors bring their own */
+static TSS DefaultTSS;
+
+static void gdt_set_tss(GDT* gdt, TSS* tss) {
+    uint64_t base = (uint64_t)tss;
+    uint32_t limit = sizeof(TSS) - 1;
+
+    gdt->TssLow.Limit0 = limit & 0xFFFF;
+    gdt->TssLow.Base0 = base & 0xFFFF;
+    gdt->TssLow.Base1 = (base >> 16) & 0xFF;
+    gdt->TssLow.AccessByte = 0x89; // present, 64-bit TSS (available)
+    gdt->TssLow.Limit1_Flags = (limit >> 16) & 0x0F;
+    gdt->TssLow.Base2 = (base >> 24) & 0xFF;
+
+    gdt->TssHigh.Limit0 = (base >> 32) & 0xFFFF;
+    gdt->TssHigh.Base0 = (base >> 48) & 0xFFFF;
+    gdt->TssHigh.Base1 = 0;
+    gdt->TssHigh.AccessByte = 0;
+    gdt->TssHigh.Limit1_Flags = 0;
+    gdt->TssHigh.Base2 = 0;
+}
+
+/*
+ * Load a GDT built from DefaultGDT plus the given TSS on the calling CPU.
+ * Reloading the segment registers clears the GS base, so per-CPU data has
+ * to be installed afterwards.
+ */
+void gdt_init_cpu(GDT* gdt, TSS* tss) {
+    if (gdt != &DefaultGDT)
+        memcpy(gdt, &DefaultGDT, sizeof(GDT));
+
+    memset(tss, 0, sizeof(TSS));
+    tss->IopbOffset = sizeof(TSS);
+    gdt_set_tss(gdt, tss);
+
+    GDTDescriptor descriptor;
+    descriptor.Size = sizeof(GDT) - 1;
+    descriptor.Offset = (uint64_t)gdt;
+    load_gdt(&descriptor);
+
+    asm volatile ("ltr %0" : : "r"((uint16_t)GDT_OFFSET_TSS));
+}
 
 void gdt_init() {
-    gdtDescriptor.Size = sizeof(GDT) - 1;
-    gdtDescriptor.Offset = (uint64_t)&DefaultGDT;
-    load_gdt(&gdtDescriptor);
+    gdt_init_cpu(&DefaultGDT, &DefaultTSS);
 }
\ No newline at end of file
@@ -18,6 +18,16 @@ typedef struct GDTEntry {
     uint8_t Base2;
 }__attribute__((packed)) GDTEntry;
 
+typedef struct TSS {
+    uint32_t Reserved0;
+    uint64_t Rsp[3];
+    uint64_t Reserved1;
+    uint64_t Ist[7];
+    uint64_t Reserved2;
+    uint16_t Reserved3;
+    uint16_t IopbOffset;
+} __attribute__((packed)) TSS;
+
 typedef struct GDT {
     GDTEntry Null; //0x00
     GDTEntry KernelCode; //0x08
@@ -25,13 +35,18 @@ typedef struct GDT {
     GDTEntry UserNull;
     GDTEntry UserCode;
     GDTEntry UserData;
+    GDTEntry TssLow; //0x30, 16-byte system descriptor
+    GDTEntry TssHigh;
 } __attribute__((packed)) 
 __attribute((aligned(0x1000))) GDT;
 
+#define GDT_OFFSET_TSS 0x30
+
 extern GDT DefaultGDT;
 
 extern void load_gdt(GDTDescriptor* gdtDescriptor);
 
 void gdt_init();
+void gdt_init_cpu(GDT* gdt, TSS* tss);
 
 #endif /* GDT_H */
\ No newline at end of file
@@ -1,28 +1,104 @@
+; Every stub builds the same TrapFrame (see IDT/idt.h): the CPU-pushed iret
+; frame, an error code (0 when the CPU pushes none), the vector and all
+; general purpose registers.
+
+%macro push_regs 0
+    push rax
+    push rbx
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push rbp
+    push r8
+    push r9
+    push r10
+    push r11
+    push r12
+    push r13
+    push r14
+    push r15
+%endmacro
+
+%macro pop_regs 0
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rbp
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rbx
+    pop rax
+%endmacro
+
 %macro isr_err_stub 1
 global isr_stub_%+%1
 isr_stub_%+%1:
-    pop rsi          ; error code → rsi
-    push rdi
-    mov rdi, %1      ; exception number → rdi
-    call exception_handler
-    pop rdi
-    iretq
+    push %1          ; error code already pushed by the CPU
+    jmp isr_common
 %endmacro
 
 %macro isr_no_err_stub 1
 global isr_stub_%+%1
 isr_stub_%+%1:
-    push rsi
-    push rdi
-    xor rsi, rsi     ; no error code → rsi = 0
-    mov rdi, %1      ; exception number → rdi
-    call exception_handler
-    pop rdi
-    pop rsi
-    iretq
+    push 0           ; no error code
+    push %1
+    jmp isr_common
 %endmacro
 
+%macro irq_stub 1
+global irq_stub_%+%1
+irq_stub_%+%1:
+    push 0
+    push %1 + 32
+    jmp irq_common
+%endmacro
+
+; Local APIC vectors (timer, IPIs, spurious) share the IRQ path
+%macro apic_stub 1
+global apic_stub_%+%1
+apic_stub_%+%1:
+    push 0
+    push %1
+    jmp irq_common
+%endmacro
+
+section .text
+
 extern exception_handler
+extern irq_dispatch
+
+isr_common:
+    push_regs
+    cld
+    mov rdi, [rsp + 15*8]    ; exception number → rdi
+    mov rsi, [rsp + 16*8]    ; error code → rsi
+    call exception_handler
+    pop_regs
+    add rsp, 16
+    iretq
+
+irq_common:
+    push_regs
+    cld
+    mov rdi, rsp             ; TrapFrame* → rdi
+    call irq_dispatch
+
+; New tasks start here too: their first switch returns into this label with
+; a prepared TrapFrame on the stack.
+global trap_return
+trap_return:
+    pop_regs
+    add rsp, 16
+    iretq
+
 isr_no_err_stub 0
 isr_no_err_stub 1
 isr_no_err_stub 2
@@ -56,10 +132,78 @@ isr_no_err_stub 29
 isr_err_stub    30
 isr_no_err_stub 31
 
+irq_stub 0
+irq_stub 1
+irq_stub 2
+irq_stub 3
+irq_stub 4
+irq_stub 5
+irq_stub 6
+irq_stub 7
+irq_stub 8
+irq_stub 9
+irq_stub 10
+irq_stub 11
+irq_stub 12
+irq_stub 13
+irq_stub 14
+irq_stub 15
+
+apic_stub 224
+apic_stub 225
+apic_stub 226
+apic_stub 227
+apic_stub 228
+apic_stub 229
+apic_stub 230
+apic_stub 231
+apic_stub 232
+apic_stub 233
+apic_stub 234
+apic_stub 235
+apic_stub 236
+apic_stub 237
+apic_stub 238
+apic_stub 239
+apic_stub 240
+apic_stub 241
+apic_stub 242
+apic_stub 243
+apic_stub 244
+apic_stub 245
+apic_stub 246
+apic_stub 247
+apic_stub 248
+apic_stub 249
+apic_stub 250
+apic_stub 251
+apic_stub 252
+apic_stub 253
+apic_stub 254
+apic_stub 255
+
+section .data
+
 global isr_stub_table
 isr_stub_table:
-%assign i 0 
-%rep    32 
+%assign i 0
+%rep    32
     dq isr_stub_%+i ; use DQ instead if targeting 64-bit
-%assign i i+1 
+%assign i i+1
+%endrep
+
+global irq_stub_table
+irq_stub_table:
+%assign i 0
+%rep    16
+    dq irq_stub_%+i
+%assign i i+1
+%endrep
+
+global apic_stub_table
+apic_stub_table:
+%assign i 224
+%rep    32
+    dq apic_stub_%+i
+%assign i i+1
 %endrep
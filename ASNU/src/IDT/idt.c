@@ -1,5 +1,9 @@
 #include "idt.h"
 #include <Serial/serial.h>
+#include <sched/scheduler.h>
+#include <fpu/fpu.h>
+#include <Drivers/LAPIC.h>
+#include <Drivers/IOAPIC.h>
 
 typedef struct {
 	uint16_t    isr_low;
@@ -43,6 +47,9 @@ char error_codes[32][128] = {
 };
 
 void exception_handler(int exception, uint64_t err_code) {
+    /* Lazy FPU switching, not an error unless there is no state to give */
+    if (exception == 7 && fpu_handle_nm()) return;
+
     if (exception < 0 || exception > 31) {
         printk("\x1b[1;91m{ PANIC }\tIDT Exception occurred\n\r\t\tUnknown exception (%d) - Assuming software interrupt\n\r\x1b[0m", exception);
         asm volatile ("cli; hlt");
@@ -97,6 +104,11 @@ void idt_set_desc(uint8_t vector, void* isr, uint8_t flags) {
 static bool vectors[IDT_MAX_DESCRIPTORS];
 
 extern void* isr_stub_table[];
+extern void* irq_stub_table[];
+extern void* apic_stub_table[];
+
+/* Indexed by vector; legacy IRQs sit at 0x20-0x2F, local APIC vectors at 0xE0-0xFF */
+static IrqHandler vector_handlers[IDT_MAX_DESCRIPTORS];
 
 void idt_init_exceptions() {
     for (uint8_t vector = 0; vector < 32; vector++) {
@@ -105,12 +117,36 @@ void idt_init_exceptions() {
     }
 }
 
-__attribute__((interrupt)) void idt_keyboard_handler(int* __unused) {
-    (void)__unused;
+void idt_set_irq_handler(uint8_t irq, IrqHandler handler) {
+    if (irq >= 16) return;
+    vector_handlers[0x20 + irq] = handler;
+    idt_set_desc(0x20 + irq, irq_stub_table[irq], 0x8E);
+    vectors[0x20 + irq] = true;
+}
+
+void idt_set_vector_handler(uint8_t vector, IrqHandler handler) {
+    if (vector < IDT_APIC_VECTOR_BASE) return;
+    vector_handlers[vector] = handler;
+    idt_set_desc(vector, apic_stub_table[vector - IDT_APIC_VECTOR_BASE], 0x8E);
+    vectors[vector] = true;
+}
+
+/* Common C entry for the IRQ stubs; handlers acknowledge their interrupt controller themselves */
+void irq_dispatch(TrapFrame* frame) {
+    uint8_t vector = (uint8_t)frame->vector;
+    if (vector_handlers[vector])
+        vector_handlers[vector](frame);
+    else if (vector >= 0x20 && vector < 0x30)
+        idt_irq_eoi(vector - 0x20);
+
+    scheduler_irq_exit();
+}
+
+static void idt_keyboard_handler(TrapFrame* frame) {
+    (void)frame;
     uint8_t sc = inb(0x60);
     KeyboardDriverMain(sc);
-    idt_pic_send_eoi(1);
-    outb(0x20, 0x20);
+    idt_irq_eoi(1);
 }
 
 idtr_t idt_init() {
@@ -121,8 +157,8 @@ idtr_t idt_init() {
 
     idt_pic_remap(0x20, 0x28);
 
-    idt_set_desc(0x20, (void*)&pit_handler, 0x8E);
-    idt_set_desc(0x21, (void*)&idt_keyboard_handler, 0x8E);
+    idt_set_irq_handler(0, pit_handler);
+    idt_set_irq_handler(1, idt_keyboard_handler);
 
     outb(PIC1_DATA, 0b11111100);
     outb(PIC2_DATA, 0b11111111);
@@ -138,6 +174,19 @@ idtr_t idt_init() {
     return idtr;
 }
 
+/* Application processors share the boot CPU's table */
+void idt_load(void) {
+    __asm__ volatile ("lidt %0" : : "m"(idtr));
+}
+
+/* Once the IOAPICs carry the ISA IRQs the local APIC takes the EOI: one register write */
+void idt_irq_eoi(uint8_t irq) {
+	if (ioapic_active())
+		lapic_eoi();
+	else
+		idt_pic_send_eoi(irq);
+}
+
 #define PIC_EOI		0x20		/* End-of-interrupt command code */
 
 void idt_pic_send_eoi(uint8_t irq)
@@ -183,7 +232,20 @@ void idt_pic_remap(int offset1, int offset2) {
 	outb(PIC2_DATA, 0);
 }
 
-void KiIrqSetMask(uint8_t IRQline) {
+/* Mask every line on both PICs; returns the mask they had, slave in the high byte */
+uint16_t idt_pic_disable(void) {
+	uint16_t mask = inb(PIC1_DATA) | ((uint16_t)inb(PIC2_DATA) << 8);
+	outb(PIC1_DATA, 0xFF);
+	outb(PIC2_DATA, 0xFF);
+	return mask;
+}
+
+void idt_irq_set_mask(uint8_t IRQline) {
+    if (ioapic_active()) {
+        ioapic_irq_set_mask(IRQline, true);
+        return;
+    }
+
     uint16_t port;
     uint8_t value;
 
@@ -198,6 +260,11 @@ void KiIrqSetMask(uint8_t IRQline) {
 }
 
 void idt_irq_clear_mask(uint8_t IRQline) {
+    if (ioapic_active()) {
+        ioapic_irq_set_mask(IRQline, false);
+        return;
+    }
+
     uint16_t port;
     uint8_t value;
 
@@ -5,12 +5,24 @@
 #include <stdbool.h>
 #include <KiSimple.h>
 
+/* Layout pushed by the stubs in idt.asm, lowest address first */
+typedef struct TrapFrame {
+	uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
+	uint64_t rbp, rdi, rsi, rdx, rcx, rbx, rax;
+	uint64_t vector, error;
+	uint64_t rip, cs, rflags, rsp, ss;
+} TrapFrame;
+
+typedef void (*IrqHandler)(TrapFrame* frame);
+
 #include <VMM/vmm.h>
 #include <Drivers/PS2Keyboard.h>
 #include <Drivers/PIT.h>
 
 #define IDT_MAX_DESCRIPTORS 256
 #define GDT_OFFSET_KERNEL_CODE 0x08
+#define GDT_OFFSET_KERNEL_DATA 0x10
+#define IDT_APIC_VECTOR_BASE 0xE0
 
 typedef struct {
 	uint16_t	limit;
@@ -19,7 +31,13 @@ typedef struct {
 
 void idt_set_desc(uint8_t vector, void* isr, uint8_t flags);
 idtr_t idt_init(void);
+void idt_load(void);
 void idt_init_exceptions(void);
+void idt_set_irq_handler(uint8_t irq, IrqHandler handler);
+void idt_set_vector_handler(uint8_t vector, IrqHandler handler);
+void irq_dispatch(TrapFrame* frame);
+
+extern void trap_return(void);
 
 #define PIC1		0x20
 #define PIC2		0xA0
@@ -28,9 +46,13 @@ void idt_init_exceptions(void);
 #define PIC2_COMMAND	PIC2
 #define PIC2_DATA	(PIC2+1)
 
-void idt_pic_send_eoi(uint8_t irq);
-void idt_pic_remap(int offset1, int offset2);
+/* Acknowledge an ISA IRQ at whichever controller delivers it: the PICs or the local APIC */
+void idt_irq_eoi(uint8_t irq);
 void idt_irq_set_mask(uint8_t IRQline);
 void idt_irq_clear_mask(uint8_t IRQline);
 
+void idt_pic_send_eoi(uint8_t irq);
+void idt_pic_remap(int offset1, int offset2);
+uint16_t idt_pic_disable(void);
+
 #endif /* IDT_H */
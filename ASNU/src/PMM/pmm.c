@@ -2,6 +2,7 @@
 #include <KiSimple.h>
 #include <string.h>
 #include <stdint.h>
+#include <sync/spinlock.h>
 
 typedef struct {
     uint64_t base;
@@ -26,6 +27,9 @@ PmmFile* pmm_file = &pmm_file_ins;
 BitmapFile bitmap_file_ins;
 BitmapFile* bitmap_file = &bitmap_file_ins;
 
+/* Bitmap updates are read-modify-write; every CPU allocates */
+static Spinlock pmm_lock = SPINLOCK_INIT;
+
 void pmm_init(int pmm_virt_mem, uint64_t largest_base, uint64_t largest_length, uint64_t second_largest_base, uint64_t second_largest_length, uint64_t total_memory, uint64_t total_usable_memory, uint64_t total_reserved_memory) {
     serial_fwrite("Initializing Physical Memory Manager with the following parameters:");
     serial_fwrite("PMM Virtual Memory: %d", pmm_virt_mem);
@@ -87,20 +91,24 @@ void* kalloc(size_t size) {
     if (size == 0) return NULL;
     uint64_t pages_needed = (size + 4095) / 4096;
 
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
     uint8_t* bm = (uint8_t*)pmm_file->bitmap_base;
     for (uint64_t i = 0; i < pmm_file->bitmap_length * 8; i++) {
         uint64_t byte_index = i / 8;
         uint8_t bit_index = i % 8;
         if ((bm[byte_index] & (uint8_t)(1u << bit_index)) == 0) {
             bm[byte_index] |= (uint8_t)(1u << bit_index);
+            spin_unlock_irqrestore(&pmm_lock, flags);
             return (void*)(pmm_file->base + (i * 4096));
         }
     }
+    spin_unlock_irqrestore(&pmm_lock, flags);
     return NULL;
 }
 
 void* palloc() {
     uint64_t index = UINT64_MAX;
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
     uint8_t* bm = (uint8_t*)pmm_file->bitmap_base;
     for (uint64_t i = 0; i < pmm_file->bitmap_length * 8; i++) {
         uint64_t byte_index = i / 8;
@@ -111,6 +119,7 @@ void* palloc() {
             break;
         }
     }
+    spin_unlock_irqrestore(&pmm_lock, flags);
 
     if (index == UINT64_MAX) return NULL; // No free pages found
     return (void*)(pmm_file->base + (index * 4096));
@@ -123,6 +132,9 @@ void kfree(void* ptr) {
     if (phys < pmm_file->base || phys >= pmm_file->base + pmm_file->length)
         return;
 
-    BitmapClearBit((phys - pmm_file->base) / 4096);
     memset(ptr, 0, 4096);
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    BitmapClearBit((phys - pmm_file->base) / 4096);
+    spin_unlock_irqrestore(&pmm_lock, flags);
 }
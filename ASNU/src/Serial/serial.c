@@ -1,6 +1,33 @@
 #include "serial.h"
+#include <sync/spinlock.h>
+#include <IDT/idt.h>
 
 #define COM1 0x3F8
+#define COM1_IRQ 4
+
+static SerialRxHandler serial_rx_handler = NULL;
+
+static void serial_irq(TrapFrame* frame) {
+    (void)frame;
+    while (inb(COM1 + 5) & 0x01) {      /* LSR: data ready */
+        char c = (char)inb(COM1);
+        if (serial_rx_handler) serial_rx_handler(c);
+    }
+    idt_irq_eoi(COM1_IRQ);
+}
+
+/* The firmware already set up the line; this only turns on receive interrupts */
+void serial_init(void) {
+    outb(COM1 + 1, 0x01);               /* IER: received data available */
+    outb(COM1 + 4, 0x0B);               /* MCR: DTR, RTS, OUT2 gates the IRQ */
+    idt_set_irq_handler(COM1_IRQ, serial_irq);
+    idt_irq_clear_mask(COM1_IRQ);
+}
+
+/* handler runs in interrupt context, once per received byte */
+void serial_set_rx_handler(SerialRxHandler handler) {
+    serial_rx_handler = handler;
+}
 
 void serial_write_char(char c) {
     outb(COM1, c);
@@ -95,10 +122,15 @@ void serial_write_octal(unsigned int value) {
 
 static int serial_log_id = 0;
 
+/* Keeps lines from different CPUs from interleaving */
+static Spinlock serial_lock = SPINLOCK_INIT;
+
 void serial_fwrite(const char* fmt, ...) {
     va_list args;
     va_start(args, fmt);
 
+    uint64_t flags = spin_lock_irqsave(&serial_lock);
+
     serial_write_char('[');
     char* log_id = serial_i2s(serial_log_id++);
     for (char* p = log_id; *p; p++) serial_write_char(*p);
@@ -186,6 +218,12 @@ void serial_fwrite(const char* fmt, ...) {
                                 for (int j = 0; buf[j]; j++) serial_write_char(buf[j]);
                                 break;
                             }
+                            case 'x':
+                            case 'X': {
+                                unsigned long long v = va_arg(args, unsigned long long);
+                                serial_write_hex((uintptr_t)v, *p == 'X');
+                                break;
+                            }
                         }
                     }
                     break;
@@ -199,5 +237,6 @@ void serial_fwrite(const char* fmt, ...) {
     }
 
     serial_write_char('\n');
+    spin_unlock_irqrestore(&serial_lock, flags);
     va_end(args);
 }
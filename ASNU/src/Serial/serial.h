@@ -5,7 +5,10 @@
 #include <stdarg.h>
 #include <KiSimple.h>
 
+typedef void (*SerialRxHandler)(char c);
+
 void serial_init(void);
+void serial_set_rx_handler(SerialRxHandler handler);
 
 void serial_fwrite(const char* fmt, ...);
 
@@ -2,9 +2,22 @@
 #include <KiSimple.h>
 #include <PMM/pmm.h>
 #include <string.h>
+#include <sync/spinlock.h>
 
 void* PML4;
 
+/*
+ * Device registers are not covered by the HHDM, so they get uncached
+ * mappings in a window of their own below the kernel image.
+ */
+#define MMIO_WINDOW_BASE 0xFFFFFFFF00000000ULL
+#define MMIO_WINDOW_SIZE 0x0000000080000000ULL
+
+static uint64_t mmio_next = MMIO_WINDOW_BASE;
+
+/* Serializes page table edits between CPUs */
+static Spinlock vmm_lock = SPINLOCK_INIT;
+
 uint64_t cr3_phys;
 uint64_t cr3_virt;
 
@@ -18,6 +31,12 @@ void vmm_init() {
     __asm__ volatile("mov %0, %%cr3" : : "r"(VA2PA(PML4)));
 }
 
+uint64_t vmm_get_cr3(void) {
+    uint64_t cr3;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+    return cr3;
+}
+
 void mmap(void* vaddr, void* paddr, uint64_t flags) {
     uint64_t va = (uint64_t)vaddr;
     uint64_t pa = (uint64_t)paddr;
@@ -29,6 +48,8 @@ void mmap(void* vaddr, void* paddr, uint64_t flags) {
     uint64_t pd_index   = (va >> 21) & 0x1FF;
     uint64_t pt_index   = (va >> 12) & 0x1FF;
 
+    uint64_t lock_flags = spin_lock_irqsave(&vmm_lock);
+
     uint64_t* pdpt;
     if (!(pml4[pml4_index] & PAGE_PRESENT)) {
         pdpt = (uint64_t*)palloc();
@@ -59,6 +80,8 @@ void mmap(void* vaddr, void* paddr, uint64_t flags) {
     pt[pt_index] = 0;
 
     pt[pt_index] = (pa & ~0xFFFUL) | (flags & 0xFFF) | PAGE_PRESENT;
+
+    spin_unlock_irqrestore(&vmm_lock, lock_flags);
 }
 
 void unmap(void* vaddr) {
@@ -81,3 +104,16 @@ void unmap(void* vaddr) {
 
     __asm__ volatile("invlpg (%0)" : : "r"(vaddr) : "memory");
 }
+
+void* vmm_map_mmio(uint64_t paddr, uint64_t size) {
+    uint64_t offset = paddr & 0xFFF;
+    uint64_t pages = (offset + size + 0xFFF) / 0x1000;
+
+    uint64_t va = __atomic_fetch_add(&mmio_next, pages * 0x1000, __ATOMIC_RELAXED);
+    if (va + pages * 0x1000 > MMIO_WINDOW_BASE + MMIO_WINDOW_SIZE) return NULL;
+
+    for (uint64_t i = 0; i < pages; i++)
+        mmap((void*)(va + i * 0x1000), (void*)((paddr & ~0xFFFULL) + i * 0x1000), PAGE_PRESENT | PAGE_RW | PAGE_PCD | PAGE_PWT);
+
+    return (void*)(va + offset);
+}
@@ -10,8 +10,25 @@ void vmm_init();
 #define PAGE_PRESENT 0x1
 #define PAGE_RW      0x2
 #define PAGE_USER    0x4
+#define PAGE_PWT     0x8
+#define PAGE_PCD     0x10
+#define PAGE_ACCESSED 0x20
+#define PAGE_DIRTY   0x40
+#define PAGE_HUGE    0x80
+
+/* Bits 9-11 and 52-58 are ignored by the MMU and free for software use */
+#define PAGE_SOFT_DIRTY (1ULL << 11)
+#define PAGE_AGE_SHIFT  52
+#define PAGE_AGE_MASK   (0xFULL << PAGE_AGE_SHIFT)
+
+#define PAGE_ADDR_MASK  0x000FFFFFFFFFF000ULL
+
+extern void* PML4;
+
+uint64_t vmm_get_cr3(void);
 
 void mmap(void* vaddr, void* paddr, uint64_t flags);
 void unmap(void* vaddr);
+void* vmm_map_mmio(uint64_t paddr, uint64_t size);
 
 #endif /* VMM_H */
\ No newline at end of file
@@ -0,0 +1,291 @@
+#include "wss.h"
+#include <KiSimple.h>
+#include <Serial/serial.h>
+#include <string.h>
+#include <sync/spinlock.h>
+#include <time/timer.h>
+
+static WssSpace wss_spaces[WSS_MAX_SPACES];
+static uint32_t wss_next_space = 0;
+static Timer wss_timer;
+
+/* Processes come and go on any CPU while the boot CPU's timer scans */
+static Spinlock wss_lock = SPINLOCK_INIT;
+
+static inline uint32_t wss_bucket(uint64_t age) {
+    if (age == 0) return 0;
+    if (age == 1) return 1;
+    if (age < 4) return 2;
+    if (age < 8) return 3;
+    return 4;
+}
+
+static WssSpace* wss_find(uint64_t cr3) {
+    cr3 &= PAGE_ADDR_MASK;
+    for (int i = 0; i < WSS_MAX_SPACES; i++) {
+        if (wss_spaces[i].used && wss_spaces[i].cr3 == cr3)
+            return &wss_spaces[i];
+    }
+    return NULL;
+}
+
+/* Each call takes a reference that wss_untrack() gives back */
+WssSpace* wss_track(uint64_t cr3, bool kernel) {
+    uint64_t flags = spin_lock_irqsave(&wss_lock);
+    WssSpace* s = wss_find(cr3);
+    if (s) {
+        s->users++;
+        spin_unlock_irqrestore(&wss_lock, flags);
+        return s;
+    }
+
+    s = NULL;
+    for (int i = 0; i < WSS_MAX_SPACES; i++) {
+        if (!wss_spaces[i].used) {
+            s = &wss_spaces[i];
+            memset(s, 0, sizeof(WssSpace));
+            s->cr3 = cr3 & PAGE_ADDR_MASK;
+            s->used = true;
+            s->kernel = kernel;
+            s->users = 1;
+            s->i4 = kernel ? 256 : 0;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&wss_lock, flags);
+    return s;
+}
+
+void wss_untrack(uint64_t cr3) {
+    uint64_t flags = spin_lock_irqsave(&wss_lock);
+    WssSpace* s = wss_find(cr3);
+    if (s && --s->users == 0) s->used = false;
+    spin_unlock_irqrestore(&wss_lock, flags);
+}
+
+void wss_init(void) {
+    memset(wss_spaces, 0, sizeof(wss_spaces));
+    wss_next_space = 0;
+}
+
+static WssRegion* wss_region_slot(WssSpace* s, uint64_t va) {
+    uint64_t key = (va >> 21) + 1;
+    uint32_t h = (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 56) % WSS_MAX_REGIONS;
+    for (uint32_t n = 0; n < WSS_MAX_REGIONS; n++) {
+        WssRegion* r = &s->regions[(h + n) % WSS_MAX_REGIONS];
+        if (r->key == key || r->key == 0) {
+            r->key = key;
+            return r;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Sample one leaf entry: fold the hardware A/D bits into the software age and
+ * soft-dirty bits, then clear them so the next pass sees fresh accesses.
+ * Returns the entry's age after the update.
+ */
+static uint64_t wss_sample(volatile uint64_t* entry, bool flush, uint64_t va, bool* dirty) {
+    uint64_t old = *entry;
+    uint64_t new;
+    do {
+        uint64_t age = (old & PAGE_AGE_MASK) >> PAGE_AGE_SHIFT;
+        if (old & PAGE_ACCESSED) age = 0;
+        else if (age < WSS_MAX_AGE) age++;
+
+        new = old & ~(PAGE_ACCESSED | PAGE_DIRTY | PAGE_AGE_MASK);
+        new |= age << PAGE_AGE_SHIFT;
+        if (old & PAGE_DIRTY) new |= PAGE_SOFT_DIRTY;
+    } while (!__atomic_compare_exchange_n(entry, &old, new, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    /* A cached translation would hide the next access, drop it */
+    if (flush && (old & (PAGE_ACCESSED | PAGE_DIRTY)))
+        __asm__ volatile("invlpg (%0)" : : "r"(va) : "memory");
+
+    *dirty = (new & PAGE_SOFT_DIRTY) != 0;
+    return (new & PAGE_AGE_MASK) >> PAGE_AGE_SHIFT;
+}
+
+static void wss_commit_region(WssSpace* s, uint64_t va) {
+    WssRegion* r = wss_region_slot(s, va);
+    for (int b = 0; b < WSS_AGE_BUCKETS; b++) {
+        if (r) r->hist[b] = (uint16_t)s->pt_hist[b];
+        s->pass_hist[b] += s->pt_hist[b];
+        s->pt_hist[b] = 0;
+    }
+    if (r) {
+        r->resident = (uint16_t)s->pt_resident;
+        r->dirty = (uint16_t)s->pt_dirty;
+    }
+    s->pass_resident += s->pt_resident;
+    s->pass_dirty += s->pt_dirty;
+    s->pt_resident = 0;
+    s->pt_dirty = 0;
+}
+
+static void wss_finish_pass(WssSpace* s) {
+    for (int b = 0; b < WSS_AGE_BUCKETS; b++) {
+        s->hist[b] = s->pass_hist[b];
+        s->pass_hist[b] = 0;
+    }
+    s->resident = s->pass_resident;
+    s->dirty = s->pass_dirty;
+    s->pass_resident = 0;
+    s->pass_dirty = 0;
+    s->passes++;
+    s->i4 = s->kernel ? 256 : 0;
+    s->i3 = s->i2 = s->i1 = 0;
+}
+
+/* Advance the cursor past the entry at the given level (4 = PML4 .. 1 = PT) */
+static void wss_advance(WssSpace* s, int level) {
+    switch (level) {
+        case 1:
+            if (++s->i1 < 512) return;
+            s->i1 = 0;
+            /* fallthrough */
+        case 2:
+            if (++s->i2 < 512) return;
+            s->i2 = 0;
+            /* fallthrough */
+        case 3:
+            if (++s->i3 < 512) return;
+            s->i3 = 0;
+            /* fallthrough */
+        default:
+            s->i4++;
+    }
+}
+
+/* Visit at most budget entries of the space's half; returns the budget left over */
+static uint32_t wss_scan_space(WssSpace* s, uint32_t budget) {
+    uint64_t* pml4 = (uint64_t*)PA2VAu64(s->cr3);
+    /* The kernel half is mapped in every address space */
+    bool active = s->kernel || (vmm_get_cr3() & PAGE_ADDR_MASK) == s->cr3;
+    uint32_t end = s->kernel ? 512 : 256;
+
+    while (budget > 0) {
+        if (s->i4 >= end) {
+            wss_finish_pass(s);
+            return budget;
+        }
+        budget--;
+
+        uint64_t e4 = pml4[s->i4];
+        if (!(e4 & PAGE_PRESENT)) {
+            s->i3 = s->i2 = s->i1 = 0;
+            wss_advance(s, 4);
+            continue;
+        }
+
+        uint64_t* pdpt = (uint64_t*)PA2VAu64(e4 & PAGE_ADDR_MASK);
+        uint64_t e3 = pdpt[s->i3];
+        if (!(e3 & PAGE_PRESENT) || (e3 & PAGE_HUGE)) {
+            /* 1 GiB pages are left to the large-page code */
+            s->i2 = s->i1 = 0;
+            wss_advance(s, 3);
+            continue;
+        }
+
+        uint64_t va = ((uint64_t)s->i4 << 39) | ((uint64_t)s->i3 << 30) | ((uint64_t)s->i2 << 21);
+        if (s->i4 >= 256) va |= 0xFFFF000000000000ULL;
+        uint64_t* pd = (uint64_t*)PA2VAu64(e3 & PAGE_ADDR_MASK);
+        uint64_t e2 = pd[s->i2];
+        if (!(e2 & PAGE_PRESENT)) {
+            s->i1 = 0;
+            wss_advance(s, 2);
+            continue;
+        }
+
+        bool dirty;
+        if (e2 & PAGE_HUGE) {
+            uint64_t age = wss_sample(&pd[s->i2], active, va, &dirty);
+            s->pt_hist[wss_bucket(age)] += 512;
+            s->pt_resident += 512;
+            if (dirty) s->pt_dirty += 512;
+            wss_commit_region(s, va);
+            s->i1 = 0;
+            wss_advance(s, 2);
+            continue;
+        }
+
+        uint64_t* pt = (uint64_t*)PA2VAu64(e2 & PAGE_ADDR_MASK);
+        if (pt[s->i1] & PAGE_PRESENT) {
+            uint64_t age = wss_sample(&pt[s->i1], active, va | ((uint64_t)s->i1 << 12), &dirty);
+            s->pt_hist[wss_bucket(age)]++;
+            s->pt_resident++;
+            if (dirty) s->pt_dirty++;
+        }
+        if (s->i1 == 511) wss_commit_region(s, va);
+        wss_advance(s, 1);
+    }
+    return 0;
+}
+
+/* One bounded scan step, then the timer is re-armed for the next */
+static void wss_scan_step(void* arg) {
+    (void)arg;
+
+    /* Interrupts are already off in timer callbacks */
+    spin_lock(&wss_lock);
+    uint32_t budget = WSS_SCAN_BUDGET;
+    for (int n = 0; n < WSS_MAX_SPACES && budget > 0; n++) {
+        WssSpace* s = &wss_spaces[wss_next_space];
+        if (s->used) {
+            budget = wss_scan_space(s, budget);
+            if (budget == 0) break;
+        }
+        wss_next_space = (wss_next_space + 1) % WSS_MAX_SPACES;
+    }
+    spin_unlock(&wss_lock);
+
+    add_timer(&wss_timer, WSS_SCAN_INTERVAL_NS, WSS_SCAN_INTERVAL_NS >> TIMER_SLACK_SHIFT);
+}
+
+void wss_start(void) {
+    timer_init(&wss_timer, wss_scan_step, NULL);
+    add_timer(&wss_timer, WSS_SCAN_INTERVAL_NS, WSS_SCAN_INTERVAL_NS >> TIMER_SLACK_SHIFT);
+}
+
+uint64_t wss_get_pages(uint64_t cr3) {
+    WssSpace* s = wss_find(cr3);
+    if (!s) return 0;
+
+    uint64_t pages = 0;
+    for (int b = 0; b < WSS_ACTIVE_BUCKETS; b++)
+        pages += s->hist[b];
+    return pages;
+}
+
+/* Working-set size of a procedure in bytes; procedures without a cr3 share the kernel space */
+uint64_t wss_get_proc(Procedure* proc) {
+    if (!proc) return 0;
+    uint64_t cr3 = proc->state.Regs.cr3 ? proc->state.Regs.cr3 : VA2PAu64((uint64_t)PML4);
+    return wss_get_pages(cr3) * 4096;
+}
+
+const WssRegion* wss_get_region(uint64_t cr3, uint64_t va) {
+    WssSpace* s = wss_find(cr3);
+    if (!s) return NULL;
+
+    uint64_t key = (va >> 21) + 1;
+    uint32_t h = (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 56) % WSS_MAX_REGIONS;
+    for (uint32_t n = 0; n < WSS_MAX_REGIONS; n++) {
+        WssRegion* r = &s->regions[(h + n) % WSS_MAX_REGIONS];
+        if (r->key == key) return r;
+        if (r->key == 0) return NULL;
+    }
+    return NULL;
+}
+
+void wss_dump(void) {
+    for (int i = 0; i < WSS_MAX_SPACES; i++) {
+        WssSpace* s = &wss_spaces[i];
+        if (!s->used) continue;
+        serial_fwrite("WSS %s space cr3=%p passes=%llu resident=%llu dirty=%llu wss=%llu pages",
+            s->kernel ? "kernel" : "process", (void*)s->cr3, s->passes, s->resident, s->dirty, wss_get_pages(s->cr3));
+        serial_fwrite("  age 0: %llu, 1: %llu, 2-3: %llu, 4-7: %llu, 8+: %llu",
+            s->hist[0], s->hist[1], s->hist[2], s->hist[3], s->hist[4]);
+    }
+}
@@ -0,0 +1,74 @@
+#ifndef WSS_H
+#define WSS_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <VMM/vmm.h>
+#include <sched/scheduler.h>
+
+/*
+ * Working-set estimation.
+ *
+ * A rate-limited scanner walks every tracked address space, a bounded
+ * number of entries per step: the lower half of a process's, the upper
+ * half of the kernel's. Processes sharing page tables share one space. Each visit samples and clears the
+ * accessed/dirty bits of a leaf entry and keeps the entry's age (full passes
+ * since it was last accessed) in the software bits of the PTE itself.
+ * Steps run from a kernel timer on the boot CPU, so they go on while its
+ * tick is stopped.
+ */
+
+#define WSS_MAX_SPACES      8
+#define WSS_MAX_REGIONS     256     /* 2 MiB regions with a recorded histogram, per space */
+#define WSS_SCAN_INTERVAL_NS 100000000ULL /* ns between scan steps */
+#define WSS_SCAN_BUDGET     512     /* page table entries visited per scan step */
+#define WSS_MAX_AGE         15
+
+/* Age buckets: 0, 1, 2-3, 4-7, 8-15 passes since last access */
+#define WSS_AGE_BUCKETS     5
+#define WSS_ACTIVE_BUCKETS  2       /* buckets counted towards the working set */
+
+typedef struct {
+    uint64_t key;                   /* (va >> 21) + 1, 0 when free */
+    uint16_t hist[WSS_AGE_BUCKETS];
+    uint16_t resident;
+    uint16_t dirty;
+} WssRegion;
+
+typedef struct {
+    uint64_t cr3;
+    bool used;
+    bool kernel;                    /* scan the upper half instead of the lower */
+    uint32_t users;                 /* processes tracking it */
+
+    /* Scan cursor, resumes where the last step stopped */
+    uint16_t i4, i3, i2, i1;
+    uint32_t pt_hist[WSS_AGE_BUCKETS];
+    uint32_t pt_resident;
+    uint32_t pt_dirty;
+
+    /* Totals for the pass in progress, published when it completes */
+    uint64_t pass_hist[WSS_AGE_BUCKETS];
+    uint64_t pass_resident;
+    uint64_t pass_dirty;
+
+    uint64_t hist[WSS_AGE_BUCKETS];
+    uint64_t resident;
+    uint64_t dirty;
+    uint64_t passes;
+
+    WssRegion regions[WSS_MAX_REGIONS];
+} WssSpace;
+
+void wss_init(void);
+/* Once the boot CPU has timers: start the scan steps there */
+void wss_start(void);
+WssSpace* wss_track(uint64_t cr3, bool kernel);
+void wss_untrack(uint64_t cr3);
+
+uint64_t wss_get_pages(uint64_t cr3);
+uint64_t wss_get_proc(Procedure* proc);
+const WssRegion* wss_get_region(uint64_t cr3, uint64_t va);
+void wss_dump(void);
+
+#endif /* WSS_H */
@@ -0,0 +1,244 @@
+#include "fpu.h"
+#include <string.h>
+#include <KiSimple.h>
+#include <PMM/pmm.h>
+#include <Serial/serial.h>
+#include <smp/smp.h>
+
+#define CR0_MP          (1ULL << 1)
+#define CR0_EM          (1ULL << 2)
+#define CR0_TS          (1ULL << 3)
+#define CR0_NE          (1ULL << 5)
+#define CR4_OSFXSR      (1ULL << 9)
+#define CR4_OSXMMEXCPT  (1ULL << 10)
+#define CR4_OSXSAVE     (1ULL << 18)
+
+#define CPUID1_ECX_XSAVE    (1U << 26)
+#define CPUID1_ECX_AVX      (1U << 28)
+#define CPUIDD1_EAX_XSAVEOPT (1U << 0)
+
+#define FPU_DEFAULT_FCW     0x037F
+#define FPU_DEFAULT_MXCSR   0x1F80
+
+/* Below this a plain rep movsb beats the state juggling */
+#define MEMCPY_FAST_MIN     1024
+
+static bool fpu_xsave = false;
+static bool fpu_xsaveopt = false;
+static bool fpu_avx = false;
+static uint64_t fpu_xcr0 = 0;
+static uint32_t fpu_size = 0;
+
+static inline uint64_t read_cr0(void) {
+    uint64_t v;
+    asm volatile ("mov %%cr0, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr0(uint64_t v) {
+    asm volatile ("mov %0, %%cr0" : : "r"(v) : "memory");
+}
+
+static inline uint64_t read_cr4(void) {
+    uint64_t v;
+    asm volatile ("mov %%cr4, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr4(uint64_t v) {
+    asm volatile ("mov %0, %%cr4" : : "r"(v) : "memory");
+}
+
+static inline void clts(void) {
+    asm volatile ("clts" : : : "memory");
+}
+
+static inline void stts(void) {
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+static inline void xsetbv(uint32_t reg, uint64_t value) {
+    asm volatile ("xsetbv" : : "c"(reg), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static void fpu_save(void *area) {
+    uint32_t lo = (uint32_t)fpu_xcr0, hi = (uint32_t)(fpu_xcr0 >> 32);
+    if (fpu_xsaveopt)
+        asm volatile ("xsaveopt64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+    else if (fpu_xsave)
+        asm volatile ("xsave64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+    else
+        asm volatile ("fxsave64 (%0)" : : "r"(area) : "memory");
+}
+
+static void fpu_restore(const void *area) {
+    uint32_t lo = (uint32_t)fpu_xcr0, hi = (uint32_t)(fpu_xcr0 >> 32);
+    if (fpu_xsave)
+        asm volatile ("xrstor64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+    else
+        asm volatile ("fxrstor64 (%0)" : : "r"(area) : "memory");
+}
+
+/*
+ * A zeroed XSAVE header marks every component as in its init state; only
+ * the control words in the legacy area are always loaded and need sane
+ * (all exceptions masked) values.
+ */
+static void *fpu_alloc_state(void) {
+    uint8_t *area = (uint8_t*)palloc();
+    if (!area) return NULL;
+    memset(area, 0, 4096);
+    *(uint16_t*)(area + 0) = FPU_DEFAULT_FCW;
+    *(uint32_t*)(area + 24) = FPU_DEFAULT_MXCSR;
+    return area;
+}
+
+void fpu_init_cpu(void) {
+    uint64_t cr0 = read_cr0();
+    cr0 &= ~CR0_EM;
+    cr0 |= CR0_MP | CR0_NE;
+    write_cr0(cr0);
+
+    uint64_t cr4 = read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (fpu_xsave) cr4 |= CR4_OSXSAVE;
+    write_cr4(cr4);
+    if (fpu_xsave) xsetbv(0, fpu_xcr0);
+
+    asm volatile ("fninit");
+    stts();
+
+    PerCpu *cpu = this_cpu();
+    cpu->fpu_owner = NULL;
+    cpu->fpu_live = false;
+}
+
+/* End of the furthest component in mask within a standard-format XSAVE area */
+static uint32_t fpu_xsave_end(uint64_t mask) {
+    uint32_t end = 512 + 64;    /* legacy area and header */
+    for (uint32_t i = 2; i < 64; i++) {
+        if (!(mask & (1ULL << i))) continue;
+        uint32_t size, offset, ecx, edx;
+        cpuid(0xD, i, &size, &offset, &ecx, &edx);
+        if (offset + size > end) end = offset + size;
+    }
+    return end;
+}
+
+/* Called once on the BSP; the APs only run fpu_init_cpu() */
+void fpu_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+
+    fpu_xsave = (ecx & CPUID1_ECX_XSAVE) != 0;
+    if (fpu_xsave) {
+        bool avx = (ecx & CPUID1_ECX_AVX) != 0;
+        uint32_t supported;
+        cpuid(0xD, 0, &supported, &ebx, &ecx, &edx);
+
+        fpu_xcr0 = XCR0_X87 | XCR0_SSE;
+        if (avx && (supported & XCR0_AVX)) fpu_xcr0 |= XCR0_AVX;
+        fpu_avx = (fpu_xcr0 & XCR0_AVX) != 0;
+
+        /* About 2.7 KiB with AVX-512; only if the area still fits the page fpu_alloc_state() hands out */
+        if (fpu_avx && (supported & XCR0_AVX512) == XCR0_AVX512 &&
+            fpu_xsave_end(fpu_xcr0 | XCR0_AVX512) <= 4096)
+            fpu_xcr0 |= XCR0_AVX512;
+
+        cpuid(0xD, 1, &eax, &ebx, &ecx, &edx);
+        fpu_xsaveopt = (eax & CPUIDD1_EAX_XSAVEOPT) != 0;
+    }
+
+    fpu_init_cpu();
+
+    if (fpu_xsave) {
+        /* EBX of leaf 0xD reports the area size for what XCR0 enables now */
+        cpuid(0xD, 0, &eax, &ebx, &ecx, &edx);
+        fpu_size = ebx;
+    } else {
+        fpu_size = 512;
+    }
+
+    serial_fwrite("FPU: %s, xcr0=0x%llx, %u byte save area%s", fpu_xsave ? "xsave" : "fxsave",
+                  fpu_xcr0, fpu_size, fpu_xsaveopt ? ", xsaveopt" : "");
+}
+
+bool fpu_has_avx(void) {
+    return fpu_avx;
+}
+
+/* #NM: the running procedure touched the FPU while TS was set */
+bool fpu_handle_nm(void) {
+    if (!fpu_size || fpu_size > 4096) return false;
+
+    PerCpu *cpu = this_cpu();
+    Procedure *p = cpu->current;
+    if (!p) return false;
+    if (!p->fpu_state) {
+        p->fpu_state = fpu_alloc_state();
+        if (!p->fpu_state) return false;
+    }
+
+    clts();
+    fpu_restore(p->fpu_state);
+    cpu->fpu_owner = p;
+    cpu->fpu_live = true;
+    p->fpu_cpu = cpu->cpu_id;
+    return true;
+}
+
+/*
+ * Called by context_switch() with interrupts off. prev's state is always
+ * written back, so it can migrate freely; the registers stay tagged with
+ * it, and if it is the next to run here and was last restored here, TS is
+ * simply left clear.
+ */
+void fpu_switch(PerCpu *cpu, Procedure *prev, Procedure *next) {
+    if (!fpu_size) return;
+
+    bool was_live = cpu->fpu_live;
+    if (was_live) fpu_save(prev->fpu_state);
+
+    bool keep = next->fpu_state && cpu->fpu_owner == next && next->fpu_cpu == cpu->cpu_id;
+    if (keep && !was_live) clts();
+    else if (!keep && was_live) stts();
+    cpu->fpu_live = keep;
+}
+
+/* Drop p's save area before its Procedure is reused; p must be off every CPU */
+void fpu_free_state(Procedure *p) {
+    if (!p->fpu_state) return;
+    kfree(p->fpu_state);
+    p->fpu_state = NULL;
+}
+
+/* Returns the flags for kernel_fpu_end(); the caller's own FPU state, if live, is saved first */
+uint64_t kernel_fpu_begin(void) {
+    uint64_t flags = irq_save();
+    PerCpu *cpu = this_cpu();
+    if (cpu->fpu_live) {
+        fpu_save(cpu->fpu_owner->fpu_state);
+        cpu->fpu_live = false;
+    }
+    cpu->fpu_owner = NULL;
+
+    uint32_t mxcsr = FPU_DEFAULT_MXCSR;
+    clts();
+    asm volatile ("fninit; ldmxcsr %0" : : "m"(mxcsr));
+    return flags;
+}
+
+void kernel_fpu_end(uint64_t flags) {
+    if (fpu_avx) asm volatile ("vzeroupper");
+    stts();
+    irq_restore(flags);
+}
+
+void *memcpy_fast(void *dst, const void *src, size_t n) {
+    if (n < MEMCPY_FAST_MIN || !fpu_size) return memcpy(dst, src, n);
+
+    uint64_t flags = kernel_fpu_begin();
+    if (fpu_avx) memcpy_avx(dst, src, n);
+    else memcpy_sse2(dst, src, n);
+    kernel_fpu_end(flags);
+    return dst;
+}
@@ -0,0 +1,43 @@
+#ifndef FPU_H
+#define FPU_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sched/scheduler.h>
+
+/*
+ * Lazy x87/SSE/AVX/AVX-512 state. CR0.TS stays set while the registers do not hold
+ * the running procedure's state; its first FPU instruction raises #NM, which
+ * allocates its save area on first use and restores it. A procedure that
+ * never touches the FPU costs nothing but the TS bit.
+ *
+ * The kernel itself is built without SSE. Routines that want vector code
+ * bracket it with kernel_fpu_begin()/kernel_fpu_end(), which runs with
+ * interrupts off, so keep the work between them bounded.
+ */
+
+#define XCR0_X87    0x1
+#define XCR0_SSE    0x2
+#define XCR0_AVX    0x4
+#define XCR0_AVX512 0xE0    /* opmask, ZMM_Hi256, Hi16_ZMM: enabled together or not at all */
+
+void fpu_init(void);
+void fpu_init_cpu(void);
+bool fpu_handle_nm(void);
+
+struct PerCpu;
+void fpu_switch(struct PerCpu *cpu, Procedure *prev, Procedure *next);
+void fpu_free_state(Procedure *p);
+
+uint64_t kernel_fpu_begin(void);
+void kernel_fpu_end(uint64_t flags);
+
+bool fpu_has_avx(void);
+void *memcpy_fast(void *dst, const void *src, size_t n);
+
+/* fpu/simd.asm; only between kernel_fpu_begin() and kernel_fpu_end() */
+void memcpy_sse2(void *dst, const void *src, size_t n);
+void memcpy_avx(void *dst, const void *src, size_t n);
+
+#endif /* FPU_H */
@@ -0,0 +1,58 @@
+[bits 64]
+
+section .text
+
+; void memcpy_sse2(void* dst, const void* src, size_t n)
+;
+; 64 bytes per iteration through xmm0-3, unaligned loads and stores, then
+; rep movsb for the tail. Only valid inside kernel_fpu_begin/end.
+global memcpy_sse2
+memcpy_sse2:
+    mov rcx, rdx
+    shr rcx, 6
+    jz .tail
+.loop:
+    movdqu xmm0, [rsi]
+    movdqu xmm1, [rsi + 16]
+    movdqu xmm2, [rsi + 32]
+    movdqu xmm3, [rsi + 48]
+    movdqu [rdi], xmm0
+    movdqu [rdi + 16], xmm1
+    movdqu [rdi + 32], xmm2
+    movdqu [rdi + 48], xmm3
+    add rsi, 64
+    add rdi, 64
+    dec rcx
+    jnz .loop
+.tail:
+    mov rcx, rdx
+    and rcx, 63
+    rep movsb
+    ret
+
+; void memcpy_avx(void* dst, const void* src, size_t n)
+;
+; Same shape with ymm0-3, 128 bytes per iteration.
+global memcpy_avx
+memcpy_avx:
+    mov rcx, rdx
+    shr rcx, 7
+    jz .tail
+.loop:
+    vmovdqu ymm0, [rsi]
+    vmovdqu ymm1, [rsi + 32]
+    vmovdqu ymm2, [rsi + 64]
+    vmovdqu ymm3, [rsi + 96]
+    vmovdqu [rdi], ymm0
+    vmovdqu [rdi + 32], ymm1
+    vmovdqu [rdi + 64], ymm2
+    vmovdqu [rdi + 96], ymm3
+    add rsi, 128
+    add rdi, 128
+    dec rcx
+    jnz .loop
+.tail:
+    mov rcx, rdx
+    and rcx, 127
+    rep movsb
+    ret
@@ -9,10 +9,25 @@
 #include <Serial/serial.h>
 #include <PMM/pmm.h>
 #include <VMM/vmm.h>
+#include <VMM/wss.h>
 #include <GDT/GDT.h>
 #include <IDT/idt.h>
 #include <Drivers/PS2Keyboard.h>
 #include <sched/scheduler.h>
+#include <sched/taskpool.h>
+#include <sched/kthread.h>
+#include <sched/idle.h>
+#include <sched/process.h>
+#include <sched/coroutine.h>
+#include <sched/trace.h>
+#include <smp/smp.h>
+#include <Drivers/LAPIC.h>
+#include <Drivers/HPET.h>
+#include <Drivers/IOAPIC.h>
+#include <ACPI/acpi.h>
+#include <ACPI/madt.h>
+#include <time/tick.h>
+#include <fpu/fpu.h>
 
 __attribute__((used, section(".limine_requests")))
 static volatile LIMINE_BASE_REVISION(3);
@@ -32,6 +47,22 @@ static volatile struct limine_hhdm_request hhdm_request = {
     .id = LIMINE_HHDM_REQUEST,
     .revision = 0
 };
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_executable_cmdline_request cmdline_request = {
+    .id = LIMINE_EXECUTABLE_CMDLINE_REQUEST,
+    .revision = 0
+};
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_mp_request mp_request = {
+    .id = LIMINE_MP_REQUEST,
+    .revision = 0,
+    .flags = LIMINE_MP_X2APIC     /* APIC IDs above 255 can only be started in x2APIC mode */
+};
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_rsdp_request rsdp_request = {
+    .id = LIMINE_RSDP_REQUEST,
+    .revision = 0
+};
 
 __attribute__((used, section(".limine_requests_start")))
 static volatile LIMINE_REQUESTS_START_MARKER;
@@ -51,6 +82,17 @@ static void hcf(void) {
     }
 }
 
+/* Debug queries typed on COM1 */
+static void serial_command(char c) {
+    switch (c) {
+    case 's': sched_dump_stats(); break;
+    case 't': tick_dump_stats(); break;
+    case 'i': idle_dump_stats(); break;
+    case 'r': trace_dump_async(); break;
+    default: break;
+    }
+}
+
 void kmain(void) {
     if (LIMINE_BASE_REVISION_SUPPORTED == false) {
         hcf();
@@ -149,50 +191,356 @@ void kmain(void) {
 
     vmm_init();
 
+    wss_init();
+
     gdt_init();
 
+    smp_init_bsp();
+
     pit_init(100);
 
     idt_init();
 
+    fpu_init();
+
+    idle_init();
+
+    serial_init();
+    serial_set_rx_handler(serial_command);
+
+    /* Base revision 3 reports the RSDP by physical address */
+    if (rsdp_request.response && acpi_init((uint64_t)rsdp_request.response->address)) {
+        madt_init();
+        hpet_init();
+    }
+
+    lapic_init();
+
+    /* From here the ISA IRQs come through the IOAPICs and the PICs stay masked */
+    ioapic_init();
+
+    tick_init();
+    wss_start();
+
     scheduler_init();
 
+    smp_init(mp_request.response);
+
+    if (cmdline_request.response)
+        smp_isolate_cpus(cmdline_request.response->cmdline);
+
+    taskpool_init();
+    kthread_init(16);
+    co_init();
+
+    sched_bench_switch(10000);
+    sched_bench_pick_switch(1000);
+
+    void test_taskpool();
+    test_taskpool();
+
+    void test_deadline();
+    test_deadline();
+
     void test_sched();
     test_sched();
 
-    hcf();
+    void test_kthread();
+    test_kthread();
+
+    void test_process();
+    test_process();
+
+    void test_coroutine();
+    test_coroutine();
+
+    /* The boot context becomes this CPU's idle procedure */
+    cpu_idle_loop();
 }
 
-void proc0() {
+int proc0(void *arg) {
+    (void)arg;
     for (int i = 0; i < 10000000; i++) {
         if (i % 1000 == 0) {
             serial_fwrite("Proc0 counted to: %d\n\r", i);
         }
     }
     serial_fwrite("Proc0 finished counting.\n\r");
+    return 0;
 }
 
-void proc1() {
+int proc1(void *arg) {
+    (void)arg;
     for (int i = 0; i < 10000000; i++) {
         if (i % 1000 == 0) {
             serial_fwrite("Proc1 counted to: %d\n\r", i);
         }
     }
     serial_fwrite("Proc1 finished counting.\n\r");
+    return 0;
+}
+
+static void taskpool_sum_range(void* arg, uint64_t lo, uint64_t hi) {
+    uint64_t sum = 0;
+    for (uint64_t i = lo; i < hi; i++) sum += i;
+    __atomic_fetch_add((uint64_t*)arg, sum, __ATOMIC_RELAXED);
+}
+
+void test_taskpool() {
+    uint64_t n = 1000000;
+    uint64_t sum = 0;
+    parallel_for(0, n, 4096, taskpool_sum_range, &sum);
+    serial_fwrite("Task pool: parallel sum %llu, expected %llu", sum, n * (n - 1) / 2);
+}
+
+/*
+ * EDF under load: more fair CPU hogs than CPUs, one periodic deadline task
+ * checking every job against its deadline, and one deadline task that never
+ * blocks and must be held to its reservation by throttling.
+ */
+#define DL_TEST_PERIOD_NS   50000000ULL
+#define DL_TEST_WORK_NS     4000000ULL
+#define DL_TEST_JOBS        40
+
+static volatile uint64_t dl_test_end = 0;
+static KThread *dl_runaway_thread = NULL;
+
+static void dl_spin_ns(uint64_t ns) {
+    uint64_t end = tick_get_ns() + ns;
+    while (tick_get_ns() < end)
+        asm volatile ("pause");
+}
+
+int dl_hog(void *arg) {
+    (void)arg;
+    while (tick_get_ns() < dl_test_end)
+        asm volatile ("pause");
+    return 0;
+}
+
+int dl_runaway(void *arg) {
+    (void)arg;
+    while (tick_get_ns() < dl_test_end)
+        asm volatile ("pause");
+    return 0;
+}
+
+int dl_periodic(void *arg) {
+    (void)arg;
+    uint64_t start = tick_get_ns();
+    uint32_t met = 0;
+    for (uint32_t k = 0; k < DL_TEST_JOBS; k++) {
+        uint64_t release = start + k * DL_TEST_PERIOD_NS;
+        dl_spin_ns(DL_TEST_WORK_NS);
+        if (tick_get_ns() <= release + DL_TEST_PERIOD_NS) met++;
+
+        uint64_t next = release + DL_TEST_PERIOD_NS;
+        uint64_t now = tick_get_ns();
+        if (now < next) sleep_ns(next - now);
+    }
+    serial_fwrite("EDF: %u of %u deadlines met under load", met, DL_TEST_JOBS);
+
+    /* Let the runaway finish its time, then check it got no more than its share */
+    while (tick_get_ns() < dl_test_end) sleep_ns(DL_TEST_PERIOD_NS);
+    Procedure *r = &dl_runaway_thread->proc;
+    uint64_t span = dl_test_end - start;
+    serial_fwrite("EDF: runaway ran %llu ms of %llu ms (reserved 10%%), throttled %llu times",
+                  r->time_used_ns / 1000000, span / 1000000, r->dl_throttles);
+    kthread_join(dl_runaway_thread);
+    return 0;
+}
+
+/* Reservations that each fit on their own, pinned to one CPU until their sum passes the cap */
+#define DL_ADMIT_PROBES     4
+#define DL_ADMIT_RUNTIME_NS (3 * DL_TEST_PERIOD_NS / 10)
+
+static int dl_probe(void *arg) {
+    (void)arg;
+    return 0;
+}
+
+static void test_deadline_admission(void) {
+    PerCpu *cpu = this_cpu();
+    KThread *probes[DL_ADMIT_PROBES];
+    uint32_t n = 0;
+    for (; n < DL_ADMIT_PROBES; n++) {
+        probes[n] = kthread_create(dl_probe, NULL);
+        if (!probes[n]) break;
+        sched_set_affinity(&probes[n]->proc, cpumask_of(cpu->cpu_id));
+    }
+
+    uint64_t bw = (DL_ADMIT_RUNTIME_NS << SCHED_DL_BW_SHIFT) / DL_TEST_PERIOD_NS;
+    uint64_t reserved = __atomic_load_n(&cpu->rq.dl_bw, __ATOMIC_RELAXED);
+    uint32_t fit = reserved < SCHED_DL_BW_LIMIT ? (uint32_t)((SCHED_DL_BW_LIMIT - reserved) / bw) : 0;
+
+    uint32_t admitted = 0;
+    while (admitted < n && sched_set_deadline(&probes[admitted]->proc, DL_ADMIT_RUNTIME_NS, DL_TEST_PERIOD_NS, DL_TEST_PERIOD_NS))
+        admitted++;
+    bool summed = admitted == fit && admitted < n;
+
+    /* Leaving the class gives the reservation back: the refused one fits now */
+    bool returned = false;
+    if (admitted && admitted < n) {
+        sched_set_nice(&probes[0]->proc, 0);
+        returned = sched_set_deadline(&probes[admitted]->proc, DL_ADMIT_RUNTIME_NS, DL_TEST_PERIOD_NS, DL_TEST_PERIOD_NS);
+    }
+    serial_fwrite("EDF: %u of %u 30%% reservations admitted on one CPU, %u expected; sum %s, bandwidth %s on leaving",
+                  admitted, n, fit, summed ? "capped" : "NOT capped", returned ? "returned" : "NOT returned");
+
+    /* Exiting releases the rest */
+    for (uint32_t i = 0; i < n; i++) {
+        kthread_start(probes[i]);
+        kthread_detach(probes[i]);
+    }
+}
+
+void test_deadline() {
+    dl_test_end = tick_get_ns() + (DL_TEST_JOBS + 10) * DL_TEST_PERIOD_NS;
+
+    KThread *periodic = kthread_create(dl_periodic, NULL);
+    KThread *runaway = kthread_create(dl_runaway, NULL);
+    KThread *greedy = kthread_create(dl_hog, NULL);
+    if (!periodic || !runaway || !greedy) return;
+
+    bool ok = sched_set_deadline(&periodic->proc, 2 * DL_TEST_WORK_NS, DL_TEST_PERIOD_NS, DL_TEST_PERIOD_NS)
+           && sched_set_deadline(&runaway->proc, DL_TEST_PERIOD_NS / 10, DL_TEST_PERIOD_NS, DL_TEST_PERIOD_NS);
+    dl_runaway_thread = runaway;
+
+    /* A full CPU's worth can never fit next to what is already reserved; it runs as one of the fair hogs */
+    bool rejected = !sched_set_deadline(&greedy->proc, DL_TEST_PERIOD_NS, DL_TEST_PERIOD_NS, DL_TEST_PERIOD_NS);
+    serial_fwrite("EDF: admission %s, overload %s", ok ? "ok" : "FAILED", rejected ? "rejected" : "NOT rejected");
+    test_deadline_admission();
+
+    kthread_start(greedy);
+    kthread_detach(greedy);
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        KThread *hog = kthread_run(dl_hog, NULL);
+        if (hog) kthread_detach(hog);
+    }
+    kthread_start(periodic);
+    kthread_detach(periodic);
+    kthread_start(runaway);
 }
 
 void test_sched() {
-    uint64_t stack0_base = (uint64_t)palloc();
-    uint64_t stack0_size = 4096;
-    uint64_t heap0_base = (uint64_t)palloc();
-    uint64_t heap0_size = 4096;
-    uint64_t stack1_base = (uint64_t)palloc();
-    uint64_t stack1_size = 4096;
-    uint64_t heap1_base = (uint64_t)palloc();
-    uint64_t heap1_size = 4096;
-    Procedure* proc0_ptr = create_proc(proc0, 0, 0, 0, 0, stack0_base, stack0_size, heap0_base, heap0_size);
-    Procedure* proc1_ptr = create_proc(proc1, 0, 0, 0, 0, stack1_base, stack1_size, heap1_base, heap1_size);
-
-    register_proc(proc0_ptr);
-    register_proc(proc1_ptr);
+    KThread *t0 = kthread_run(proc0, NULL);
+    KThread *t1 = kthread_run(proc1, NULL);
+    if (t0) kthread_detach(t0);
+    if (t1) kthread_detach(t1);
+}
+
+/* Spawn and join short-lived threads back to back, from a thread so the joins can block */
+#define KTHREAD_TEST_COUNT 256
+
+static int kthread_test_child(void *arg) {
+    return (int)(uintptr_t)arg;
+}
+
+static int kthread_test_main(void *arg) {
+    (void)arg;
+    uint64_t sum = 0;
+    uint64_t start = tick_get_ns();
+    for (uint32_t i = 0; i < KTHREAD_TEST_COUNT; i++) {
+        KThread *t = kthread_run(kthread_test_child, (void*)(uintptr_t)i);
+        if (!t) break;
+        sum += (uint64_t)kthread_join(t);
+    }
+    uint64_t ns = tick_get_ns() - start;
+    serial_fwrite("kthread: %u spawn+join, %llu ns each, exit code sum %llu, expected %llu",
+                  KTHREAD_TEST_COUNT, ns / KTHREAD_TEST_COUNT, sum, (uint64_t)KTHREAD_TEST_COUNT * (KTHREAD_TEST_COUNT - 1) / 2);
+    return 0;
+}
+
+void test_kthread() {
+    KThread *t = kthread_run(kthread_test_main, NULL);
+    if (t) kthread_detach(t);
+}
+
+/* Threads of one process: placed near each other, their run time summed into the process */
+#define PROCESS_TEST_THREADS    4
+#define PROCESS_TEST_WORK_NS    5000000ULL
+
+static volatile uint32_t process_test_cpu[PROCESS_TEST_THREADS];
+
+static int process_test_thread(void *arg) {
+    process_test_cpu[(uintptr_t)arg] = this_cpu()->cpu_id;
+    dl_spin_ns(PROCESS_TEST_WORK_NS);
+    return 0;
+}
+
+static int process_test_main(void *arg) {
+    (void)arg;
+    Process *process = process_create(kernel_process.cr3);
+    if (!process) return 0;
+
+    /* All created before any starts, so each placement sees its siblings */
+    KThread *threads[PROCESS_TEST_THREADS];
+    uint32_t started = 0;
+    for (; started < PROCESS_TEST_THREADS; started++) {
+        threads[started] = kthread_create_in(process, process_test_thread, (void*)(uintptr_t)started);
+        if (!threads[started]) break;
+    }
+    for (uint32_t i = 0; i < started; i++) kthread_start(threads[i]);
+    for (uint32_t i = 0; i < started; i++) kthread_join(threads[i]);
+
+    for (uint32_t i = 0; i < started; i++)
+        serial_fwrite("Process %u: thread %u ran on CPU %u", process->pid, i, process_test_cpu[i]);
+    serial_fwrite("Process %u: %llu us over %u threads, at least %llu expected", process->pid,
+                  process_time_ns(process) / 1000, started, started * PROCESS_TEST_WORK_NS / 1000);
+
+    /* The last of its threads to finish exiting frees it */
+    process_put(process);
+    return 0;
+}
+
+void test_process() {
+    KThread *t = kthread_run(process_test_main, NULL);
+    if (t) kthread_detach(t);
+}
+
+/* Many coroutines in flight on the one executor: all park on an event, then sleep and yield */
+#define COROUTINE_TEST_COUNT    512
+#define COROUTINE_TEST_YIELDS   4
+
+typedef struct {
+    Coroutine co;
+    uint32_t yields;
+} CoroutineTest;
+
+static CoroutineTest co_tests[COROUTINE_TEST_COUNT];
+static CoEvent co_test_event = CO_EVENT_INIT;
+static volatile bool co_test_go = false;
+static volatile uint32_t co_test_done = 0;
+
+static int co_test_step(Coroutine *co) {
+    CoroutineTest *t = (CoroutineTest*)co->arg;
+    CO_BEGIN(co);
+    co_await(co, &co_test_event, co_test_go);
+    co_sleep(co, 2000000);
+    for (t->yields = 0; t->yields < COROUTINE_TEST_YIELDS; t->yields++)
+        co_yield(co);
+    __atomic_fetch_add(&co_test_done, 1, __ATOMIC_RELAXED);
+    CO_END(co);
+}
+
+static int co_test_main(void *arg) {
+    (void)arg;
+    uint64_t start = tick_get_ns();
+    for (uint32_t i = 0; i < COROUTINE_TEST_COUNT; i++)
+        co_start(&co_tests[i].co, co_test_step, &co_tests[i]);
+
+    sleep_ns(1000000);
+    co_test_go = true;
+    co_event_signal(&co_test_event);
+
+    for (uint32_t i = 0; i < COROUTINE_TEST_COUNT; i++)
+        co_join(&co_tests[i].co);
+    serial_fwrite("coroutine: %u of %u finished in %llu us, %u bytes each", co_test_done, COROUTINE_TEST_COUNT,
+                  (tick_get_ns() - start) / 1000, (uint32_t)sizeof(Coroutine));
+    return 0;
+}
+
+void test_coroutine() {
+    KThread *t = kthread_run(co_test_main, NULL);
+    if (t) kthread_detach(t);
 }
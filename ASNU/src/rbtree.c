@@ -0,0 +1,214 @@
+#include "rbtree.h"
+
+static void rb_rotate_left(RbRoot *tree, RbNode *x) {
+    RbNode *y = x->right;
+    x->right = y->left;
+    if (y->left) y->left->parent = x;
+    y->parent = x->parent;
+    if (!x->parent) tree->root = y;
+    else if (x == x->parent->left) x->parent->left = y;
+    else x->parent->right = y;
+    y->left = x;
+    x->parent = y;
+}
+
+static void rb_rotate_right(RbRoot *tree, RbNode *x) {
+    RbNode *y = x->left;
+    x->left = y->right;
+    if (y->right) y->right->parent = x;
+    y->parent = x->parent;
+    if (!x->parent) tree->root = y;
+    else if (x == x->parent->right) x->parent->right = y;
+    else x->parent->left = y;
+    y->right = x;
+    x->parent = y;
+}
+
+/* Equal keys go to the right, so nodes with the same key stay in FIFO order */
+void rb_insert(RbRoot *tree, RbNode *node, RbLess less) {
+    RbNode *parent = NULL;
+    RbNode *cur = tree->root;
+    bool leftmost = true;
+
+    while (cur) {
+        parent = cur;
+        if (less(node, cur)) {
+            cur = cur->left;
+        } else {
+            cur = cur->right;
+            leftmost = false;
+        }
+    }
+
+    node->parent = parent;
+    node->left = node->right = NULL;
+    node->red = true;
+    if (!parent) tree->root = node;
+    else if (less(node, parent)) parent->left = node;
+    else parent->right = node;
+    if (leftmost) tree->leftmost = node;
+
+    while (node->parent && node->parent->red) {
+        RbNode *p = node->parent;
+        RbNode *g = p->parent;
+        if (p == g->left) {
+            RbNode *u = g->right;
+            if (u && u->red) {
+                p->red = false;
+                u->red = false;
+                g->red = true;
+                node = g;
+            } else {
+                if (node == p->right) {
+                    node = p;
+                    rb_rotate_left(tree, node);
+                    p = node->parent;
+                }
+                p->red = false;
+                g->red = true;
+                rb_rotate_right(tree, g);
+            }
+        } else {
+            RbNode *u = g->left;
+            if (u && u->red) {
+                p->red = false;
+                u->red = false;
+                g->red = true;
+                node = g;
+            } else {
+                if (node == p->left) {
+                    node = p;
+                    rb_rotate_right(tree, node);
+                    p = node->parent;
+                }
+                p->red = false;
+                g->red = true;
+                rb_rotate_left(tree, g);
+            }
+        }
+    }
+    tree->root->red = false;
+}
+
+static void rb_transplant(RbRoot *tree, RbNode *u, RbNode *v) {
+    if (!u->parent) tree->root = v;
+    else if (u == u->parent->left) u->parent->left = v;
+    else u->parent->right = v;
+    if (v) v->parent = u->parent;
+}
+
+static inline bool rb_is_black(const RbNode *n) {
+    return !n || !n->red;
+}
+
+static void rb_erase_fixup(RbRoot *tree, RbNode *x, RbNode *parent) {
+    while (x != tree->root && rb_is_black(x)) {
+        if (x == parent->left) {
+            RbNode *w = parent->right;
+            if (w->red) {
+                w->red = false;
+                parent->red = true;
+                rb_rotate_left(tree, parent);
+                w = parent->right;
+            }
+            if (rb_is_black(w->left) && rb_is_black(w->right)) {
+                w->red = true;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if (rb_is_black(w->right)) {
+                    w->left->red = false;
+                    w->red = true;
+                    rb_rotate_right(tree, w);
+                    w = parent->right;
+                }
+                w->red = parent->red;
+                parent->red = false;
+                if (w->right) w->right->red = false;
+                rb_rotate_left(tree, parent);
+                x = tree->root;
+                break;
+            }
+        } else {
+            RbNode *w = parent->left;
+            if (w->red) {
+                w->red = false;
+                parent->red = true;
+                rb_rotate_right(tree, parent);
+                w = parent->left;
+            }
+            if (rb_is_black(w->left) && rb_is_black(w->right)) {
+                w->red = true;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if (rb_is_black(w->left)) {
+                    w->right->red = false;
+                    w->red = true;
+                    rb_rotate_left(tree, w);
+                    w = parent->left;
+                }
+                w->red = parent->red;
+                parent->red = false;
+                if (w->left) w->left->red = false;
+                rb_rotate_right(tree, parent);
+                x = tree->root;
+                break;
+            }
+        }
+    }
+    if (x) x->red = false;
+}
+
+void rb_erase(RbRoot *tree, RbNode *node) {
+    if (tree->leftmost == node) tree->leftmost = rb_next(node);
+
+    RbNode *y = node;
+    RbNode *x;
+    RbNode *x_parent;
+    bool y_red = y->red;
+
+    if (!node->left) {
+        x = node->right;
+        x_parent = node->parent;
+        rb_transplant(tree, node, node->right);
+    } else if (!node->right) {
+        x = node->left;
+        x_parent = node->parent;
+        rb_transplant(tree, node, node->left);
+    } else {
+        y = node->right;
+        while (y->left) y = y->left;
+        y_red = y->red;
+        x = y->right;
+        if (y->parent == node) {
+            x_parent = y;
+        } else {
+            x_parent = y->parent;
+            rb_transplant(tree, y, y->right);
+            y->right = node->right;
+            y->right->parent = y;
+        }
+        rb_transplant(tree, node, y);
+        y->left = node->left;
+        y->left->parent = y;
+        y->red = node->red;
+    }
+
+    if (!y_red) rb_erase_fixup(tree, x, x_parent);
+    node->parent = node->left = node->right = NULL;
+}
+
+RbNode *rb_next(const RbNode *node) {
+    if (node->right) {
+        node = node->right;
+        while (node->left) node = node->left;
+        return (RbNode*)node;
+    }
+    RbNode *p = node->parent;
+    while (p && node == p->right) {
+        node = p;
+        p = p->parent;
+    }
+    return p;
+}
@@ -0,0 +1,41 @@
+#ifndef RBTREE_H
+#define RBTREE_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Intrusive red-black tree; the smallest node is cached for O(1) lookup */
+
+typedef struct RbNode {
+    struct RbNode *parent;
+    struct RbNode *left;
+    struct RbNode *right;
+    bool red;
+} RbNode;
+
+typedef struct {
+    RbNode *root;
+    RbNode *leftmost;
+} RbRoot;
+
+typedef bool (*RbLess)(const RbNode *a, const RbNode *b);
+
+#define RB_ROOT_INIT { NULL, NULL }
+
+#define rb_entry(ptr, type, member) \
+    ((type*)((uintptr_t)(ptr) - offsetof(type, member)))
+
+void rb_insert(RbRoot *tree, RbNode *node, RbLess less);
+void rb_erase(RbRoot *tree, RbNode *node);
+RbNode *rb_next(const RbNode *node);
+
+static inline RbNode *rb_first(const RbRoot *tree) {
+    return tree->leftmost;
+}
+
+static inline bool rb_empty(const RbRoot *tree) {
+    return tree->root == NULL;
+}
+
+#endif /* RBTREE_H */
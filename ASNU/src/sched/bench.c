@@ -0,0 +1,176 @@
+#include "scheduler.h"
+#include "runqueue.h"
+#include <string.h>
+#include <KiSimple.h>
+#include <Serial/serial.h>
+#include <time/tick.h>
+
+__attribute__((aligned(16)))
+static uint8_t bench_stack[4096];
+static uint64_t bench_main_rsp;
+static uint64_t bench_partner_rsp;
+
+static void bench_partner(void) {
+    for (;;) switch_kernel_stack(&bench_partner_rsp, bench_main_rsp, NULL);
+}
+
+/*
+ * Cycle cost of the voluntary switch path: ping-pong between the caller and a
+ * partner context that immediately switches back. Each round trip is two
+ * switches; results are reported per switch.
+ */
+void sched_bench_switch(uint32_t iterations) {
+    if (iterations == 0) return;
+
+    uint64_t *sp = (uint64_t*)(bench_stack + sizeof(bench_stack));
+    *--sp = 0;
+    *--sp = (uint64_t)&bench_partner;
+    for (int i = 0; i < 6; i++) *--sp = 0;
+    bench_partner_rsp = (uint64_t)sp;
+
+    uint64_t flags = irq_save();
+
+    /* Warm the caches and the return stack buffer */
+    for (int i = 0; i < 16; i++)
+        switch_kernel_stack(&bench_main_rsp, bench_partner_rsp, NULL);
+
+    uint64_t min = UINT64_MAX;
+    uint64_t max = 0;
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < iterations; i++) {
+        asm volatile ("lfence" : : : "memory");
+        uint64_t t0 = rdtsc();
+        switch_kernel_stack(&bench_main_rsp, bench_partner_rsp, NULL);
+        asm volatile ("lfence" : : : "memory");
+        uint64_t dt = rdtsc() - t0;
+
+        total += dt;
+        if (dt < min) min = dt;
+        if (dt > max) max = dt;
+    }
+
+    irq_restore(flags);
+
+    serial_fwrite("Switch benchmark: %u round trips, per switch min %llu avg %llu max %llu cycles",
+        iterations, min / 2, total / iterations / 2, max / 2);
+}
+
+/* Pick+switch benchmark: two fair procedures on a private run queue */
+static Procedure bench_procs[2];
+static RunQueue bench_rq;
+
+__attribute__((aligned(16)))
+static uint8_t bench_pick_stack[4096];
+
+/* What context_switch() does to both procedures, minus locking and the other classes */
+static void bench_pick_switch_once(Procedure *prev) {
+    uint64_t now = tick_get_ns();
+    prev->time_used_ns += now - prev->stats.exec_start;
+    prev->stats.exec_start = now;
+    prev->vruntime += SCHED_MIN_GRANULARITY_NS;     /* equal steps: the two strictly alternate */
+    prev->proc_state = PROC_READY;
+    sched_fair_class.enqueue(&bench_rq, prev, 0);
+    prev->on_rq = true;
+    prev->stats.ready_since = now;
+    prev->stats.nr_involuntary++;
+
+    Procedure *next = sched_fair_class.pick_next(&bench_rq);
+    sched_fair_class.dequeue(&bench_rq, next);
+    next->on_rq = false;
+    next->proc_state = PROC_RUNNING;
+    next->slice_start_ns = next->time_used_ns;
+    next->stats.exec_start = now;
+    next->stats.nr_switches++;
+    next->stats.wait_ns += now - next->stats.ready_since;
+    next->on_cpu = true;
+
+    switch_kernel_stack(&prev->kernel_rsp, next->kernel_rsp, prev);
+    prev->on_cpu = true;
+}
+
+static void bench_pick_partner(void) {
+    for (;;) bench_pick_switch_once(&bench_procs[1]);
+}
+
+static void bench_flush(const void *p, size_t size) {
+    for (uintptr_t a = (uintptr_t)p & ~(uintptr_t)(CACHE_LINE_SIZE - 1); a < (uintptr_t)p + size; a += CACHE_LINE_SIZE)
+        asm volatile ("clflush (%0)" : : "r"(a) : "memory");
+}
+
+/* Fields of a Procedure the pick+switch path reads or writes, to count the cache lines behind them */
+#define BENCH_FIELD(f) { offsetof(Procedure, f), sizeof(((Procedure*)0)->f) }
+static const struct { size_t off, size; } bench_hot_fields[] = {
+    BENCH_FIELD(kernel_rsp), BENCH_FIELD(proc_state), BENCH_FIELD(cpu), BENCH_FIELD(on_cpu),
+    BENCH_FIELD(on_rq), BENCH_FIELD(sched_class), BENCH_FIELD(weight), BENCH_FIELD(time_used_ns),
+    BENCH_FIELD(time_slice_ns), BENCH_FIELD(slice_start_ns), BENCH_FIELD(vruntime), BENCH_FIELD(affinity),
+    BENCH_FIELD(fair_node), BENCH_FIELD(process), BENCH_FIELD(fpu_state), BENCH_FIELD(fpu_cpu), BENCH_FIELD(woken),
+    BENCH_FIELD(stats.exec_start), BENCH_FIELD(stats.ready_since), BENCH_FIELD(stats.wait_ns),
+    BENCH_FIELD(stats.max_wait_ns), BENCH_FIELD(stats.nr_switches), BENCH_FIELD(stats.nr_voluntary),
+    BENCH_FIELD(stats.nr_involuntary),
+};
+
+static uint32_t bench_hot_lines(void) {
+    uint64_t lines = 0;
+    for (size_t i = 0; i < sizeof(bench_hot_fields) / sizeof(bench_hot_fields[0]); i++) {
+        size_t first = bench_hot_fields[i].off / CACHE_LINE_SIZE;
+        size_t last = (bench_hot_fields[i].off + bench_hot_fields[i].size - 1) / CACHE_LINE_SIZE;
+        for (size_t l = first; l <= last; l++) lines |= 1ULL << l;
+    }
+    return (uint32_t)__builtin_popcountll(lines);
+}
+
+/*
+ * Cost of the scheduler's pick+switch between two fair procedures, warm and
+ * with both procedures and the run queue flushed from the cache first, as
+ * after the work that runs between two switches. Each round trip is two
+ * pick+switches; results are per pick+switch. Also reports how many cache
+ * lines of a Procedure the path touches.
+ */
+void sched_bench_pick_switch(uint32_t iterations) {
+    if (iterations == 0) return;
+
+    memset(bench_procs, 0, sizeof(bench_procs));
+    memset(&bench_rq, 0, sizeof(bench_rq));
+    for (int i = 0; i < 2; i++) {
+        bench_procs[i].sched_class = SCHED_CLASS_FAIR;
+        bench_procs[i].weight = SCHED_NICE0_WEIGHT;
+    }
+
+    uint64_t *sp = (uint64_t*)(bench_pick_stack + sizeof(bench_pick_stack));
+    *--sp = 0;
+    *--sp = (uint64_t)&bench_pick_partner;
+    for (int i = 0; i < 6; i++) *--sp = 0;
+    bench_procs[1].kernel_rsp = (uint64_t)sp;
+    bench_procs[1].vruntime = 0;
+    bench_procs[0].vruntime = 0;
+    sched_fair_class.enqueue(&bench_rq, &bench_procs[1], 0);
+    bench_procs[1].on_rq = true;
+
+    uint64_t flags = irq_save();
+
+    for (int i = 0; i < 16; i++)
+        bench_pick_switch_once(&bench_procs[0]);
+
+    uint64_t warm = 0, cold = 0;
+    for (uint32_t i = 0; i < iterations; i++) {
+        asm volatile ("mfence; lfence" : : : "memory");
+        uint64_t t0 = rdtsc();
+        bench_pick_switch_once(&bench_procs[0]);
+        asm volatile ("lfence" : : : "memory");
+        warm += rdtsc() - t0;
+
+        bench_flush(bench_procs, sizeof(bench_procs));
+        bench_flush(&bench_rq, sizeof(bench_rq));
+        asm volatile ("mfence; lfence" : : : "memory");
+        t0 = rdtsc();
+        bench_pick_switch_once(&bench_procs[0]);
+        asm volatile ("lfence" : : : "memory");
+        cold += rdtsc() - t0;
+    }
+
+    irq_restore(flags);
+
+    serial_fwrite("Pick+switch benchmark: %u round trips, per pick+switch warm %llu cold %llu cycles, %u of %u Procedure cache lines touched",
+        iterations, warm / iterations / 2, cold / iterations / 2, bench_hot_lines(),
+        (uint32_t)((sizeof(Procedure) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE));
+}
@@ -0,0 +1,172 @@
+#include "coroutine.h"
+#include "kthread.h"
+#include <Serial/serial.h>
+
+/*
+ * One executor thread runs the ready coroutines in FIFO order, a step each.
+ * Wakeups come from interrupt handlers, timers and other threads, so the
+ * ready list is taken with interrupts off. A coroutine is on the ready list
+ * at most once; waking it while its step runs queues it again, and since
+ * every wait re-checks its condition an extra step is harmless.
+ */
+
+static Spinlock co_ready_lock = SPINLOCK_INIT;
+static Coroutine *co_ready_head, *co_ready_tail;
+static WaitQueue co_executor_wq = WAITQUEUE_INIT;
+static WaitQueue co_done_wq = WAITQUEUE_INIT;
+
+static void co_ready_del(Coroutine *co) {
+    if (co->prev) co->prev->next = co->next;
+    else co_ready_head = co->next;
+    if (co->next) co->next->prev = co->prev;
+    else co_ready_tail = co->prev;
+    co->next = co->prev = NULL;
+    co->queued = false;
+}
+
+void co_wake(Coroutine *co) {
+    uint64_t flags = spin_lock_irqsave(&co_ready_lock);
+    bool queue = !co->queued && !co->finished;
+    if (queue) {
+        co->queued = true;
+        co->next = NULL;
+        co->prev = co_ready_tail;
+        if (co_ready_tail) co_ready_tail->next = co;
+        else co_ready_head = co;
+        co_ready_tail = co;
+    }
+    spin_unlock_irqrestore(&co_ready_lock, flags);
+    if (queue) wake_up_one(&co_executor_wq);
+}
+
+static void co_timer_fn(void *arg) {
+    co_wake((Coroutine*)arg);
+}
+
+void co_start(Coroutine *co, int (*fn)(Coroutine *co), void *arg) {
+    co->fn = fn;
+    co->arg = arg;
+    co->state = 0;
+    co->timed_out = false;
+    co->queued = false;
+    co->finished = false;
+    co->next = co->prev = NULL;
+    co->event = NULL;
+    co->ev_next = co->ev_prev = NULL;
+    timer_init(&co->timer, co_timer_fn, co);
+    co_wake(co);
+}
+
+void co_join(Coroutine *co) {
+    wait_event(&co_done_wq, __atomic_load_n(&co->finished, __ATOMIC_ACQUIRE));
+}
+
+/* Nothing can wake co any more once it is off its event, its timer and the ready list */
+static void co_finish(Coroutine *co) {
+    __co_event_del(co->event, co);
+    del_timer(&co->timer);
+
+    uint64_t flags = spin_lock_irqsave(&co_ready_lock);
+    if (co->queued) co_ready_del(co);
+    __atomic_store_n(&co->finished, true, __ATOMIC_RELEASE);
+    spin_unlock_irqrestore(&co_ready_lock, flags);
+    wake_up_all(&co_done_wq);
+}
+
+static Coroutine *co_ready_pop(void) {
+    uint64_t flags = spin_lock_irqsave(&co_ready_lock);
+    Coroutine *co = co_ready_head;
+    if (co) co_ready_del(co);
+    spin_unlock_irqrestore(&co_ready_lock, flags);
+    return co;
+}
+
+static int co_executor(void *arg) {
+    (void)arg;
+    for (;;) {
+        wait_event(&co_executor_wq, __atomic_load_n(&co_ready_head, __ATOMIC_ACQUIRE) != NULL);
+
+        Coroutine *co;
+        while ((co = co_ready_pop())) {
+            switch (co->fn(co)) {
+            case CO_YIELD:
+                co_wake(co);
+                break;
+            case CO_DONE:
+                co_finish(co);
+                break;
+            default:
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+void co_init(void) {
+    KThread *t = kthread_run(co_executor, NULL);
+    if (!t) {
+        serial_fwrite("Coroutine executor could not be started");
+        return;
+    }
+    kthread_detach(t);
+}
+
+void co_event_init(CoEvent *ev) {
+    spin_lock_init(&ev->lock);
+    ev->head = ev->tail = NULL;
+}
+
+void __co_event_add(CoEvent *ev, Coroutine *co) {
+    if (!ev || co->event == ev) return;
+    uint64_t flags = spin_lock_irqsave(&ev->lock);
+    co->event = ev;
+    co->ev_next = NULL;
+    co->ev_prev = ev->tail;
+    if (ev->tail) ev->tail->ev_next = co;
+    else ev->head = co;
+    ev->tail = co;
+    spin_unlock_irqrestore(&ev->lock, flags);
+    /* Pairs with the fence in co_event_signal(): the condition is read after queueing */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void co_event_unlink(CoEvent *ev, Coroutine *co) {
+    if (co->ev_prev) co->ev_prev->ev_next = co->ev_next;
+    else ev->head = co->ev_next;
+    if (co->ev_next) co->ev_next->ev_prev = co->ev_prev;
+    else ev->tail = co->ev_prev;
+    co->ev_next = co->ev_prev = NULL;
+    co->event = NULL;
+}
+
+void __co_event_del(CoEvent *ev, Coroutine *co) {
+    if (!ev) return;
+    uint64_t flags = spin_lock_irqsave(&ev->lock);
+    if (co->event == ev) co_event_unlink(ev, co);
+    spin_unlock_irqrestore(&ev->lock, flags);
+}
+
+void co_event_signal(CoEvent *ev) {
+    /* The caller's condition update is visible before the waiters are looked at */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&ev->head, __ATOMIC_RELAXED)) return;
+
+    uint64_t flags = spin_lock_irqsave(&ev->lock);
+    while (ev->head) {
+        Coroutine *co = ev->head;
+        co_event_unlink(ev, co);
+        co_wake(co);
+    }
+    spin_unlock_irqrestore(&ev->lock, flags);
+}
+
+void __co_arm(Coroutine *co, uint64_t ns) {
+    del_timer(&co->timer);
+    add_timer(&co->timer, ns, ns >> TIMER_SLACK_SHIFT);
+}
+
+/* An event wakes the waiter itself, so only the deadline needs a timer; otherwise poll */
+uint64_t __co_wait_ns(const CoEvent *ev, uint64_t left) {
+    return ev || left < CO_POLL_NS ? left : CO_POLL_NS;
+}
@@ -0,0 +1,138 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sync/spinlock.h>
+#include <sync/waitqueue.h>
+#include <time/timer.h>
+#include <time/tick.h>
+
+/*
+ * Stackless kernel coroutines for driver state machines. A coroutine is a
+ * step function called again from the top every time it resumes; CO_BEGIN
+ * switches on the source line where it last suspended. Nothing on the stack survives
+ * a suspension, so locals must be recomputed and lasting state kept in the
+ * structure embedding the Coroutine (reach it through co->arg). All
+ * coroutines run one step at a time on a single executor thread, so an
+ * in-flight operation costs one Coroutine and no stack.
+ *
+ * The suspending macros are statements, one per source line, and only at
+ * the top level of the step function or inside its loops and branches,
+ * never inside a switch of its own. CO_END closes the body opened by
+ * CO_BEGIN; CO_EXIT finishes early from anywhere inside it.
+ */
+
+/* Step function results */
+#define CO_YIELD    0           /* run again after the other ready coroutines */
+#define CO_WAIT     1           /* run again once woken */
+#define CO_DONE     2
+
+/* Period at which a condition without an event is polled: one timer wheel unit */
+#define CO_POLL_NS  (1ULL << TIMER_UNIT_SHIFT)
+
+struct CoEvent;
+
+typedef struct Coroutine {
+    int (*fn)(struct Coroutine *co);
+    void *arg;
+    uint32_t state;             /* line to continue at, 0 to start */
+    uint64_t deadline;          /* of the current timed wait, tick_get_ns() time */
+    bool timed_out;             /* the last timed wait ran out before its condition held */
+    volatile bool queued;       /* on the executor's ready list */
+    volatile bool finished;
+    struct Coroutine *next, *prev;          /* ready list */
+    struct CoEvent *event;                  /* being waited on, under its lock */
+    struct Coroutine *ev_next, *ev_prev;
+    Timer timer;
+} Coroutine;
+
+/*
+ * Something coroutines wait for. As with a WaitQueue the condition lives
+ * with the caller: change it, then co_event_signal(). Signalling is cheap
+ * enough for interrupt handlers.
+ */
+typedef struct CoEvent {
+    Spinlock lock;
+    Coroutine *head, *tail;
+} CoEvent;
+
+#define CO_EVENT_INIT { SPINLOCK_INIT, NULL, NULL }
+
+/* Start the executor thread; needs kernel threads */
+void co_init(void);
+
+/* Queue co to run fn(co) from the start; co must stay valid until it finishes */
+void co_start(Coroutine *co, int (*fn)(Coroutine *co), void *arg);
+/* Make co run its next step; from any context, harmless if it is queued already */
+void co_wake(Coroutine *co);
+/* Block the calling thread until co has finished */
+void co_join(Coroutine *co);
+
+void co_event_init(CoEvent *ev);
+/* Wake every coroutine waiting on ev */
+void co_event_signal(CoEvent *ev);
+
+/* Internals of the macros below */
+void __co_event_add(CoEvent *ev, Coroutine *co);
+void __co_event_del(CoEvent *ev, Coroutine *co);
+void __co_arm(Coroutine *co, uint64_t ns);
+uint64_t __co_wait_ns(const CoEvent *ev, uint64_t left);
+
+#define __co_suspend(co, ret) do {                              \
+    (co)->state = __LINE__;                                     \
+    return (ret);                                               \
+    case __LINE__:;                                             \
+} while (0)
+
+#define CO_BEGIN(co) switch ((co)->state) { case 0:
+
+#define CO_END(co) } return CO_DONE
+
+#define CO_EXIT(co) return CO_DONE
+
+/* Let the other ready coroutines run */
+#define co_yield(co) __co_suspend((co), CO_YIELD)
+
+/* Suspend until cond is true; cond is re-evaluated after every wakeup */
+#define co_await(co, ev, cond) do {                             \
+    for (;;) {                                                  \
+        __co_event_add((ev), (co));                             \
+        if (cond) break;                                        \
+        __co_suspend((co), CO_WAIT);                            \
+    }                                                           \
+    __co_event_del((ev), (co));                                 \
+} while (0)
+
+/*
+ * As co_await, giving up after ns; co->timed_out tells which happened.
+ * With ev NULL, cond is polled every CO_POLL_NS, for hardware that does
+ * not interrupt.
+ */
+#define co_await_timeout(co, ev, cond, ns) do {                 \
+    (co)->deadline = tick_get_ns() + (ns);                      \
+    for (;;) {                                                  \
+        __co_event_add((ev), (co));                             \
+        if (!((co)->timed_out = !(cond))) break;                \
+        uint64_t __now = tick_get_ns();                         \
+        if (__now >= (co)->deadline) break;                     \
+        __co_arm((co), __co_wait_ns((ev), (co)->deadline - __now)); \
+        __co_suspend((co), CO_WAIT);                            \
+    }                                                           \
+    __co_event_del((ev), (co));                                 \
+    del_timer(&(co)->timer);                                    \
+} while (0)
+
+/* Suspend for at least ns */
+#define co_sleep(co, ns) do {                                   \
+    (co)->deadline = tick_get_ns() + (ns);                      \
+    for (;;) {                                                  \
+        uint64_t __now = tick_get_ns();                         \
+        if (__now >= (co)->deadline) break;                     \
+        __co_arm((co), (co)->deadline - __now);                 \
+        __co_suspend((co), CO_WAIT);                            \
+    }                                                           \
+    del_timer(&(co)->timer);                                    \
+} while (0)
+
+#endif /* COROUTINE_H */
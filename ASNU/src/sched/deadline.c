@@ -0,0 +1,105 @@
+#include "runqueue.h"
+#include <time/tick.h>
+#include <time/timer.h>
+
+/*
+ * Earliest-deadline-first class. A procedure reserves dl_runtime out of
+ * every dl_period, and each job must finish within dl_deadline of its
+ * release. Procedures are partitioned: admission pins each one to a CPU
+ * whose reserved density stays under SCHED_DL_BW_LIMIT, and EDF on that CPU
+ * then meets every deadline.
+ *
+ * The budget is enforced like a constant bandwidth server. A procedure that
+ * uses up its runtime is throttled, off every queue, until dl_timer starts
+ * its next period, so a runaway cannot take more than it reserved.
+ * Enforcement is as fine as the tick.
+ */
+
+static inline Procedure *dl_entry(const RbNode *node) {
+    return rb_entry(node, Procedure, dl_node);
+}
+
+static inline bool deadline_before(uint64_t a, uint64_t b) {
+    return (int64_t)(a - b) < 0;
+}
+
+static bool dl_less(const RbNode *a, const RbNode *b) {
+    return deadline_before(dl_entry(a)->dl_abs_deadline, dl_entry(b)->dl_abs_deadline);
+}
+
+/* Would running out the remaining budget before the deadline exceed the reserved density */
+static bool dl_overflows(Procedure *p, uint64_t now) {
+    if (p->dl_budget <= 0) return true;
+    unsigned __int128 lhs = (unsigned __int128)(uint64_t)p->dl_budget * p->dl_deadline;
+    unsigned __int128 rhs = (unsigned __int128)(p->dl_abs_deadline - now) * p->dl_runtime;
+    return lhs > rhs;
+}
+
+/* A waking procedure keeps its current job only if that still fits its reservation */
+static void dl_update_job(Procedure *p, uint64_t now) {
+    if (!deadline_before(now, p->dl_abs_deadline) || dl_overflows(p, now)) {
+        p->dl_abs_deadline = now + p->dl_deadline;
+        p->dl_budget = (int64_t)p->dl_runtime;
+    }
+}
+
+static void dl_enqueue(RunQueue *rq, Procedure *p, int flags) {
+    if (flags & (ENQUEUE_WAKEUP | ENQUEUE_NEW))
+        dl_update_job(p, tick_get_ns());
+
+    rb_insert(&rq->dl_tree, &p->dl_node, dl_less);
+    rq->dl_nr++;
+}
+
+static void dl_dequeue(RunQueue *rq, Procedure *p) {
+    rb_erase(&rq->dl_tree, &p->dl_node);
+    rq->dl_nr--;
+}
+
+static Procedure *dl_pick_next(RunQueue *rq) {
+    RbNode *left = rb_first(&rq->dl_tree);
+    if (!left) return NULL;
+    Procedure *p = dl_entry(left);
+    p->time_slice_ns = p->dl_budget > 0 ? (uint64_t)p->dl_budget : 0;
+    return p;
+}
+
+static void dl_tick(RunQueue *rq, Procedure *curr, uint64_t delta_ns) {
+    curr->dl_budget -= (int64_t)delta_ns;
+    if (curr->dl_budget <= 0) {
+        /* Sleep until the next period: the release of this job plus one period */
+        uint64_t now = tick_get_ns();
+        uint64_t next = curr->dl_abs_deadline - curr->dl_deadline + curr->dl_period;
+        curr->dl_throttled = true;
+        curr->dl_throttles++;
+        rq->need_resched = true;
+        add_timer(&curr->dl_timer, deadline_before(now, next) ? next - now : 0, 0);
+        return;
+    }
+
+    RbNode *left = rb_first(&rq->dl_tree);
+    if (left && deadline_before(dl_entry(left)->dl_abs_deadline, curr->dl_abs_deadline))
+        rq->need_resched = true;
+}
+
+static bool dl_check_preempt(RunQueue *rq, Procedure *curr, Procedure *woken) {
+    (void)rq;
+    return deadline_before(woken->dl_abs_deadline, curr->dl_abs_deadline);
+}
+
+/* Next period for a throttled procedure; an overrun is paid back out of the new budget */
+void dl_replenish(Procedure *p) {
+    do {
+        p->dl_abs_deadline += p->dl_period;
+        p->dl_budget += (int64_t)p->dl_runtime;
+    } while (p->dl_budget <= 0);
+    p->dl_throttled = false;
+}
+
+const SchedClassOps sched_dl_class = {
+    .enqueue = dl_enqueue,
+    .dequeue = dl_dequeue,
+    .pick_next = dl_pick_next,
+    .tick = dl_tick,
+    .check_preempt = dl_check_preempt,
+};
@@ -0,0 +1,143 @@
+#include "runqueue.h"
+
+/*
+ * Weighted fair class. Each procedure accumulates virtual runtime, real
+ * runtime scaled by NICE0_WEIGHT / weight, and the ready procedure with the
+ * smallest vruntime runs next. Within SCHED_LATENCY_NS every ready procedure
+ * gets a slice proportional to its weight.
+ *
+ * Procedures waking from a sleep are placed up to half a latency period
+ * behind min_vruntime, so an interactive task that mostly sleeps runs ahead
+ * of CPU-bound ones as soon as it wakes, while a long sleep cannot bank more
+ * than that bonus.
+ */
+
+/* Same geometric table as other fair schedulers: each nice step is ~10% CPU */
+static const uint32_t nice_to_weight[40] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */  9548,  7620,  6100,  4904,  3906,
+    /*  -5 */  3121,  2501,  1991,  1586,  1277,
+    /*   0 */  1024,   820,   655,   526,   423,
+    /*   5 */   335,   272,   215,   172,   137,
+    /*  10 */   110,    87,    70,    56,    45,
+    /*  15 */    36,    29,    23,    18,    15,
+};
+
+uint32_t sched_nice_to_weight(int nice) {
+    if (nice < SCHED_NICE_MIN) nice = SCHED_NICE_MIN;
+    if (nice > SCHED_NICE_MAX) nice = SCHED_NICE_MAX;
+    return nice_to_weight[nice - SCHED_NICE_MIN];
+}
+
+static inline Procedure *fair_entry(const RbNode *node) {
+    return rb_entry(node, Procedure, fair_node);
+}
+
+/* vruntime wraps, so compare through the signed difference */
+static inline bool vruntime_before(uint64_t a, uint64_t b) {
+    return (int64_t)(a - b) < 0;
+}
+
+static bool fair_less(const RbNode *a, const RbNode *b) {
+    return vruntime_before(fair_entry(a)->vruntime, fair_entry(b)->vruntime);
+}
+
+static inline uint64_t fair_scale(uint64_t delta_ns, uint32_t weight) {
+    return delta_ns * SCHED_NICE0_WEIGHT / weight;
+}
+
+static void fair_update_min_vruntime(RunQueue *rq, Procedure *curr) {
+    bool have = false;
+    uint64_t vr = 0;
+
+    if (curr && curr->sched_class == SCHED_CLASS_FAIR) {
+        vr = curr->vruntime;
+        have = true;
+    }
+
+    RbNode *left = rb_first(&rq->fair_tree);
+    if (left) {
+        uint64_t lv = fair_entry(left)->vruntime;
+        if (!have || vruntime_before(lv, vr)) vr = lv;
+        have = true;
+    }
+
+    /* min_vruntime only moves forward */
+    if (have && vruntime_before(rq->min_vruntime, vr))
+        rq->min_vruntime = vr;
+}
+
+static void fair_place(RunQueue *rq, Procedure *p, int flags) {
+    uint64_t vr = rq->min_vruntime;
+    if (flags & ENQUEUE_WAKEUP)
+        vr -= SCHED_LATENCY_NS / 2;
+
+    if (vruntime_before(p->vruntime, vr) || (flags & ENQUEUE_NEW))
+        p->vruntime = vr;
+}
+
+static void fair_enqueue(RunQueue *rq, Procedure *p, int flags) {
+    if (flags & (ENQUEUE_WAKEUP | ENQUEUE_NEW))
+        fair_place(rq, p, flags);
+
+    rb_insert(&rq->fair_tree, &p->fair_node, fair_less);
+    rq->fair_load += p->weight;
+    rq->fair_nr++;
+}
+
+static void fair_dequeue(RunQueue *rq, Procedure *p) {
+    rb_erase(&rq->fair_tree, &p->fair_node);
+    rq->fair_load -= p->weight;
+    rq->fair_nr--;
+}
+
+/* Share of the latency period for p, given the ready load (which includes p) */
+static uint64_t fair_slice(RunQueue *rq, Procedure *p) {
+    uint64_t period = SCHED_LATENCY_NS;
+    uint64_t nr_latency = SCHED_LATENCY_NS / SCHED_MIN_GRANULARITY_NS;
+    if (rq->fair_nr > nr_latency)
+        period = rq->fair_nr * SCHED_MIN_GRANULARITY_NS;
+
+    uint64_t slice = period * p->weight / (rq->fair_load ? rq->fair_load : p->weight);
+    return slice < SCHED_MIN_GRANULARITY_NS ? SCHED_MIN_GRANULARITY_NS : slice;
+}
+
+static Procedure *fair_pick_next(RunQueue *rq) {
+    RbNode *left = rb_first(&rq->fair_tree);
+    if (!left) return NULL;
+    Procedure *p = fair_entry(left);
+    p->time_slice_ns = fair_slice(rq, p);
+    return p;
+}
+
+static void fair_tick(RunQueue *rq, Procedure *curr, uint64_t delta_ns) {
+    curr->vruntime += fair_scale(delta_ns, curr->weight);
+    fair_update_min_vruntime(rq, curr);
+
+    uint64_t ran = curr->time_used_ns - curr->slice_start_ns;
+    if (ran >= curr->time_slice_ns) {
+        rq->need_resched = true;
+        return;
+    }
+    if (ran < SCHED_MIN_GRANULARITY_NS) return;
+
+    /* Someone fell more than a slice behind: let them catch up early */
+    RbNode *left = rb_first(&rq->fair_tree);
+    if (left && (int64_t)(curr->vruntime - fair_entry(left)->vruntime) > (int64_t)curr->time_slice_ns)
+        rq->need_resched = true;
+}
+
+static bool fair_check_preempt(RunQueue *rq, Procedure *curr, Procedure *woken) {
+    (void)rq;
+    int64_t lead = (int64_t)(curr->vruntime - woken->vruntime);
+    return lead > (int64_t)fair_scale(SCHED_WAKEUP_GRANULARITY_NS, woken->weight);
+}
+
+const SchedClassOps sched_fair_class = {
+    .enqueue = fair_enqueue,
+    .dequeue = fair_dequeue,
+    .pick_next = fair_pick_next,
+    .tick = fair_tick,
+    .check_preempt = fair_check_preempt,
+};
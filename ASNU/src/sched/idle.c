@@ -0,0 +1,142 @@
+#include "idle.h"
+#include "scheduler.h"
+#include <KiSimple.h>
+#include <Serial/serial.h>
+#include <smp/smp.h>
+#include <time/tick.h>
+#include <time/timer.h>
+
+#define CPUID1_ECX_MONITOR      (1U << 3)
+#define CPUID5_ECX_EMX          (1U << 0)   /* MWAIT extensions are enumerated */
+#define CPUID5_ECX_IBE          (1U << 1)   /* interrupts break MWAIT even with IF clear */
+#define CPUID6_EAX_ARAT         (1U << 2)   /* the local APIC timer keeps running in deep C-states */
+
+#define MWAIT_ECX_IBE           1
+
+typedef struct {
+    const char *name;
+    uint32_t hint;              /* MWAIT EAX: C-state - 1 in bits 7:4, sub-state 0 */
+    uint64_t target_ns;         /* worth entering only if the CPU stays idle this long */
+} IdleStateDesc;
+
+static const IdleStateDesc idle_table[IDLE_MAX_STATES] = {
+    { "C1", 0x00, 0 },
+    { "C2", 0x10, 20000 },
+    { "C3", 0x20, 100000 },
+    { "C4", 0x30, 400000 },
+};
+
+static bool idle_mwait = false;
+static uint32_t idle_nr_states = 1;
+
+void idle_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    uint32_t max_leaf = eax;
+
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if ((ecx & CPUID1_ECX_MONITOR) && max_leaf >= 5) {
+        cpuid(5, 0, &eax, &ebx, &ecx, &edx);
+        idle_mwait = (ecx & CPUID5_ECX_EMX) && (ecx & CPUID5_ECX_IBE);
+        uint32_t substates = edx;
+
+        /* Without ARAT the timer would stop below C2 and the tick with it */
+        uint32_t limit = IDLE_MAX_STATES;
+        if (max_leaf >= 6) {
+            cpuid(6, 0, &eax, &ebx, &ecx, &edx);
+            if (!(eax & CPUID6_EAX_ARAT)) limit = 2;
+        } else {
+            limit = 2;
+        }
+
+        /* EDX nibble n counts the sub-states of C(n); stop at the first C-state without any */
+        idle_nr_states = 1;
+        while (idle_mwait && idle_nr_states < limit && ((substates >> (4 * (idle_nr_states + 1))) & 0xF))
+            idle_nr_states++;
+    }
+
+    serial_fwrite("Idle: %s, %u states", idle_mwait ? "mwait" : "hlt", idle_nr_states);
+}
+
+static inline void cpu_monitor(const volatile void *addr) {
+    asm volatile ("monitor" : : "a"(addr), "c"(0), "d"(0) : "memory");
+}
+
+static inline void cpu_mwait(uint32_t hint, uint32_t ext) {
+    asm volatile ("mwait" : : "a"(hint), "c"(ext) : "memory");
+}
+
+/* Deepest state worth entering before the next wakeup we know of */
+static uint32_t idle_select(PerCpu *cpu) {
+    uint64_t expect = cpu->tick.stopped ? timer_next_event_ns() : 1000000000ULL / tick_get_hz();
+    uint32_t s = 0;
+    while (s + 1 < idle_nr_states && idle_table[s + 1].target_ns <= expect) s++;
+    return s;
+}
+
+void idle_exit(PerCpu *cpu, uint64_t now) {
+    IdleState *is = &cpu->idle_state;
+    if (!is->entered) return;
+    is->residency_ns[is->state] += now - is->entered;
+    is->entered = 0;
+}
+
+bool idle_polling(PerCpu *cpu) {
+    return __atomic_load_n(&cpu->idle_state.polling, __ATOMIC_RELAXED);
+}
+
+/*
+ * Called with interrupts off and nothing queued; returns with them on.
+ * MWAIT runs with IF still clear and interrupts as break events, so the
+ * residency is charged before any handler can switch away. After HLT the
+ * handler runs first, and context_switch() charges it if it leaves idle.
+ */
+static void idle_enter(PerCpu *cpu) {
+    IdleState *is = &cpu->idle_state;
+    volatile bool *flag = &cpu->rq.need_resched;
+
+    is->state = (uint8_t)idle_select(cpu);
+    is->entries[is->state]++;
+
+    if (idle_mwait) {
+        __atomic_store_n(&is->polling, true, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        cpu_monitor(flag);
+        if (!*flag) {
+            is->entered = tick_get_ns();
+            cpu_mwait(idle_table[is->state].hint, MWAIT_ECX_IBE);
+            idle_exit(cpu, tick_get_ns());
+        }
+        __atomic_store_n(&is->polling, false, __ATOMIC_RELAXED);
+        asm volatile ("sti" : : : "memory");
+        return;
+    }
+
+    is->entered = tick_get_ns();
+    asm volatile ("sti; hlt" : : : "memory");
+    idle_exit(cpu, tick_get_ns());
+}
+
+void cpu_idle_loop(void) {
+    PerCpu *cpu = this_cpu();
+    for (;;) {
+        irq_save();
+        if (cpu->rq.need_resched || cpu->rq.nr_ready || sched_idle_balance()) {
+            context_switch();
+            asm volatile ("sti" : : : "memory");
+            continue;
+        }
+        tick_nohz_update();
+        idle_enter(cpu);
+    }
+}
+
+void idle_dump_stats(void) {
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        PerCpu *cpu = smp_get_cpu(i);
+        if (!cpu->online) continue;
+        for (uint32_t s = 0; s < idle_nr_states; s++)
+            serial_fwrite("Idle CPU %u %s: %llu us in %llu entries", i, idle_table[s].name,
+                          cpu->idle_state.residency_ns[s] / 1000, cpu->idle_state.entries[s]);
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef IDLE_H
+#define IDLE_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * The idle loop each CPU's boot context ends in. With MONITOR/MWAIT it
+ * waits on the run queue's need_resched flag, so a wakeup from another CPU
+ * is the store itself and needs no IPI, and picks the deepest C-state whose
+ * target residency fits before the next timer. Without it, HLT.
+ */
+
+#define IDLE_MAX_STATES 4       /* C1 .. C4 */
+
+typedef struct IdleState {
+    volatile bool polling;      /* in MWAIT on rq.need_resched */
+    uint8_t state;              /* entered, index into the state table */
+    uint64_t entered;           /* tick_get_ns() at entry, 0 while not idle */
+    uint64_t residency_ns[IDLE_MAX_STATES];
+    uint64_t entries[IDLE_MAX_STATES];
+} IdleState;
+
+struct PerCpu;
+
+/* Probe MWAIT and the C-states once, on the boot CPU */
+void idle_init(void);
+__attribute__((noreturn)) void cpu_idle_loop(void);
+
+/* Charge the residency of an idle period that ended at now; no-op if not idle */
+void idle_exit(struct PerCpu *cpu, uint64_t now);
+/* True if a store to the CPU's need_resched wakes it by itself */
+bool idle_polling(struct PerCpu *cpu);
+void idle_dump_stats(void);
+
+#endif /* IDLE_H */
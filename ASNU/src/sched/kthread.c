@@ -0,0 +1,156 @@
+#include "kthread.h"
+#include <string.h>
+#include <PMM/pmm.h>
+#include <VMM/vmm.h>
+#include <Serial/serial.h>
+#include <KiSimple.h>
+#include <sync/spinlock.h>
+#include <fpu/fpu.h>
+#include "process.h"
+
+/*
+ * Stack slots sit in a window of their own below the MMIO window, under
+ * the same top-level page table entry as the kernel image so every CPU's
+ * page tables see them. Slots are mapped once and never unmapped.
+ */
+#define KSTACK_WINDOW_BASE  0xFFFFFFFE00000000ULL
+#define KSTACK_WINDOW_SIZE  0x0000000100000000ULL
+
+_Static_assert(sizeof(KThread) <= 4096, "KThread must fit in its slot's last page");
+
+static Spinlock kstack_lock = SPINLOCK_INIT;
+static KThread *kstack_free;
+static uint64_t kstack_next = KSTACK_WINDOW_BASE;
+
+static inline uint64_t kstack_bottom(KThread *t) {
+    return (uint64_t)t - KTHREAD_STACK_PAGES * 4096ULL;
+}
+
+/* Map a fresh slot; palloc() hands out pages as they are, so each is zeroed here */
+static KThread *kstack_map(void) {
+    uint64_t flags = spin_lock_irqsave(&kstack_lock);
+    uint64_t slot = kstack_next;
+    bool ok = slot + KTHREAD_SLOT_SIZE <= KSTACK_WINDOW_BASE + KSTACK_WINDOW_SIZE;
+    if (ok) kstack_next += KTHREAD_SLOT_SIZE;
+    spin_unlock_irqrestore(&kstack_lock, flags);
+    if (!ok) return NULL;
+
+    /* A failure leaks the window range; the pages mapped so far stay with it */
+    for (uint32_t i = KTHREAD_GUARD_PAGES; i < KTHREAD_GUARD_PAGES + KTHREAD_STACK_PAGES + 1; i++) {
+        void *page = palloc();
+        if (!page) return NULL;
+        memset(page, 0, 4096);
+        mmap((void*)(slot + i * 4096ULL), VA2PA(page), PAGE_PRESENT | PAGE_RW);
+    }
+    return (KThread*)(slot + (KTHREAD_GUARD_PAGES + KTHREAD_STACK_PAGES) * 4096ULL);
+}
+
+static KThread *kstack_get(void) {
+    uint64_t flags = spin_lock_irqsave(&kstack_lock);
+    KThread *t = kstack_free;
+    if (t) kstack_free = t->next_free;
+    spin_unlock_irqrestore(&kstack_lock, flags);
+
+    if (t) {
+        t->next_free = NULL;
+        return t;
+    }
+    return kstack_map();
+}
+
+/* Zero the stack and the KThread page, then make the slot the next one handed out */
+static void kstack_put(KThread *t) {
+    memset((void*)kstack_bottom(t), 0, (KTHREAD_STACK_PAGES + 1) * 4096ULL);
+
+    uint64_t flags = spin_lock_irqsave(&kstack_lock);
+    t->next_free = kstack_free;
+    kstack_free = t;
+    spin_unlock_irqrestore(&kstack_lock, flags);
+}
+
+void kthread_init(uint32_t prealloc) {
+    for (uint32_t i = 0; i < prealloc; i++) {
+        KThread *t = kstack_map();
+        if (!t) break;
+        kstack_put(t);
+    }
+}
+
+static void kthread_put(KThread *t) {
+    if (__atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        kstack_put(t);
+}
+
+/* Task pool side of kthread_exit(): wait for the thread to leave its stack */
+static void kthread_reap(void *arg) {
+    KThread *t = (KThread*)arg;
+    while (__atomic_load_n(&t->proc.on_cpu, __ATOMIC_ACQUIRE))
+        asm volatile ("pause");
+
+    if (t->proc.dl_period) del_timer(&t->proc.dl_timer);
+    fpu_free_state(&t->proc);
+    kthread_put(t);
+}
+
+static void kthread_entry(void) {
+    KThread *t = (KThread*)scheduler_get_current();
+    kthread_exit(t->fn(t->arg));
+}
+
+KThread *kthread_create(int (*fn)(void *arg), void *arg) {
+    return kthread_create_in(&kernel_process, fn, arg);
+}
+
+KThread *kthread_create_in(Process *process, int (*fn)(void *arg), void *arg) {
+    KThread *t = kstack_get();
+    if (!t) return NULL;
+
+    if (!init_proc(&t->proc, process, (uint64_t)&kthread_entry, 0, NULL, NULL, 0, kstack_bottom(t), KTHREAD_STACK_PAGES * 4096ULL)) {
+        kstack_put(t);
+        return NULL;
+    }
+    t->fn = fn;
+    t->arg = arg;
+    t->exit_code = 0;
+    t->exited = false;
+    t->refs = 2;
+    waitqueue_init(&t->exit_wq);
+    t->reap.fn = kthread_reap;
+    t->reap.arg = t;
+    t->reap.done = NULL;
+    return t;
+}
+
+void kthread_start(KThread *t) {
+    register_proc(&t->proc);
+}
+
+KThread *kthread_run(int (*fn)(void *arg), void *arg) {
+    KThread *t = kthread_create(fn, arg);
+    if (t) kthread_start(t);
+    return t;
+}
+
+int kthread_join(KThread *t) {
+    wait_event(&t->exit_wq, __atomic_load_n(&t->exited, __ATOMIC_ACQUIRE));
+    int code = t->exit_code;
+    kthread_put(t);
+    return code;
+}
+
+void kthread_detach(KThread *t) {
+    kthread_put(t);
+}
+
+void kthread_exit(int code) {
+    KThread *t = (KThread*)scheduler_get_current();
+    t->exit_code = code;
+    __atomic_store_n(&t->exited, true, __ATOMIC_RELEASE);
+    wake_up_all(&t->exit_wq);
+
+    /* No preemption from here: the reaper must find us terminated, not merely off the CPU */
+    irq_save();
+    taskpool_submit(&t->reap);
+    sched_exit();
+    __builtin_unreachable();
+}
@@ -0,0 +1,54 @@
+#ifndef KTHREAD_H
+#define KTHREAD_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "scheduler.h"
+#include "taskpool.h"
+#include <sync/waitqueue.h>
+
+/*
+ * Kernel threads. Each one lives in a stack slot of its own in a window of
+ * kernel address space: unmapped guard pages, the stack, then the page
+ * holding the KThread itself. Slots are recycled through a free list and
+ * zeroed when they go back on it, so creating a thread maps nothing and
+ * allocates nothing but a PID. An exiting thread hands itself to the task
+ * pool, which recycles its slot once it is off the CPU and nobody holds a
+ * handle to it any more.
+ */
+
+#define KTHREAD_STACK_PAGES 4
+#define KTHREAD_GUARD_PAGES 3
+#define KTHREAD_SLOT_SIZE   ((KTHREAD_GUARD_PAGES + KTHREAD_STACK_PAGES + 1) * 4096ULL)
+
+typedef struct KThread {
+    Procedure proc;             /* first, so the running procedure is the thread */
+    int (*fn)(void *arg);
+    void *arg;
+    int exit_code;
+    volatile bool exited;
+    volatile uint32_t refs;     /* the thread until reaped, the creator until joined or detached */
+    WaitQueue exit_wq;
+    Task reap;
+    struct KThread *next_free;
+} KThread;
+
+/* Fill the slot pool ahead of time; the task pool must be up before threads exit */
+void kthread_init(uint32_t prealloc);
+
+/* A new thread running fn(arg), not yet started; NULL if out of memory or PIDs */
+KThread *kthread_create(int (*fn)(void *arg), void *arg);
+/* The same, as a thread of process rather than of kernel_process */
+KThread *kthread_create_in(struct Process *process, int (*fn)(void *arg), void *arg);
+void kthread_start(KThread *t);
+KThread *kthread_run(int (*fn)(void *arg), void *arg);
+
+/* Wait for t to exit and return its exit code; t is gone afterwards */
+int kthread_join(KThread *t);
+/* Give up the handle: t is reaped as soon as it exits */
+void kthread_detach(KThread *t);
+
+/* Returning from fn does the same with its return value */
+__attribute__((noreturn)) void kthread_exit(int code);
+
+#endif /* KTHREAD_H */
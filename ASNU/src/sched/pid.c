@@ -0,0 +1,192 @@
+#include "pid.h"
+#include <string.h>
+#include <PMM/pmm.h>
+#include <sync/spinlock.h>
+
+#define PID_MAP_BITS    (4096 * 8)     /* PIDs per bitmap page */
+#define PID_MAP_PAGES   (PID_MAX_LIMIT / PID_MAP_BITS)
+
+/* Radix tree: a static root over PID bits 21-16, then two levels of PID_NODE_SLOTS */
+#define PID_NODE_SHIFT  8
+#define PID_NODE_SLOTS  (1U << PID_NODE_SHIFT)
+#define PID_NODE_MASK   (PID_NODE_SLOTS - 1)
+#define PID_ROOT_SLOTS  (PID_MAX_LIMIT >> (2 * PID_NODE_SHIFT))
+
+typedef struct {
+    uint64_t *bits;             /* allocated the first time pid_max reaches the page */
+    uint32_t nr_free;
+} PidMapPage;
+
+typedef struct PidNode {
+    uint32_t count;             /* non-NULL slots; the node is freed when it drops to zero */
+    void *slots[PID_NODE_SLOTS];
+} PidNode;
+
+/* Covers the bitmap, the tree and the task list */
+static Spinlock pid_lock = SPINLOCK_INIT;
+
+static PidMapPage pid_map[PID_MAP_PAGES];
+static uint32_t pid_max = PID_MAX_DEFAULT;
+static uint32_t last_pid;
+
+static PidNode *pid_root[PID_ROOT_SLOTS];
+static Procedure *task_head, *task_tail;
+static size_t nr_tasks;
+
+static bool pid_map_page_init(uint32_t page) {
+    PidMapPage *m = &pid_map[page];
+    if (m->bits) return true;
+    m->bits = (uint64_t*)kalloc(PID_MAP_BITS / 8);
+    if (!m->bits) return false;
+    memset(m->bits, 0, PID_MAP_BITS / 8);
+    m->nr_free = PID_MAP_BITS;
+    if (page == 0) {
+        m->bits[0] = 1;         /* PID 0 is the idle procedures' */
+        m->nr_free--;
+    }
+    return true;
+}
+
+/* First free PID in [from, to), marked used; 0 if there is none */
+static uint32_t pid_find_free(uint32_t from, uint32_t to) {
+    while (from < to) {
+        uint32_t page = from / PID_MAP_BITS;
+        uint32_t page_end = (page + 1) * PID_MAP_BITS;
+        if (page_end > to) page_end = to;
+        if (!pid_map_page_init(page)) return 0;
+
+        PidMapPage *m = &pid_map[page];
+        for (uint32_t pid = from; m->nr_free && pid < page_end; pid = (pid | 63) + 1) {
+            uint64_t *word = &m->bits[(pid % PID_MAP_BITS) / 64];
+            uint64_t free = ~*word & (~0ULL << (pid % 64));
+            if (!free) continue;
+            uint32_t found = (pid & ~63U) + (uint32_t)__builtin_ctzll(free);
+            if (found >= page_end) break;
+            *word |= 1ULL << (found % 64);
+            m->nr_free--;
+            return found;
+        }
+        from = page_end;
+    }
+    return 0;
+}
+
+uint32_t pid_alloc(void) {
+    uint64_t flags = spin_lock_irqsave(&pid_lock);
+    uint32_t pid = pid_find_free(last_pid + 1, pid_max);
+    if (!pid) pid = pid_find_free(1, last_pid + 1);
+    while (!pid && pid_max < PID_MAX_LIMIT) {
+        pid_max *= 2;
+        pid = pid_find_free(pid_max / 2, pid_max);
+    }
+    if (pid) last_pid = pid;
+    spin_unlock_irqrestore(&pid_lock, flags);
+    return pid;
+}
+
+static void pid_free_locked(uint32_t pid) {
+    PidMapPage *m = &pid_map[pid / PID_MAP_BITS];
+    uint64_t bit = 1ULL << (pid % 64);
+    uint64_t *word = &m->bits[(pid % PID_MAP_BITS) / 64];
+    if (!(*word & bit)) return;
+    *word &= ~bit;
+    m->nr_free++;
+}
+
+void pid_free(uint32_t pid) {
+    if (pid == 0 || pid >= PID_MAX_LIMIT) return;
+    uint64_t flags = spin_lock_irqsave(&pid_lock);
+    pid_free_locked(pid);
+    spin_unlock_irqrestore(&pid_lock, flags);
+}
+
+static PidNode *pid_node_alloc(void) {
+    PidNode *node = (PidNode*)kalloc(sizeof(PidNode));
+    if (node) memset(node, 0, sizeof(PidNode));
+    return node;
+}
+
+bool pid_attach(Procedure *p) {
+    uint32_t pid = p->pid;
+    if (pid == 0 || pid >= PID_MAX_LIMIT) return false;
+
+    uint64_t flags = spin_lock_irqsave(&pid_lock);
+    PidNode **mid = &pid_root[pid >> (2 * PID_NODE_SHIFT)];
+    if (!*mid && !(*mid = pid_node_alloc())) goto fail;
+
+    PidNode **leaf = (PidNode**)&(*mid)->slots[(pid >> PID_NODE_SHIFT) & PID_NODE_MASK];
+    if (!*leaf) {
+        if (!(*leaf = pid_node_alloc())) goto fail;
+        (*mid)->count++;
+    }
+
+    void **slot = &(*leaf)->slots[pid & PID_NODE_MASK];
+    if (!*slot) (*leaf)->count++;
+    *slot = p;
+
+    p->task_next = NULL;
+    p->task_prev = task_tail;
+    if (task_tail) task_tail->task_next = p;
+    else task_head = p;
+    task_tail = p;
+    nr_tasks++;
+    spin_unlock_irqrestore(&pid_lock, flags);
+    return true;
+
+fail:
+    /* A middle node we just allocated stays; it is freed with its last leaf */
+    spin_unlock_irqrestore(&pid_lock, flags);
+    return false;
+}
+
+void pid_detach(Procedure *p) {
+    uint32_t pid = p->pid;
+    if (pid == 0 || pid >= PID_MAX_LIMIT) return;
+
+    uint64_t flags = spin_lock_irqsave(&pid_lock);
+    PidNode **mid = &pid_root[pid >> (2 * PID_NODE_SHIFT)];
+    PidNode **leaf = *mid ? (PidNode**)&(*mid)->slots[(pid >> PID_NODE_SHIFT) & PID_NODE_MASK] : NULL;
+    if (leaf && *leaf && (*leaf)->slots[pid & PID_NODE_MASK] == p) {
+        (*leaf)->slots[pid & PID_NODE_MASK] = NULL;
+        if (--(*leaf)->count == 0) {
+            kfree(*leaf);
+            *leaf = NULL;
+            if (--(*mid)->count == 0) {
+                kfree(*mid);
+                *mid = NULL;
+            }
+        }
+
+        if (p->task_prev) p->task_prev->task_next = p->task_next;
+        else task_head = p->task_next;
+        if (p->task_next) p->task_next->task_prev = p->task_prev;
+        else task_tail = p->task_prev;
+        p->task_next = p->task_prev = NULL;
+        nr_tasks--;
+    }
+    pid_free_locked(pid);
+    spin_unlock_irqrestore(&pid_lock, flags);
+}
+
+Procedure *find_task_by_pid(uint32_t pid) {
+    if (pid == 0 || pid >= PID_MAX_LIMIT) return NULL;
+
+    Procedure *p = NULL;
+    uint64_t flags = spin_lock_irqsave(&pid_lock);
+    PidNode *mid = pid_root[pid >> (2 * PID_NODE_SHIFT)];
+    PidNode *leaf = mid ? (PidNode*)mid->slots[(pid >> PID_NODE_SHIFT) & PID_NODE_MASK] : NULL;
+    if (leaf) p = (Procedure*)leaf->slots[pid & PID_NODE_MASK];
+    spin_unlock_irqrestore(&pid_lock, flags);
+    return p;
+}
+
+size_t pid_nr_tasks(void) {
+    return __atomic_load_n(&nr_tasks, __ATOMIC_RELAXED);
+}
+
+void for_each_task(void (*fn)(Procedure *p, void *arg), void *arg) {
+    uint64_t flags = spin_lock_irqsave(&pid_lock);
+    for (Procedure *p = task_head; p; p = p->task_next)
+        fn(p, arg);
+    spin_unlock_irqrestore(&pid_lock, flags);
+}
@@ -0,0 +1,37 @@
+#ifndef PID_H
+#define PID_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "scheduler.h"
+
+/*
+ * PID allocation and the PID -> Procedure table. PIDs come from a bitmap,
+ * handed out next-fit below pid_max so a freed PID is not reused at once;
+ * pid_max doubles up to PID_MAX_LIMIT when every PID below it is taken.
+ * Registered procedures sit in a three-level radix tree keyed by PID and on
+ * one list for iteration. PID 0 belongs to the idle procedures and is never
+ * handed out.
+ */
+
+#define PID_MAX_DEFAULT 32768
+#define PID_MAX_LIMIT   (1U << 22)
+
+/* A free PID, 0 when all PID_MAX_LIMIT are taken or out of memory */
+uint32_t pid_alloc(void);
+void pid_free(uint32_t pid);
+
+/* Make p findable by its PID; false if the table cannot grow */
+bool pid_attach(Procedure *p);
+/* Remove p from the table and free its PID */
+void pid_detach(Procedure *p);
+
+/* Registered procedure with that PID, or NULL; safe from interrupt handlers */
+Procedure *find_task_by_pid(uint32_t pid);
+size_t pid_nr_tasks(void);
+
+/* Call fn on every registered procedure, under the table lock: fn must not block or attach/detach */
+void for_each_task(void (*fn)(Procedure *p, void *arg), void *arg);
+
+#endif /* PID_H */
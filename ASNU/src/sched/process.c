@@ -0,0 +1,80 @@
+#include "process.h"
+#include <string.h>
+#include <PMM/pmm.h>
+#include <VMM/vmm.h>
+#include <KiSimple.h>
+#include <VMM/wss.h>
+
+Process kernel_process;
+
+void process_init(void) {
+    memset(&kernel_process, 0, sizeof(Process));
+    spin_lock_init(&kernel_process.lock);
+    kernel_process.cr3 = VA2PAu64((uint64_t)PML4);
+    kernel_process.kernel = true;
+    wss_track(kernel_process.cr3, true);
+}
+
+Process *process_create(uint64_t cr3) {
+    Process *process = (Process*)kalloc(sizeof(Process));
+    if (!process) return NULL;
+    memset(process, 0, sizeof(Process));
+    spin_lock_init(&process->lock);
+    process->refs = 1;
+    process->cr3 = cr3;
+    wss_track(cr3, false);
+    return process;
+}
+
+/* There are no per-process address spaces yet, so there are no page tables to free */
+static void process_destroy(Process *process) {
+    wss_untrack(process->cr3);
+    kfree(process);
+}
+
+void process_put(Process *process) {
+    if (process->kernel) return;
+    if (__atomic_sub_fetch(&process->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        process_destroy(process);
+}
+
+void process_add_thread(Process *process, Procedure *t) {
+    uint64_t flags = spin_lock_irqsave(&process->lock);
+    if (!process->nr_threads && !process->kernel) process->pid = t->pid;
+    t->process = process;
+    t->thread_id = process->next_tid++;
+    t->thread_prev = NULL;
+    t->thread_next = process->threads;
+    if (process->threads) process->threads->thread_prev = t;
+    process->threads = t;
+    process->nr_threads++;
+    if (!process->kernel) __atomic_add_fetch(&process->refs, 1, __ATOMIC_RELAXED);
+    spin_unlock_irqrestore(&process->lock, flags);
+}
+
+void process_remove_thread(Procedure *t) {
+    Process *process = t->process;
+    if (!process) return;
+
+    uint64_t flags = spin_lock_irqsave(&process->lock);
+    if (t->thread_prev) t->thread_prev->thread_next = t->thread_next;
+    else process->threads = t->thread_next;
+    if (t->thread_next) t->thread_next->thread_prev = t->thread_prev;
+    t->thread_next = t->thread_prev = NULL;
+    process->nr_threads--;
+    process->exited_time_ns += t->time_used_ns;
+    spin_unlock_irqrestore(&process->lock, flags);
+
+    /* Its last switch away still looks at its process */
+    t->process = &kernel_process;
+    process_put(process);
+}
+
+uint64_t process_time_ns(Process *process) {
+    uint64_t flags = spin_lock_irqsave(&process->lock);
+    uint64_t ns = process->exited_time_ns;
+    for (Procedure *t = process->threads; t; t = t->thread_next)
+        ns += t->time_used_ns;
+    spin_unlock_irqrestore(&process->lock, flags);
+    return ns;
+}
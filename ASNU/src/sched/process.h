@@ -0,0 +1,48 @@
+#ifndef PROCESS_H
+#define PROCESS_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sync/spinlock.h>
+#include "scheduler.h"
+
+/*
+ * A process owns the address space and the accounting of its threads;
+ * each thread is a Procedure with its own registers, stack and scheduling
+ * entity. Adding a thread to a process sets up no address space, and
+ * switching between threads of one process leaves CR3 alone. Kernel
+ * threads all belong to kernel_process.
+ *
+ * Each thread holds a reference on its process, and so does the creator
+ * until it calls process_put(). The last reference to go frees the
+ * process; kernel_process is never freed.
+ */
+typedef struct Process {
+    Spinlock lock;              /* the thread list and the counters below */
+    volatile uint32_t refs;
+    uint32_t pid;               /* its first thread's PID */
+    uint64_t cr3;               /* physical address of its top-level page table */
+    bool kernel;                /* kernel_process: its threads are unrelated, nothing groups them */
+    Procedure *threads;
+    uint32_t nr_threads;
+    uint32_t next_tid;
+    uint32_t last_cpu;          /* where its last new thread was placed; siblings go near it */
+    uint64_t exited_time_ns;    /* run time of threads that have exited */
+} Process;
+
+extern Process kernel_process;
+
+void process_init(void);
+
+/* A new process running in the address space rooted at cr3, without threads yet; the caller holds a reference */
+Process *process_create(uint64_t cr3);
+void process_put(Process *process);
+
+void process_add_thread(Process *process, Procedure *t);
+/* t exits: its run time moves to the process, its reference goes and it is left in kernel_process */
+void process_remove_thread(Procedure *t);
+
+/* Run time of every thread the process had, live or exited */
+uint64_t process_time_ns(Process *process);
+
+#endif /* PROCESS_H */
@@ -0,0 +1,60 @@
+#include "runqueue.h"
+
+/*
+ * Fixed-priority class: one FIFO per priority level and a bitmap of the
+ * non-empty levels, so picking is a single bsf. Procedures at the same level
+ * round-robin every SchedTickFreq ticks.
+ */
+
+static inline uint32_t rt_first_prio(uint64_t map) {
+    uint64_t idx;
+    asm ("bsfq %1, %0" : "=r"(idx) : "rm"(map));
+    return (uint32_t)idx;
+}
+
+static void rt_enqueue(RunQueue *rq, Procedure *p, int flags) {
+    (void)flags;
+    uint8_t prio = p->priority;
+    p->rq_next = NULL;
+    p->rq_prev = rq->rt_tail[prio];
+    if (rq->rt_tail[prio]) rq->rt_tail[prio]->rq_next = p;
+    else rq->rt_head[prio] = p;
+    rq->rt_tail[prio] = p;
+    rq->rt_bitmap |= (1ULL << prio);
+}
+
+static void rt_dequeue(RunQueue *rq, Procedure *p) {
+    uint8_t prio = p->priority;
+    if (p->rq_prev) p->rq_prev->rq_next = p->rq_next;
+    else rq->rt_head[prio] = p->rq_next;
+    if (p->rq_next) p->rq_next->rq_prev = p->rq_prev;
+    else rq->rt_tail[prio] = p->rq_prev;
+    p->rq_next = p->rq_prev = NULL;
+    if (!rq->rt_head[prio]) rq->rt_bitmap &= ~(1ULL << prio);
+}
+
+static Procedure *rt_pick_next(RunQueue *rq) {
+    if (!rq->rt_bitmap) return NULL;
+    Procedure *p = rq->rt_head[rt_first_prio(rq->rt_bitmap)];
+    p->time_slice_ns = SchedTickFreq * sched_tick_ns;
+    return p;
+}
+
+static void rt_tick(RunQueue *rq, Procedure *curr, uint64_t delta_ns) {
+    (void)delta_ns;
+    if (curr->time_used_ns - curr->slice_start_ns >= curr->time_slice_ns)
+        rq->need_resched = true;
+}
+
+static bool rt_check_preempt(RunQueue *rq, Procedure *curr, Procedure *woken) {
+    (void)rq;
+    return woken->priority < curr->priority;
+}
+
+const SchedClassOps sched_rt_class = {
+    .enqueue = rt_enqueue,
+    .dequeue = rt_dequeue,
+    .pick_next = rt_pick_next,
+    .tick = rt_tick,
+    .check_preempt = rt_check_preempt,
+};
@@ -0,0 +1,88 @@
+#ifndef RUNQUEUE_H
+#define RUNQUEUE_H 1
+
+#include "scheduler.h"
+#include <rbtree.h>
+#include <sync/spinlock.h>
+
+/* Scheduler internals shared by the core and the scheduling classes */
+
+#define SCHED_LATENCY_NS            24000000ULL /* period in which every fair task runs once */
+#define SCHED_MIN_GRANULARITY_NS    3000000ULL
+#define SCHED_WAKEUP_GRANULARITY_NS 1000000ULL
+#define SCHED_MIGRATION_COST_NS     500000ULL   /* ran this recently: still cache hot */
+
+/* enqueue flags */
+#define ENQUEUE_WAKEUP  0x1     /* procedure was blocked */
+#define ENQUEUE_NEW     0x2     /* procedure never ran */
+#define ENQUEUE_RESTORE 0x4     /* taken off and put back, its wait goes on */
+
+/* Deadline bandwidth, runtime / deadline in 1 << SCHED_DL_BW_SHIFT units; 5% of each CPU stays for the other classes */
+#define SCHED_DL_BW_SHIFT   20
+#define SCHED_DL_BW_LIMIT   ((95ULL << SCHED_DL_BW_SHIFT) / 100)
+
+/* Wakeup-to-run latency histogram: bucket i counts [2^i, 2^(i+1)) ns */
+#define SCHED_LAT_BUCKETS 32
+
+/*
+ * One per CPU, inside its PerCpu block. The lock covers the queues and the
+ * queue membership and state of every procedure whose ->cpu names this CPU;
+ * it is held across the stack switch and dropped by sched_finish_switch().
+ * Only idle balancing holds two at once, the lower CPU's first.
+ */
+typedef struct RunQueue {
+    Spinlock lock;
+    uint32_t cpu;
+
+    /* SCHED_CLASS_DL: ready procedures ordered by absolute deadline */
+    RbRoot dl_tree;
+    uint32_t dl_nr;
+    uint64_t dl_bw;             /* admitted reservations, under the admission lock */
+
+    /* SCHED_CLASS_RT: one FIFO per priority, bitmap of non-empty levels */
+    Procedure *rt_head[SCHED_PRIO_LEVELS];
+    Procedure *rt_tail[SCHED_PRIO_LEVELS];
+    uint64_t rt_bitmap;
+
+    /* SCHED_CLASS_FAIR: ready procedures ordered by vruntime */
+    RbRoot fair_tree;
+    uint64_t fair_load;
+    uint32_t fair_nr;
+    uint64_t min_vruntime;
+
+    size_t nr_ready;
+    bool need_resched;
+    Procedure *migrate;         /* switched out on a CPU outside its affinity, placed again by sched_finish_switch() */
+
+    uint32_t lat_hist[SCHED_LAT_BUCKETS];
+    uint64_t lat_count;
+    uint64_t lat_max_ns;
+} RunQueue;
+
+typedef struct {
+    void (*enqueue)(RunQueue *rq, Procedure *p, int flags);
+    void (*dequeue)(RunQueue *rq, Procedure *p);
+    /* Best ready procedure of the class, left queued; sets its time_slice_ns */
+    Procedure *(*pick_next)(RunQueue *rq);
+    /* Charge delta_ns of runtime to the running procedure, may set need_resched */
+    void (*tick)(RunQueue *rq, Procedure *curr, uint64_t delta_ns);
+    /* Should a woken procedure of this class preempt the running one of the same class */
+    bool (*check_preempt)(RunQueue *rq, Procedure *curr, Procedure *woken);
+} SchedClassOps;
+
+extern const SchedClassOps sched_dl_class;
+extern const SchedClassOps sched_rt_class;
+extern const SchedClassOps sched_fair_class;
+
+extern uint64_t sched_tick_ns;
+
+uint32_t sched_nice_to_weight(int nice);
+void dl_replenish(Procedure *p);
+void sched_dl_timer_fn(void *arg);
+
+/* sched/switch.asm; returns the procedure that switched to us, prev as seen from the other side */
+Procedure *switch_kernel_stack(uint64_t *prev_rsp, uint64_t next_rsp, Procedure *prev);
+extern void sched_task_start(void);
+void sched_finish_switch(Procedure *prev);
+
+#endif /* RUNQUEUE_H */
@@ -1,144 +1,843 @@
 #include "scheduler.h"
+#include "runqueue.h"
+#include <stddef.h>
 #include <string.h>
 #include <PMM/pmm.h>
 #include <Serial/serial.h>
-
-#define MAX_PROCS 1024
+#include <IDT/idt.h>
+#include <KiSimple.h>
+#include <Drivers/PIT.h>
+#include <smp/smp.h>
+#include <time/tick.h>
+#include <fpu/fpu.h>
+#include "pid.h"
+#include "process.h"
+#include "trace.h"
+#include <smp/topology.h>
 
 uint32_t SchedTickFreq = 10;
-static Procedure *proc_list[MAX_PROCS];
-static size_t proc_count = 0;
-static Procedure *current_proc = NULL;
-static uint32_t next_pid = 1;
 
 Procedure *scheduler_get_current(void) {
-    return current_proc;
+    return this_cpu()->current;
 }
 
-Procedure *create_proc(uint64_t entry_point, int argc, char** argv, char** envp, uint8_t privilege_level, uint64_t stack_base, uint64_t stack_size,
-                      uint64_t heap_base, uint64_t heap_size) {
-    Procedure *p = (Procedure*)kalloc(sizeof(Procedure));
-    if (!p) return NULL;
+/* Set up a thread of process in caller-provided memory; false when no PID is left */
+bool init_proc(Procedure *p, Process *process, uint64_t entry_point, int argc, char** argv, char** envp, uint8_t privilege_level,
+               uint64_t stack_base, uint64_t stack_size) {
     memset(p, 0, sizeof(Procedure));
 
-    p->pid = next_pid++;
+    p->pid = pid_alloc();
+    if (!p->pid) return false;
+    process_add_thread(process, p);
     p->proc_state = PROC_NEW;
     p->privilege_level = privilege_level & 0x3;
-    p->thread_id = 0;
+    p->priority = SCHED_PRIO_FOR_PL(p->privilege_level);
+    p->sched_class = SCHED_CLASS_FAIR;
+    p->nice = (int8_t)SCHED_NICE_FOR_PL(p->privilege_level);
+    p->weight = sched_nice_to_weight(p->nice);
+    p->cpu = this_cpu()->cpu_id;
+    p->affinity = smp_housekeeping_mask();
     p->state.Id = p->pid;
+    p->state.ParentCpuId = p->cpu;
     p->state.EntryPoint = entry_point;
     p->state.KernelStack = stack_base;
     p->state.UserStack = stack_base + stack_size;
     p->state.PagesMapped = 0;
-    p->state.TimeUsedNs = 0;
-    p->state.TimeSliceNs = 0;
     p->state.IsKernelProcedure = (privilege_level == 0);
 
-    // Initialize registers
+    p->state.Regs.cr3 = process->cr3;
     p->state.Regs.rip = entry_point;
     p->state.Regs.rflags = 0x202;
 
-    // Prepare a safe initial stack for first run
-    uint64_t *stack_top = (uint64_t*)p->state.UserStack;
-    stack_top--;
-    *stack_top = 0;  // fake return address
-    p->state.Regs.rsp = (uint64_t)stack_top;
+    /*
+     * Build the stack the first switch to this procedure unwinds:
+     * a switch_kernel_stack() frame returning into sched_task_start, which
+     * finishes the switch and irets through the TrapFrame below into the
+     * entry point. Returning from the entry point lands in sched_exit().
+     */
+    uint64_t *sp = (uint64_t*)(p->state.UserStack & ~0xFULL);
+    *--sp = (uint64_t)&sched_exit;
+    uint64_t entry_rsp = (uint64_t)sp;
+
+    TrapFrame *frame = (TrapFrame*)((uint64_t)sp - sizeof(TrapFrame));
+    memset(frame, 0, sizeof(TrapFrame));
+    frame->rdi = (uint64_t)argc;
+    frame->rsi = (uint64_t)argv;
+    frame->rdx = (uint64_t)envp;
+    frame->rip = entry_point;
+    frame->cs = GDT_OFFSET_KERNEL_CODE;
+    frame->rflags = p->state.Regs.rflags;
+    frame->rsp = entry_rsp;
+    frame->ss = GDT_OFFSET_KERNEL_DATA;
+
+    sp = (uint64_t*)frame;
+    *--sp = (uint64_t)&sched_task_start;
+    for (int i = 0; i < 6; i++) *--sp = 0;  /* rbx, rbp, r12-r15 */
+    p->kernel_rsp = (uint64_t)sp;
+
+    return true;
+}
+
+/* Another thread in an existing process: no address space to set up */
+Procedure *create_thread(Process *process, uint64_t entry_point, int argc, char** argv, char** envp, uint8_t privilege_level,
+                         uint64_t stack_base, uint64_t stack_size) {
+    Procedure *p = (Procedure*)kalloc(sizeof(Procedure));
+    if (!p) return NULL;
+    if (!init_proc(p, process, entry_point, argc, argv, envp, privilege_level, stack_base, stack_size)) {
+        kfree(p);
+        return NULL;
+    }
+    return p;
+}
+
+/* A new process and its first thread; there are no user address spaces yet, so it runs in the kernel's */
+Procedure *create_proc(uint64_t entry_point, int argc, char** argv, char** envp, uint8_t privilege_level, uint64_t stack_base, uint64_t stack_size,
+                      uint64_t heap_base, uint64_t heap_size) {
+    (void)heap_base;
+    (void)heap_size;
 
+    Process *process = process_create(kernel_process.cr3);
+    if (!process) return NULL;
+    Procedure *p = create_thread(process, entry_point, argc, argv, envp, privilege_level, stack_base, stack_size);
+    /* Its thread keeps it alive from here; without one it is freed */
+    process_put(process);
     return p;
 }
 
-void register_proc(Procedure *proc) {
-    if (proc_count >= MAX_PROCS) return;
-    proc_list[proc_count++] = proc;
-    proc->proc_state = PROC_READY;
-    if (!current_proc) {
-        current_proc = proc;
-        proc->proc_state = PROC_RUNNING;
+/*
+ * Ready procedures live in their class's structure on a CPU's run queue: the
+ * deadline tree for SCHED_CLASS_DL, the priority FIFOs for SCHED_CLASS_RT,
+ * the vruntime tree for SCHED_CLASS_FAIR.
+ * The running one is that CPU's current; blocked, suspended and terminated
+ * ones are on no queue at all. Classes are consulted in SchedClass order.
+ */
+static const SchedClassOps *sched_classes[SCHED_CLASS_COUNT] = {
+    [SCHED_CLASS_DL] = &sched_dl_class,
+    [SCHED_CLASS_RT] = &sched_rt_class,
+    [SCHED_CLASS_FAIR] = &sched_fair_class,
+};
+
+uint64_t sched_tick_ns = 10000000;
+
+/* Covers every run queue's dl_bw */
+static Spinlock dl_admit_lock = SPINLOCK_INIT;
+
+static inline RunQueue *cpu_rq(uint32_t cpu) {
+    return &smp_get_cpu(cpu)->rq;
+}
+
+static void sched_enqueue(RunQueue *rq, Procedure *p, int flags) {
+    if (!(flags & ENQUEUE_RESTORE)) {
+        p->stats.ready_since = tick_get_ns();
+        p->woken = (flags & (ENQUEUE_WAKEUP | ENQUEUE_NEW)) != 0;
+        if (p->woken) p->stats.nr_wakeups++;
     }
+    sched_classes[p->sched_class]->enqueue(rq, p, flags);
+    p->on_rq = true;
+    rq->nr_ready++;
 }
 
-void scheduler_init(void) {
-    proc_count = 0;
-    current_proc = NULL;
-    next_pid = 1;
+static void sched_dequeue(RunQueue *rq, Procedure *p) {
+    sched_classes[p->sched_class]->dequeue(rq, p);
+    p->on_rq = false;
+    rq->nr_ready--;
 }
 
-void scheduler_tick(void) {
-    static uint64_t sched_ticks = 0;
-    sched_ticks++;
+/* Lock the run queue p belongs to; p->cpu only changes with that lock held */
+static RunQueue *task_rq_lock(Procedure *p) {
+    for (;;) {
+        uint32_t cpu = __atomic_load_n(&p->cpu, __ATOMIC_RELAXED);
+        RunQueue *rq = cpu_rq(cpu);
+        spin_lock(&rq->lock);
+        if (p->cpu == cpu) return rq;
+        spin_unlock(&rq->lock);
+    }
+}
 
-    serial_fwrite("Scheduler ticked");
-    if (sched_ticks % SchedTickFreq == 0) {
-        serial_fwrite("Scheduler tick frequency rule met");
-        context_switch();
-        serial_fwrite("Scheduler tick: %llu, current PID: %u\n", sched_ticks, current_proc ? current_proc->pid : 0);
+/* Ready, but its deadline budget is spent: it stays off the queues until dl_timer fires */
+static inline bool sched_throttled(Procedure *p) {
+    return p->sched_class == SCHED_CLASS_DL && p->dl_throttled;
+}
+
+static inline bool cpu_is_idle(PerCpu *cpu) {
+    return cpu->current == &cpu->idle && cpu->rq.nr_ready == 0;
+}
+
+/* cpu and all its SMT siblings are idle */
+static bool core_is_idle(uint32_t cpu) {
+    CpuMask siblings = topology_domain(cpu, TOPO_SMT) | cpumask_of(cpu);
+    while (siblings) {
+        uint32_t i = (uint32_t)__builtin_ctzll(siblings);
+        siblings &= siblings - 1;
+        PerCpu *c = smp_get_cpu(i);
+        if (c && c->online && !cpu_is_idle(c)) return false;
     }
+    return true;
 }
 
-static Procedure *find_next_proc(void) {
-    if (proc_count == 0) return NULL;
-    size_t start = 0;
-    if (current_proc) {
-        for (size_t i = 0; i < proc_count; ++i) {
-            if (proc_list[i] == current_proc) {
-                start = (i + 1) % proc_count;
-                break;
-            }
+/* An idle CPU in mask, on a fully idle core if there is one, the one closest to near among equals */
+static uint32_t sched_find_idle(CpuMask mask, uint32_t near) {
+    uint32_t best = UINT32_MAX;
+    bool best_core = false;
+    TopoLevel best_dist = TOPO_LEVELS;
+    while (mask) {
+        uint32_t i = (uint32_t)__builtin_ctzll(mask);
+        mask &= mask - 1;
+        PerCpu *cpu = smp_get_cpu(i);
+        if (!cpu || !cpu->online || !cpu_is_idle(cpu)) continue;
+
+        bool core = core_is_idle(i);
+        TopoLevel dist = topology_distance(i, near);
+        if (best == UINT32_MAX || (core && !best_core) || (core == best_core && dist < best_dist)) {
+            best = i;
+            best_core = core;
+            best_dist = dist;
+        }
+    }
+    return best;
+}
+
+/*
+ * Where a procedure becoming runnable should go, always within its
+ * affinity. A waking one stays on the CPU it last ran on, where its cache
+ * lines are, if that CPU is idle or it ran there very recently. Otherwise
+ * it looks for an idle core, then an idle CPU, in the waker's last level
+ * cache, then its old one, then further out domain by domain. A new one
+ * searches outwards from the CPU it was created on; a new thread of a
+ * multi-threaded process from where its siblings went, so they share
+ * caches. With nothing idle a waking one stays where it was and a new one
+ * goes to the least loaded CPU, the closest one among equals.
+ */
+static uint32_t sched_select_cpu(Procedure *p, bool new_proc) {
+    /* Deadline procedures run where their bandwidth was admitted */
+    if (p->sched_class == SCHED_CLASS_DL) return p->cpu;
+
+    Process *process = p->process;
+    bool group = new_proc && process && !process->kernel && process->nr_threads > 1;
+    uint32_t home = group ? process->last_cpu : p->cpu;
+
+    PerCpu *prev = smp_get_cpu(home);
+    bool prev_ok = prev && prev->online && cpumask_test(p->affinity, home);
+    if (prev_ok && cpu_is_idle(prev)) return home;
+    if (prev_ok && !new_proc && tick_get_ns() - p->stats.exec_start < SCHED_MIGRATION_COST_NS)
+        return home;
+
+    /* Racy reads throughout; this is only a placement hint */
+    uint32_t waker = this_cpu()->cpu_id;
+    if (!new_proc && cpumask_test(p->affinity, waker)) {
+        uint32_t c = sched_find_idle(topology_domain(waker, TOPO_LLC) & p->affinity, waker);
+        if (c != UINT32_MAX) return c;
+    }
+    for (int level = TOPO_LLC; level < TOPO_LEVELS; level++) {
+        CpuMask mask = level == TOPO_SYSTEM ? CPUMASK_ALL : topology_domain(home, (TopoLevel)level);
+        uint32_t c = sched_find_idle(mask & p->affinity, home);
+        if (c != UINT32_MAX) return c;
+    }
+
+    if (!new_proc && prev_ok) return home;
+
+    uint32_t best = prev_ok ? home : UINT32_MAX;
+    size_t best_load = prev_ok ? prev->rq.nr_ready + 1 : SIZE_MAX;
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        PerCpu *cpu = smp_get_cpu(i);
+        if (!cpu->online || !cpumask_test(p->affinity, i)) continue;
+
+        size_t load = cpu->rq.nr_ready + 1;
+        if (load < best_load || (load == best_load && topology_distance(i, home) < topology_distance(best, home))) {
+            best = i;
+            best_load = load;
         }
     }
-    for (size_t i = 0; i < proc_count; ++i) {
-        size_t idx = (start + i) % proc_count;
-        Procedure *p = proc_list[idx];
-        if (p->proc_state == PROC_READY || p->proc_state == PROC_IDLE)
+
+    /* No CPU of its affinity is online: leave it where it was */
+    return best == UINT32_MAX ? p->cpu : best;
+}
+
+/* Make the procedure findable by PID and runnable */
+void register_proc(Procedure *proc) {
+    if (pid_attach(proc)) sched_wakeup(proc);
+}
+
+void scheduler_init(void) {
+    process_init();
+
+    uint32_t freq = pit_get_frequency();
+    if (freq) sched_tick_ns = 1000000000ULL / freq;
+
+    scheduler_init_cpu(this_cpu());
+}
+
+/* Adopt the calling CPU's boot context as its idle procedure; its stack is saved on the first switch */
+void scheduler_init_cpu(PerCpu *cpu) {
+    memset(&cpu->rq, 0, sizeof(RunQueue));
+    spin_lock_init(&cpu->rq.lock);
+    cpu->rq.cpu = cpu->cpu_id;
+
+    Procedure *idle = &cpu->idle;
+    memset(idle, 0, sizeof(Procedure));
+    idle->pid = 0;
+    idle->proc_state = PROC_RUNNING;
+    idle->priority = SCHED_PRIO_LEVELS - 1;
+    idle->sched_class = SCHED_CLASS_FAIR;
+    idle->weight = sched_nice_to_weight(SCHED_NICE_MAX);
+    idle->cpu = cpu->cpu_id;
+    idle->affinity = cpumask_of(cpu->cpu_id);
+    idle->process = &kernel_process;
+    idle->state.Regs.cr3 = kernel_process.cr3;
+    idle->on_cpu = true;
+    idle->state.ParentCpuId = cpu->cpu_id;
+    idle->state.IsKernelProcedure = true;
+    idle->stats.exec_start = tick_get_ns();
+
+    __atomic_store_n(&cpu->current, idle, __ATOMIC_RELEASE);
+    trace_init_cpu(cpu);
+}
+
+/* Charge curr for the time since it was last charged; its class may ask for a resched */
+static void sched_account(RunQueue *rq, Procedure *curr, uint64_t now) {
+    uint64_t delta = now - curr->stats.exec_start;
+    curr->stats.exec_start = now;
+    curr->time_used_ns += delta;
+    if (curr != &smp_get_cpu(rq->cpu)->idle)
+        sched_classes[curr->sched_class]->tick(rq, curr, delta);
+}
+
+/* ticks tick periods passed, more than one after a stopped tick; runtime itself comes from the kernel clock */
+void scheduler_tick(uint64_t ticks) {
+    PerCpu *cpu = this_cpu();
+    Procedure *curr = cpu->current;
+    if (!curr) return;  /* ticks that arrive before scheduler_init() */
+
+    cpu->ticks += ticks;
+
+    RunQueue *rq = &cpu->rq;
+    spin_lock(&rq->lock);
+    trace_sched(TRACE_TICK, curr->pid, (uint32_t)ticks, (uint32_t)rq->nr_ready, 0);
+    sched_account(rq, curr, tick_get_ns());
+    if (curr == &cpu->idle && rq->nr_ready) rq->need_resched = true;
+    bool resched = rq->need_resched;
+    spin_unlock(&rq->lock);
+
+    if (resched) context_switch();
+}
+
+/* Wakeup-to-run latency of next, which was queued by a wakeup */
+static void sched_record_latency(RunQueue *rq, uint64_t ns) {
+    int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= SCHED_LAT_BUCKETS) bucket = SCHED_LAT_BUCKETS - 1;
+    rq->lat_hist[bucket]++;
+    rq->lat_count++;
+    if (ns > rq->lat_max_ns) rq->lat_max_ns = ns;
+}
+
+/* Preempt on the way out of an interrupt if a wakeup asked for it */
+void scheduler_irq_exit(void) {
+    PerCpu *cpu = this_cpu();
+    if (!cpu->current) return;
+    if (cpu->rq.need_resched) context_switch();
+    else tick_nohz_update();
+}
+
+/* Best ready procedure over all classes, taken off its queue */
+static Procedure *find_next_proc(RunQueue *rq) {
+    for (int c = 0; c < SCHED_CLASS_COUNT; c++) {
+        Procedure *p = sched_classes[c]->pick_next(rq);
+        if (p) {
+            sched_dequeue(rq, p);
             return p;
+        }
     }
     return NULL;
 }
 
+/*
+ * Pick the next procedure for this CPU and swap kernel stacks. Must be
+ * called with interrupts disabled: from the timer path (inside the IRQ
+ * stub) or through sched_yield(). The run queue lock is held across the
+ * swap, so a blocking procedure cannot be woken onto another CPU before its
+ * stack is saved; whichever procedure resumes drops it.
+ */
 void context_switch(void) {
-    Procedure *next = find_next_proc();
-    if (!next) return;
-    Procedure *prev = current_proc;
-    if (prev == next) return;
-
-    // Save current process registers
-    if (prev) {
-        asm volatile(
-            "mov %%rax, %0\n\t" "mov %%rbx, %1\n\t" "mov %%rcx, %2\n\t" "mov %%rdx, %3\n\t"
-            "mov %%rsi, %4\n\t" "mov %%rdi, %5\n\t" "mov %%rbp, %6\n\t" "mov %%rsp, %7\n\t"
-            "mov %%r8, %8\n\t" "mov %%r9, %9\n\t" "mov %%r10, %10\n\t" "mov %%r11, %11\n\t"
-            "mov %%r12, %12\n\t" "mov %%r13, %13\n\t" "mov %%r14, %14\n\t" "mov %%r15, %15\n\t"
-            "pushfq\n\t" "popq %16\n\t"
-            : "=m"(prev->state.Regs.rax), "=m"(prev->state.Regs.rbx), "=m"(prev->state.Regs.rcx),
-              "=m"(prev->state.Regs.rdx), "=m"(prev->state.Regs.rsi), "=m"(prev->state.Regs.rdi),
-              "=m"(prev->state.Regs.rbp), "=m"(prev->state.Regs.rsp), "=m"(prev->state.Regs.r8),
-              "=m"(prev->state.Regs.r9), "=m"(prev->state.Regs.r10), "=m"(prev->state.Regs.r11),
-              "=m"(prev->state.Regs.r12), "=m"(prev->state.Regs.r13), "=m"(prev->state.Regs.r14),
-              "=m"(prev->state.Regs.r15), "=m"(prev->state.Regs.rflags)
-            :
-            : "memory"
-        );
-        prev->proc_state = PROC_READY;
+    PerCpu *cpu = this_cpu();
+    RunQueue *rq = &cpu->rq;
+    Procedure *prev = cpu->current;
+
+    spin_lock(&rq->lock);
+    uint64_t now = tick_get_ns();
+    if (prev == &cpu->idle) idle_exit(cpu, now);
+    sched_account(rq, prev, now);
+    rq->need_resched = false;
+
+    /* A still-runnable procedure goes back to its class's queue */
+    if (prev->proc_state == PROC_RUNNING && prev != &cpu->idle) {
+        if (!cpumask_test(prev->affinity, cpu->cpu_id)) {
+            /* Its affinity changed under it: placed again once off this stack */
+            prev->proc_state = PROC_WAITING;
+            rq->migrate = prev;
+        } else {
+            prev->proc_state = PROC_READY;
+            if (!sched_throttled(prev)) sched_enqueue(rq, prev, 0);
+        }
     }
 
+    Procedure *next = find_next_proc(rq);
+    if (!next) next = &cpu->idle;
+
+    if (prev->proc_state == PROC_RUNNING && prev == &cpu->idle && next != &cpu->idle)
+        prev->proc_state = PROC_IDLE;
+
     next->proc_state = PROC_RUNNING;
-    current_proc = next;
-
-    // Restore next process registers and jump
-    asm volatile(
-        "mov %0, %%rax\n\t" "mov %1, %%rbx\n\t" "mov %2, %%rcx\n\t" "mov %3, %%rdx\n\t"
-        "mov %4, %%rsi\n\t" "mov %5, %%rdi\n\t" "mov %6, %%rbp\n\t" "mov %7, %%rsp\n\t"
-        "mov %8, %%r8\n\t" "mov %9, %%r9\n\t" "mov %10, %%r10\n\t" "mov %11, %%r11\n\t"
-        "mov %12, %%r12\n\t" "mov %13, %%r13\n\t" "mov %14, %%r14\n\t" "mov %15, %%r15\n\t"
-        "pushq %16\n\t" "popfq\n\t" "jmp *%17\n\t"
-        :
-        : "m"(next->state.Regs.rax), "m"(next->state.Regs.rbx), "m"(next->state.Regs.rcx),
-          "m"(next->state.Regs.rdx), "m"(next->state.Regs.rsi), "m"(next->state.Regs.rdi),
-          "m"(next->state.Regs.rbp), "m"(next->state.Regs.rsp), "m"(next->state.Regs.r8),
-          "m"(next->state.Regs.r9), "m"(next->state.Regs.r10), "m"(next->state.Regs.r11),
-          "m"(next->state.Regs.r12), "m"(next->state.Regs.r13), "m"(next->state.Regs.r14),
-          "m"(next->state.Regs.r15), "m"(next->state.Regs.rflags),
-          "m"(next->state.Regs.rip)
-        : "memory"
-    );
+    next->slice_start_ns = next->time_used_ns;
+    if (prev == next) {
+        tick_nohz_update_locked(cpu);
+        spin_unlock(&rq->lock);
+        return;
+    }
+
+    if (prev != &cpu->idle) {
+        if (prev->proc_state == PROC_READY || prev == rq->migrate) {
+            prev->stats.nr_involuntary++;
+        } else {
+            prev->stats.nr_voluntary++;
+            trace_sched(TRACE_BLOCK, prev->pid, prev->proc_state, 0, 0);
+            /* A deadline procedure blocking has finished its job */
+            if (prev->sched_class == SCHED_CLASS_DL && now > prev->dl_abs_deadline) prev->dl_misses++;
+        }
+    }
+    trace_sched(TRACE_SWITCH, next->pid, prev->pid, prev->proc_state, 0);
+    next->stats.exec_start = now;
+    next->stats.nr_switches++;
+    if (next != &cpu->idle) {
+        uint64_t wait = now - next->stats.ready_since;
+        next->stats.wait_ns += wait;
+        if (wait > next->stats.max_wait_ns) next->stats.max_wait_ns = wait;
+        if (next->woken) {
+            sched_record_latency(rq, wait);
+            next->woken = false;
+        }
+    }
+
+    next->on_cpu = true;
+    cpu->current = next;
+    fpu_switch(cpu, prev, next);
+
+    /* Threads of one process share the address space: only a process change reloads CR3 */
+    if (next->process != prev->process && next->process->cr3 != prev->process->cr3)
+        asm volatile ("mov %0, %%cr3" : : "r"(next->process->cr3) : "memory");
+
+    Procedure *last = switch_kernel_stack(&prev->kernel_rsp, next->kernel_rsp, prev);
+    sched_finish_switch(last);
+}
+
+/* First thing on the new stack: prev is fully off this CPU from here on */
+void sched_finish_switch(Procedure *prev) {
+    PerCpu *cpu = this_cpu();
+    __atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+    tick_nohz_update_locked(cpu);
+    Procedure *migrate = cpu->rq.migrate;
+    cpu->rq.migrate = NULL;
+    spin_unlock(&cpu->rq.lock);
+
+    if (migrate) sched_wakeup(migrate);
+}
+
+/* Voluntary switch: only callee-saved state is saved, the caller's flags are restored on return */
+void sched_yield(void) {
+    uint64_t flags = irq_save();
+    context_switch();
+    irq_restore(flags);
+}
+
+/*
+ * Take the current procedure off the CPU in the given state (PROC_WAITING,
+ * PROC_SLEEPING, ...). A wakeup that lands before the switch turns it back
+ * into PROC_RUNNING and context_switch() simply requeues it.
+ */
+void sched_block(SchedulerState state) {
+    uint64_t flags = irq_save();
+    PerCpu *cpu = this_cpu();
+    if (cpu->current != &cpu->idle) {
+        cpu->current->proc_state = state;
+        context_switch();
+    }
+    irq_restore(flags);
+}
+
+/*
+ * For callers that must recheck a condition after announcing they are
+ * about to block: set PROC_WAITING (or similar), recheck, then either
+ * context_switch() or set PROC_RUNNING again. Interrupts must be off.
+ */
+void sched_set_state(SchedulerState state) {
+    PerCpu *cpu = this_cpu();
+    if (cpu->current != &cpu->idle)
+        __atomic_store_n(&cpu->current->proc_state, state, __ATOMIC_SEQ_CST);
+}
+
+/* Called with rq locked; true if rq's CPU should reschedule */
+static bool check_preempt_wakeup(RunQueue *rq, Procedure *p) {
+    PerCpu *cpu = smp_get_cpu(rq->cpu);
+    Procedure *curr = cpu->current;
+    if (curr == &cpu->idle || p->sched_class < curr->sched_class)
+        rq->need_resched = true;
+    else if (p->sched_class == curr->sched_class && sched_classes[p->sched_class]->check_preempt(rq, curr, p))
+        rq->need_resched = true;
+    return rq->need_resched;
+}
+
+/* Make a procedure runnable again, possibly on another CPU; safe from interrupt handlers */
+void sched_wakeup(Procedure *proc) {
+    uint64_t flags = irq_save();
+    RunQueue *rq = task_rq_lock(proc);
+
+    SchedulerState state = proc->proc_state;
+    if (state == PROC_READY || state == PROC_RUNNING || state == PROC_TERMINATED || state == PROC_IDLE || proc->on_rq) {
+        spin_unlock(&rq->lock);
+        irq_restore(flags);
+        return;
+    }
+
+    /* Blocked but still on its CPU: it has not reached context_switch() yet */
+    if (proc->on_cpu) {
+        proc->proc_state = PROC_RUNNING;
+        spin_unlock(&rq->lock);
+        irq_restore(flags);
+        return;
+    }
+
+    int eflags = (state == PROC_NEW) ? ENQUEUE_NEW : ENQUEUE_WAKEUP;
+    proc->proc_state = PROC_READY;
+
+    /* dl_timer queues it when the next period starts */
+    if (sched_throttled(proc)) {
+        spin_unlock(&rq->lock);
+        irq_restore(flags);
+        return;
+    }
+
+    uint32_t target = sched_select_cpu(proc, state == PROC_NEW);
+    if (state == PROC_NEW && !proc->process->kernel) proc->process->last_cpu = target;
+    trace_sched(TRACE_WAKEUP, proc->pid, target, this_cpu()->current ? this_cpu()->current->pid : 0, state);
+    if (target != proc->cpu) {
+        trace_sched(TRACE_MIGRATE, proc->pid, proc->cpu, target, 0);
+        /* vruntime is relative to the queue it was earned on */
+        uint64_t rel = proc->vruntime - rq->min_vruntime;
+        proc->cpu = target;
+        proc->state.ParentCpuId = target;
+        spin_unlock(&rq->lock);
+        rq = cpu_rq(target);
+        spin_lock(&rq->lock);
+        proc->vruntime = rq->min_vruntime + rel;
+    }
+
+    sched_enqueue(rq, proc, eflags);
+    bool kick = check_preempt_wakeup(rq, proc);
+
+    /* A CPU with its tick stopped has to restart it now that it has a queue */
+    PerCpu *cpu = this_cpu();
+    if (target == cpu->cpu_id) tick_nohz_update_locked(cpu);
+    else if (smp_get_cpu(target)->tick.stopped) kick = true;
+    spin_unlock(&rq->lock);
+
+    if (kick) smp_send_resched(target);
+    irq_restore(flags);
+}
+
+/* Give back p's deadline reservation */
+static void sched_dl_release(Procedure *p) {
+    uint64_t flags = spin_lock_irqsave(&dl_admit_lock);
+    cpu_rq(p->cpu)->dl_bw -= p->dl_bw;
+    p->dl_bw = 0;
+    spin_unlock_irqrestore(&dl_admit_lock, flags);
+}
+
+/* Move a procedure to another class (or level within it), requeueing it if ready */
+static void sched_change(Procedure *proc, uint8_t sched_class, uint8_t priority, int nice) {
+    /* Leaving the deadline class: no replenishment may queue it behind our back */
+    bool leave_dl = proc->sched_class == SCHED_CLASS_DL && sched_class != SCHED_CLASS_DL;
+    if (leave_dl) {
+        del_timer(&proc->dl_timer);
+        sched_dl_release(proc);
+    }
+
+    uint64_t flags = irq_save();
+    RunQueue *rq = task_rq_lock(proc);
+
+    bool queued = proc->on_rq;
+    if (queued) sched_dequeue(rq, proc);
+
+    bool throttled = sched_throttled(proc) && proc->proc_state == PROC_READY;
+    if (leave_dl) proc->dl_throttled = false;
+
+    if (sched_class == SCHED_CLASS_FAIR && proc->sched_class != SCHED_CLASS_FAIR)
+        proc->vruntime = rq->min_vruntime;
+    proc->sched_class = sched_class;
+    proc->priority = priority;
+    proc->nice = (int8_t)nice;
+    proc->weight = sched_nice_to_weight(nice);
+
+    bool kick = false;
+    if (queued || (throttled && !sched_throttled(proc))) {
+        sched_enqueue(rq, proc, queued ? ENQUEUE_RESTORE : 0);
+        kick = check_preempt_wakeup(rq, proc);
+    }
+    uint32_t cpu = rq->cpu;
+    spin_unlock(&rq->lock);
+
+    if (kick) smp_send_resched(cpu);
+    irq_restore(flags);
+}
+
+/* Fixed priority, SCHED_CLASS_RT */
+void sched_set_priority(Procedure *proc, uint8_t priority) {
+    if (priority >= SCHED_PRIO_LEVELS) priority = SCHED_PRIO_LEVELS - 1;
+    sched_change(proc, SCHED_CLASS_RT, priority, proc->nice);
+}
+
+/*
+ * Make a procedure that has not been registered yet a deadline procedure.
+ * Fails if the parameters are inconsistent (runtime <= deadline <= period)
+ * or no CPU has runtime / deadline of bandwidth left; the least loaded CPU
+ * that fits gets it.
+ */
+bool sched_set_deadline(Procedure *proc, uint64_t runtime_ns, uint64_t deadline_ns, uint64_t period_ns) {
+    if (!runtime_ns || runtime_ns > deadline_ns || deadline_ns > period_ns) return false;
+    if (proc->proc_state != PROC_NEW || proc->sched_class == SCHED_CLASS_DL) return false;
+
+    uint64_t bw = (runtime_ns << SCHED_DL_BW_SHIFT) / deadline_ns;
+    uint64_t flags = spin_lock_irqsave(&dl_admit_lock);
+    uint32_t best = UINT32_MAX;
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        PerCpu *cpu = smp_get_cpu(i);
+        if (!cpu->online || !cpumask_test(proc->affinity, i) || cpu->rq.dl_bw + bw > SCHED_DL_BW_LIMIT) continue;
+        if (best == UINT32_MAX || cpu->rq.dl_bw < cpu_rq(best)->dl_bw) best = i;
+    }
+    if (best == UINT32_MAX) {
+        spin_unlock_irqrestore(&dl_admit_lock, flags);
+        return false;
+    }
+    cpu_rq(best)->dl_bw += bw;
+    spin_unlock_irqrestore(&dl_admit_lock, flags);
+
+    proc->sched_class = SCHED_CLASS_DL;
+    proc->dl_runtime = runtime_ns;
+    proc->dl_deadline = deadline_ns;
+    proc->dl_period = period_ns;
+    proc->dl_bw = bw;
+    proc->dl_abs_deadline = 0;
+    proc->dl_budget = 0;
+    proc->dl_throttled = false;
+    timer_init(&proc->dl_timer, sched_dl_timer_fn, proc);
+    proc->cpu = best;
+    proc->state.ParentCpuId = best;
+    return true;
+}
+
+/* Runs on the procedure's CPU when a throttled deadline procedure's next period starts */
+void sched_dl_timer_fn(void *arg) {
+    Procedure *p = (Procedure*)arg;
+    uint64_t flags = irq_save();
+    RunQueue *rq = task_rq_lock(p);
+
+    bool kick = false;
+    if (sched_throttled(p)) {
+        dl_replenish(p);
+        if (p->proc_state == PROC_READY && !p->on_rq) {
+            sched_enqueue(rq, p, 0);
+            kick = check_preempt_wakeup(rq, p);
+        }
+    }
+
+    PerCpu *cpu = this_cpu();
+    uint32_t target = rq->cpu;
+    if (target == cpu->cpu_id) tick_nohz_update_locked(cpu);
+    else if (smp_get_cpu(target)->tick.stopped) kick = true;
+    spin_unlock(&rq->lock);
+
+    if (kick) smp_send_resched(target);
+    irq_restore(flags);
+}
+
+/*
+ * Restrict proc to the CPUs in mask. A queued procedure outside it moves
+ * now; a running one is preempted and moves as it switches out; a blocked
+ * one is placed by its next wakeup. A deadline procedure cannot leave the
+ * CPU its bandwidth was admitted on.
+ */
+bool sched_set_affinity(Procedure *proc, CpuMask mask) {
+    bool any = false;
+    for (uint32_t i = 0; i < smp_cpu_count(); i++)
+        if (smp_get_cpu(i)->online && cpumask_test(mask, i)) any = true;
+    if (!any) return false;
+
+    uint64_t flags = irq_save();
+    RunQueue *rq = task_rq_lock(proc);
+    if (proc->sched_class == SCHED_CLASS_DL && !cpumask_test(mask, proc->cpu)) {
+        spin_unlock(&rq->lock);
+        irq_restore(flags);
+        return false;
+    }
+
+    proc->affinity = mask;
+    bool requeue = false, preempt = false;
+    if (!cpumask_test(mask, proc->cpu)) {
+        if (proc->on_rq) {
+            sched_dequeue(rq, proc);
+            proc->proc_state = PROC_WAITING;
+            requeue = true;
+        } else if (proc->on_cpu && proc->proc_state == PROC_RUNNING) {
+            rq->need_resched = true;
+            preempt = true;
+        }
+    }
+    uint32_t cpu = rq->cpu;
+    spin_unlock(&rq->lock);
+
+    if (requeue) sched_wakeup(proc);
+    if (preempt) {
+        if (cpu == this_cpu()->cpu_id) context_switch();
+        else smp_send_resched(cpu);
+    }
+    irq_restore(flags);
+    return true;
+}
+
+/* Weighted fair share, SCHED_CLASS_FAIR */
+void sched_set_nice(Procedure *proc, int nice) {
+    if (nice < SCHED_NICE_MIN) nice = SCHED_NICE_MIN;
+    if (nice > SCHED_NICE_MAX) nice = SCHED_NICE_MAX;
+    sched_change(proc, SCHED_CLASS_FAIR, proc->priority, nice);
+}
+
+/* Move the first migratable procedure queued on src to dst; both locked in CPU order */
+static bool sched_pull(uint32_t src_id, uint32_t dst_id, bool cold_only) {
+    RunQueue *src = cpu_rq(src_id);
+    RunQueue *dst = cpu_rq(dst_id);
+    RunQueue *first = src_id < dst_id ? src : dst;
+    RunQueue *second = src_id < dst_id ? dst : src;
+    spin_lock(&first->lock);
+    spin_lock(&second->lock);
+
+    /* Deadline procedures stay where their bandwidth is */
+    Procedure *p = NULL;
+    uint64_t now = tick_get_ns();
+    for (int c = SCHED_CLASS_RT; c < SCHED_CLASS_COUNT && !dst->nr_ready; c++) {
+        Procedure *q = sched_classes[c]->pick_next(src);
+        if (!q || q->on_cpu || !cpumask_test(q->affinity, dst_id)) continue;
+        if (cold_only && now - q->stats.exec_start < SCHED_MIGRATION_COST_NS) continue;
+        p = q;
+        break;
+    }
+
+    if (p) {
+        uint64_t rel = p->vruntime - src->min_vruntime;
+        sched_dequeue(src, p);
+        trace_sched(TRACE_MIGRATE, p->pid, src_id, dst_id, 0);
+        p->cpu = dst_id;
+        p->state.ParentCpuId = dst_id;
+        p->vruntime = dst->min_vruntime + rel;
+        sched_enqueue(dst, p, ENQUEUE_RESTORE);
+        dst->need_resched = true;
+    }
+
+    spin_unlock(&second->lock);
+    spin_unlock(&first->lock);
+    return p != NULL;
+}
+
+/*
+ * Pull one queued procedure to this idle CPU from the busiest CPU of the
+ * innermost domain that has one waiting: SMT siblings first, then the L2,
+ * the last level cache, the package and the whole system. Beyond the last
+ * level cache only procedures that have gone cold move. Called from the
+ * idle loop with interrupts off; true if something was pulled.
+ */
+bool sched_idle_balance(void) {
+    uint32_t self = this_cpu()->cpu_id;
+    CpuMask seen = cpumask_of(self);
+
+    for (int level = TOPO_SMT; level < TOPO_LEVELS; level++) {
+        CpuMask mask = level == TOPO_SYSTEM ? CPUMASK_ALL : topology_domain(self, (TopoLevel)level);
+        mask &= ~seen;
+        seen |= mask;
+
+        uint32_t busiest = UINT32_MAX;
+        size_t most = 0;
+        while (mask) {
+            uint32_t i = (uint32_t)__builtin_ctzll(mask);
+            mask &= mask - 1;
+            PerCpu *cpu = smp_get_cpu(i);
+            if (!cpu || !cpu->online || cpu->current == &cpu->idle) continue;
+            size_t n = cpu->rq.nr_ready;
+            if (n > most) {
+                busiest = i;
+                most = n;
+            }
+        }
+        if (busiest != UINT32_MAX && sched_pull(busiest, self, level > TOPO_LLC)) return true;
+    }
+    return false;
+}
+
+/* Ready procedures over all online CPUs */
+size_t sched_nr_ready(void) {
+    size_t nr = 0;
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        PerCpu *cpu = smp_get_cpu(i);
+        if (cpu->online) nr += cpu->rq.nr_ready;
+    }
+    return nr;
+}
+
+static const char *sched_state_name(SchedulerState state) {
+    static const char *names[] = { "new", "ready", "running", "waiting", "sleeping", "terminated", "suspended", "idle" };
+    return (uint32_t)state < sizeof(names) / sizeof(names[0]) ? names[state] : "?";
+}
+
+static void sched_dump_task(Procedure *p, void *arg) {
+    (void)arg;
+    serial_fwrite("%u %u %u %s %llu %llu %llu %llu %llu %llu %llu", p->pid, p->process->pid, p->cpu, sched_state_name(p->proc_state),
+        p->time_used_ns / 1000, p->stats.wait_ns / 1000, p->stats.max_wait_ns / 1000,
+        p->stats.nr_switches, p->stats.nr_voluntary, p->stats.nr_involuntary, p->stats.nr_wakeups);
+}
+
+/* Per-procedure times and per-CPU wakeup latency histograms, over serial */
+void sched_dump_stats(void) {
+    serial_fwrite("%llu tasks", (uint64_t)pid_nr_tasks());
+    serial_fwrite("pid tgid cpu state run_us wait_us max_wait_us switches voluntary involuntary wakeups");
+    for_each_task(sched_dump_task, NULL);
+
+    uint64_t flags;
+    for (uint32_t c = 0; c < smp_cpu_count(); c++) {
+        PerCpu *cpu = smp_get_cpu(c);
+        if (!cpu->online) continue;
+
+        /* Copy under the lock, print without it */
+        uint32_t hist[SCHED_LAT_BUCKETS];
+        flags = spin_lock_irqsave(&cpu->rq.lock);
+        memcpy(hist, cpu->rq.lat_hist, sizeof(hist));
+        uint64_t count = cpu->rq.lat_count;
+        uint64_t max = cpu->rq.lat_max_ns;
+        uint64_t idle = cpu->idle.time_used_ns;
+        spin_unlock_irqrestore(&cpu->rq.lock, flags);
+
+        serial_fwrite("CPU %u: idle %llu us, %llu wakeups, max latency %llu ns", c, idle / 1000, count, max);
+        for (int b = 0; b < SCHED_LAT_BUCKETS; b++) {
+            if (!hist[b]) continue;
+            serial_fwrite("  [%llu, %llu) ns: %u", 1ULL << b, 2ULL << b, hist[b]);
+        }
+    }
+}
+
+void sched_exit(void) {
+    Procedure *curr = this_cpu()->current;
+    if (curr->sched_class == SCHED_CLASS_DL) sched_dl_release(curr);
+    /* Its PID can be reused from here on; the Procedure itself stays */
+    process_remove_thread(curr);
+    pid_detach(curr);
+
+    irq_save();
+    curr->proc_state = PROC_TERMINATED;
+    context_switch();
+    for (;;) asm volatile ("hlt");
 }
@@ -3,9 +3,34 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <rbtree.h>
+#include <time/timer.h>
+#include <smp/cpumask.h>
 
 extern uint32_t SchedTickFreq;
 
+/* Scheduling classes in pick order */
+typedef enum {
+    SCHED_CLASS_DL = 0,
+    SCHED_CLASS_RT = 1,
+    SCHED_CLASS_FAIR = 2,
+    SCHED_CLASS_COUNT
+} SchedClass;
+
+#define SCHED_NICE_MIN      -20
+#define SCHED_NICE_MAX      19
+#define SCHED_NICE0_WEIGHT  1024
+
+/* Priority 0 is the highest; each privilege level gets a band of 16 levels */
+#define SCHED_PRIO_LEVELS   64
+#define SCHED_PRIO_BAND     16
+#define SCHED_PRIO_FOR_PL(pl) ((uint8_t)(((pl) & 0x3) * SCHED_PRIO_BAND + SCHED_PRIO_BAND / 2))
+
+/* The fair class keeps the same order through weight: two nice levels per privilege level */
+#define SCHED_NICE_PER_PL   2
+#define SCHED_NICE_FOR_PL(pl) ((int)((pl) & 0x3) * SCHED_NICE_PER_PL)
+
 typedef enum {
     PROC_NEW = 0,
     PROC_READY = 1,
@@ -24,36 +49,132 @@ typedef struct {
     uint64_t rip, rflags;
     uint64_t cr3;
     uint16_t cs, ds, es, fs, gs, ss;
-} __attribute__((packed)) RegisterState;
+} RegisterState;
 
 typedef struct {
     uint32_t Id;
-    uint32_t ParentCpuId;
+    uint32_t ParentCpuId;       /* CPU it was created on or last moved to */
     SchedulerState State;
+    bool IsKernelProcedure;
     uint64_t EntryPoint;
     uint64_t KernelStack;
     uint64_t UserStack;
     uint64_t PagesMapped;
-    uint64_t TimeUsedNs;
-    uint64_t TimeSliceNs;
-    bool IsKernelProcedure;
     RegisterState Regs;
-} __attribute__((packed)) CPUState;
+} CPUState;
 
+/* Per-procedure accounting, in tick_get_ns() nanoseconds; exactly one cache line */
 typedef struct {
-    uint32_t pid;
+    uint64_t exec_start;        /* last switched in, or last charged */
+    uint64_t ready_since;       /* last queued */
+    uint64_t wait_ns;           /* runnable but not running */
+    uint64_t max_wait_ns;
+    uint64_t nr_switches;       /* times switched in */
+    uint64_t nr_voluntary;      /* switched out because it blocked */
+    uint64_t nr_involuntary;    /* preempted while still runnable */
+    uint64_t nr_wakeups;
+} SchedStats;
+
+#define CACHE_LINE_SIZE 64
+#define __cacheline_aligned __attribute__((aligned(CACHE_LINE_SIZE)))
+
+struct Process;
+
+/*
+ * One thread of execution: registers, a kernel stack and a scheduling
+ * entity. The address space and the accounting it shares with its sibling
+ * threads belong to its Process.
+ *
+ * Laid out by access frequency. The first four cache lines hold everything
+ * the pick, switch and accounting paths touch, grouped so a switch between
+ * two fair procedures reads and writes three lines of each; the deadline
+ * line is only touched by SCHED_CLASS_DL. Identity, class parameters and
+ * the register snapshot follow in the cold part.
+ */
+typedef struct Procedure {
+    /* Line 0: switch and tick */
+    uint64_t kernel_rsp __cacheline_aligned;   /* saved by switch_kernel_stack() */
     SchedulerState proc_state;
+    uint32_t cpu;               /* run queue the procedure belongs to */
+    volatile bool on_cpu;       /* running, or its stack is still being switched away from */
+    bool on_rq;                 /* queued in its class on that run queue */
+    uint8_t sched_class;
+    uint8_t priority;
+    uint32_t weight;
+    uint64_t time_used_ns;
+    uint64_t time_slice_ns;     /* set by the class when picked */
+    uint64_t slice_start_ns;    /* time_used_ns when last picked */
+    uint64_t vruntime;          /* SCHED_CLASS_FAIR: weighted virtual runtime */
+    CpuMask affinity;           /* CPUs it may be placed on */
+
+    /* Line 1: run queue links, one class at a time; line 0 is full, so this starts line 1 */
+    union {
+        RbNode fair_node;                       /* SCHED_CLASS_FAIR: ordered by vruntime */
+        struct {
+            struct Procedure *rq_next, *rq_prev;    /* SCHED_CLASS_RT: priority FIFO */
+        };
+    };
+    struct Process *process;    /* owns the address space */
+    void *fpu_state;            /* XSAVE area, allocated on first FPU use */
+    uint32_t fpu_cpu;           /* CPU it was last restored on */
+    bool woken;                 /* queued by a wakeup, so its wait is a wakeup latency */
+
+    /* Line 2 */
+    SchedStats stats __cacheline_aligned;
+
+    /* Line 3: SCHED_CLASS_DL current job, ordered by absolute deadline */
+    uint64_t dl_abs_deadline __cacheline_aligned;
+    int64_t dl_budget;
+    RbNode dl_node;
+    bool dl_throttled;          /* budget spent, waiting for dl_timer to replenish it */
+
+    /* Cold */
+    uint32_t pid __cacheline_aligned;
+    uint32_t thread_id;         /* index within its process, 0 for the first thread */
+    struct Procedure *task_next, *task_prev;    /* every registered procedure, see sched/pid.h */
+    struct Procedure *thread_next, *thread_prev;    /* threads of the same process */
     uint8_t privilege_level;
-    uint32_t thread_id;
+    int8_t nice;
+
+    /* SCHED_CLASS_DL reservation, relative ns */
+    uint64_t dl_runtime, dl_deadline, dl_period;
+    uint64_t dl_bw;             /* runtime / deadline reserved on its CPU, fixed point */
+    Timer dl_timer;
+    uint64_t dl_throttles, dl_misses;
+
     CPUState state;
-} __attribute__((packed)) Procedure;
+} Procedure;
+
+_Static_assert(offsetof(Procedure, fair_node) == CACHE_LINE_SIZE, "Procedure line 0 must stay one cache line");
+_Static_assert(offsetof(Procedure, pid) == 4 * CACHE_LINE_SIZE, "Procedure hot part must stay four cache lines");
+
+struct PerCpu;
 
-void scheduler_tick(void);
+void scheduler_tick(uint64_t ticks);
 void context_switch(void);
+void sched_yield(void);
+void sched_exit(void);
+void sched_block(SchedulerState state);
+void sched_set_state(SchedulerState state);
+void sched_wakeup(Procedure *proc);
+void sched_set_priority(Procedure *proc, uint8_t priority);
+void sched_set_nice(Procedure *proc, int nice);
+bool sched_set_affinity(Procedure *proc, CpuMask mask);
+bool sched_set_deadline(Procedure *proc, uint64_t runtime_ns, uint64_t deadline_ns, uint64_t period_ns);
+void scheduler_irq_exit(void);
+size_t sched_nr_ready(void);
+bool sched_idle_balance(void);
+void sched_bench_switch(uint32_t iterations);
+void sched_bench_pick_switch(uint32_t iterations);
+void sched_dump_stats(void);
 Procedure *scheduler_get_current(void);
+bool init_proc(Procedure *p, struct Process *process, uint64_t entry_point, int argc, char** argv, char** envp, uint8_t privilege_level, uint64_t stack_base, uint64_t stack_size);
 Procedure *create_proc(uint64_t entry_point, int argc, char** argv, char** envp, uint8_t privilege_level, uint64_t stack_base, uint64_t stack_size,
                       uint64_t heap_base, uint64_t heap_size);
+Procedure *create_thread(struct Process *process, uint64_t entry_point, int argc, char** argv, char** envp, uint8_t privilege_level,
+                         uint64_t stack_base, uint64_t stack_size);
 void register_proc(Procedure *proc);
 void scheduler_init(void);
+void scheduler_init_cpu(struct PerCpu *cpu);
 
 #endif /* SCHEDULER_H */
\ No newline at end of file
@@ -0,0 +1,42 @@
+[bits 64]
+
+section .text
+
+; Procedure* switch_kernel_stack(uint64_t* prev_rsp, uint64_t next_rsp, Procedure* prev)
+;
+; Saves the callee-saved registers on the current kernel stack, stores the
+; stack pointer in *prev_rsp and resumes the task whose stack is next_rsp.
+; Everything else is either caller-saved (the C caller spilled it) or lives
+; in the TrapFrame the interrupt stub pushed further up the same stack.
+; prev rides across in rax, so the resumed side learns who it replaced.
+global switch_kernel_stack
+switch_kernel_stack:
+    mov rax, rdx
+    push rbx
+    push rbp
+    push r12
+    push r13
+    push r14
+    push r15
+    mov [rdi], rsp
+    mov rsp, rsi
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbp
+    pop rbx
+    ret
+
+; First return of a new procedure: finish the switch like context_switch()
+; would, then drop into its prepared TrapFrame.
+extern sched_finish_switch
+extern trap_return
+
+global sched_task_start
+sched_task_start:
+    mov rdi, rax
+    sub rsp, 8              ; the TrapFrame leaves rsp 8 off the call alignment
+    call sched_finish_switch
+    add rsp, 8
+    jmp trap_return
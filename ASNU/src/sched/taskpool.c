@@ -0,0 +1,326 @@
+#include "taskpool.h"
+#include "scheduler.h"
+#include "process.h"
+#include <string.h>
+#include <PMM/pmm.h>
+#include <Serial/serial.h>
+#include <KiSimple.h>
+#include <sync/spinlock.h>
+#include <smp/smp.h>
+
+/*
+ * Chase-Lev work-stealing deque (fixed size). The owner pushes and takes
+ * at bottom without atomics on the fast path; thieves race on top with a
+ * CAS. Only the owning worker may push or take, never an interrupt handler
+ * running on top of it, which is why those go through the injection queue.
+ */
+typedef struct {
+    volatile int64_t top;
+    uint8_t pad0[56];
+    volatile int64_t bottom;
+    uint8_t pad1[56];
+    Task *buf[TASKPOOL_DEQUE_SIZE];
+} TaskDeque;
+
+typedef struct {
+    TaskDeque deque;
+    Procedure *proc;
+    uint32_t id;
+    uint64_t rng;
+} Worker;
+
+_Static_assert(sizeof(Worker) <= 4096, "Worker must fit in one page");
+
+static Worker *workers[TASKPOOL_MAX_WORKERS];
+static uint32_t worker_count = 0;
+
+/* Bit n set while worker n is blocked waiting for work */
+static volatile uint64_t idle_mask = 0;
+
+static Spinlock inject_lock = SPINLOCK_INIT;
+static Task *inject_head = NULL;
+static Task *inject_tail = NULL;
+
+static bool deque_push(TaskDeque *d, Task *t) {
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    if (b - top >= TASKPOOL_DEQUE_SIZE) return false;
+
+    __atomic_store_n(&d->buf[b & (TASKPOOL_DEQUE_SIZE - 1)], t, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+static Task *deque_take(TaskDeque *d) {
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+    if (top > b) {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    Task *t = __atomic_load_n(&d->buf[b & (TASKPOOL_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (top == b) {
+        /* Last element: race the thieves for it */
+        if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            t = NULL;
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return t;
+}
+
+static Task *deque_steal(TaskDeque *d) {
+    int64_t top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (top >= b) return NULL;
+
+    Task *t = __atomic_load_n(&d->buf[top & (TASKPOOL_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;    /* lost the race, the caller moves on to another victim */
+    return t;
+}
+
+static inline bool deque_empty(TaskDeque *d) {
+    return __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE) <= __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+}
+
+static void inject_push(Task *t) {
+    t->next = NULL;
+    uint64_t flags = spin_lock_irqsave(&inject_lock);
+    if (inject_tail) inject_tail->next = t;
+    else inject_head = t;
+    inject_tail = t;
+    spin_unlock_irqrestore(&inject_lock, flags);
+}
+
+static Task *inject_pop(void) {
+    if (!__atomic_load_n(&inject_head, __ATOMIC_RELAXED)) return NULL;
+
+    uint64_t flags = spin_lock_irqsave(&inject_lock);
+    Task *t = inject_head;
+    if (t) {
+        inject_head = t->next;
+        if (!inject_head) inject_tail = NULL;
+    }
+    spin_unlock_irqrestore(&inject_lock, flags);
+    return t;
+}
+
+static inline uint64_t xorshift64(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/* The worker the current procedure is, or NULL */
+static Worker *taskpool_self(void) {
+    Procedure *curr = scheduler_get_current();
+    for (uint32_t i = 0; i < worker_count; i++)
+        if (workers[i]->proc == curr) return workers[i];
+    return NULL;
+}
+
+static bool taskpool_has_work(void) {
+    if (__atomic_load_n(&inject_head, __ATOMIC_ACQUIRE)) return true;
+    for (uint32_t i = 0; i < worker_count; i++)
+        if (!deque_empty(&workers[i]->deque)) return true;
+    return false;
+}
+
+/* Own deque first (cache-hot, LIFO), then the injection queue, then steal from a random victim */
+static Task *taskpool_find(Worker *self) {
+    Task *t;
+    if (self && (t = deque_take(&self->deque))) return t;
+    if ((t = inject_pop())) return t;
+
+    uint32_t n = worker_count;
+    if (!n) return NULL;
+
+    uint64_t seed = rdtsc() | 1;
+    uint32_t start = (uint32_t)(xorshift64(self ? &self->rng : &seed) % n);
+    for (uint32_t i = 0; i < n; i++) {
+        Worker *victim = workers[(start + i) % n];
+        if (victim == self) continue;
+        if ((t = deque_steal(&victim->deque))) return t;
+    }
+    return NULL;
+}
+
+static void task_run(Task *t) {
+    /* t may be reused by its owner as soon as the completion fires */
+    Completion *done = t->done;
+    t->fn(t->arg);
+    if (done) completion_done(done);
+}
+
+/* Wake one blocked worker, if any */
+static void taskpool_kick(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t mask = __atomic_load_n(&idle_mask, __ATOMIC_RELAXED);
+    while (mask) {
+        uint32_t id = (uint32_t)__builtin_ctzll(mask);
+        if (__atomic_compare_exchange_n(&idle_mask, &mask, mask & ~(1ULL << id), false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            sched_wakeup(workers[id]->proc);
+            return;
+        }
+    }
+}
+
+/*
+ * Block until there is work. The idle bit is published and the queues
+ * rechecked after marking ourselves PROC_WAITING, so a submit racing with
+ * us either is seen here or wakes us.
+ */
+static void worker_idle(Worker *w) {
+    uint64_t flags = irq_save();
+    sched_set_state(PROC_WAITING);
+    __atomic_fetch_or(&idle_mask, 1ULL << w->id, __ATOMIC_SEQ_CST);
+
+    if (taskpool_has_work()) {
+        __atomic_fetch_and(&idle_mask, ~(1ULL << w->id), __ATOMIC_SEQ_CST);
+        sched_set_state(PROC_RUNNING);
+    } else {
+        context_switch();
+    }
+    irq_restore(flags);
+}
+
+static void worker_main(int id) {
+    Worker *w = workers[id];
+    for (;;) {
+        Task *t = taskpool_find(w);
+        if (t) task_run(t);
+        else worker_idle(w);
+    }
+}
+
+/* One worker per housekeeping CPU online at this point; isolated CPUs get none */
+void taskpool_init(void) {
+    uint32_t cpus = 0;
+    CpuMask housekeeping = smp_housekeeping_mask();
+    for (uint32_t i = 0; i < smp_cpu_count(); i++)
+        if (smp_get_cpu(i)->online && cpumask_test(housekeeping, i)) cpus++;
+    if (cpus > TASKPOOL_MAX_WORKERS) cpus = TASKPOOL_MAX_WORKERS;
+
+    for (uint32_t i = 0; i < cpus; i++) {
+        Worker *w = (Worker*)palloc();
+        uint64_t stack = (uint64_t)palloc();
+        if (!w || !stack) break;
+        memset(w, 0, sizeof(Worker));
+        w->id = i;
+        w->rng = (rdtsc() ^ ((uint64_t)i << 32)) | 1;
+
+        w->proc = create_thread(&kernel_process, (uint64_t)&worker_main, (int)i, NULL, NULL, 0, stack, 4096);
+        if (!w->proc) break;
+
+        workers[i] = w;
+        __atomic_store_n(&worker_count, i + 1, __ATOMIC_RELEASE);
+        register_proc(w->proc);
+    }
+
+    serial_fwrite("Task pool: %u workers", worker_count);
+}
+
+uint32_t taskpool_worker_count(void) {
+    return worker_count;
+}
+
+void taskpool_submit(Task *task) {
+    inject_push(task);
+    taskpool_kick();
+}
+
+void completion_init(Completion *c, int64_t count) {
+    __atomic_store_n(&c->pending, count, __ATOMIC_RELEASE);
+}
+
+void completion_done(Completion *c) {
+    __atomic_fetch_sub(&c->pending, 1, __ATOMIC_ACQ_REL);
+}
+
+bool completion_is_done(Completion *c) {
+    return __atomic_load_n(&c->pending, __ATOMIC_ACQUIRE) <= 0;
+}
+
+/*
+ * Help instead of sleeping: a joiner that blocked could hold up the very
+ * tasks it waits for when every worker is itself joining.
+ */
+void taskpool_join(Completion *c) {
+    Worker *self = taskpool_self();
+    while (!completion_is_done(c)) {
+        Task *t = taskpool_find(self);
+        if (t) task_run(t);
+        else sched_yield();
+    }
+}
+
+typedef struct {
+    void (*fn)(void *arg, uint64_t lo, uint64_t hi);
+    void *arg;
+    uint64_t end;
+    uint64_t grain;
+    volatile uint64_t next;
+    Completion done;
+    Task runners[];
+} ParallelFor;
+
+#define PARALLEL_FOR_MAX_RUNNERS ((4096 - sizeof(ParallelFor)) / sizeof(Task))
+
+/* Every runner claims grain-sized pieces until the range is used up */
+static void parallel_for_runner(void *arg) {
+    ParallelFor *pf = (ParallelFor*)arg;
+    for (;;) {
+        uint64_t lo = __atomic_fetch_add(&pf->next, pf->grain, __ATOMIC_RELAXED);
+        if (lo >= pf->end) break;
+        uint64_t hi = pf->end - lo < pf->grain ? pf->end : lo + pf->grain;
+        pf->fn(pf->arg, lo, hi);
+    }
+}
+
+void parallel_for(uint64_t begin, uint64_t end, uint64_t grain,
+                  void (*fn)(void *arg, uint64_t lo, uint64_t hi), void *arg) {
+    if (end <= begin) return;
+    if (grain == 0) grain = 1;
+
+    uint64_t pieces = (end - begin + grain - 1) / grain;
+    uint64_t runners = worker_count;    /* the caller is one more */
+    if (runners > pieces - 1) runners = pieces - 1;
+    if (runners > PARALLEL_FOR_MAX_RUNNERS) runners = PARALLEL_FOR_MAX_RUNNERS;
+
+    ParallelFor *pf = runners ? (ParallelFor*)palloc() : NULL;
+    if (!pf) {
+        fn(arg, begin, end);
+        return;
+    }
+
+    pf->fn = fn;
+    pf->arg = arg;
+    pf->end = end;
+    pf->grain = grain;
+    pf->next = begin;
+    completion_init(&pf->done, (int64_t)runners);
+
+    Worker *self = taskpool_self();
+    for (uint64_t i = 0; i < runners; i++) {
+        Task *t = &pf->runners[i];
+        t->fn = parallel_for_runner;
+        t->arg = pf;
+        t->done = &pf->done;
+        t->next = NULL;
+        if (!self || !deque_push(&self->deque, t))
+            inject_push(t);
+        taskpool_kick();
+    }
+
+    parallel_for_runner(pf);
+    taskpool_join(&pf->done);
+    kfree(pf);
+}
@@ -0,0 +1,45 @@
+#ifndef TASKPOOL_H
+#define TASKPOOL_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Kernel task pool: one worker procedure per online CPU, each owning a
+ * Chase-Lev deque. Workers run their own deque LIFO, then the shared
+ * injection queue, then steal FIFO from a random victim.
+ */
+
+#define TASKPOOL_MAX_WORKERS    64
+#define TASKPOOL_DEQUE_SIZE     256     /* power of two */
+
+typedef struct Completion {
+    volatile int64_t pending;
+} Completion;
+
+/* Caller-owned; must stay valid until the task has run */
+typedef struct Task {
+    void (*fn)(void *arg);
+    void *arg;
+    Completion *done;           /* signalled after fn returns, may be NULL */
+    struct Task *next;          /* injection queue link */
+} Task;
+
+void taskpool_init(void);
+uint32_t taskpool_worker_count(void);
+
+/* Queue a task from any context, interrupt handlers included */
+void taskpool_submit(Task *task);
+
+/* Run fn over [begin, end) in grain-sized pieces on all workers; not from interrupt handlers */
+void parallel_for(uint64_t begin, uint64_t end, uint64_t grain,
+                  void (*fn)(void *arg, uint64_t lo, uint64_t hi), void *arg);
+
+void completion_init(Completion *c, int64_t count);
+void completion_done(Completion *c);
+bool completion_is_done(Completion *c);
+
+/* Wait for c, running queued tasks meanwhile; never blocks the pool */
+void taskpool_join(Completion *c);
+
+#endif /* TASKPOOL_H */
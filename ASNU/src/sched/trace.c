@@ -0,0 +1,87 @@
+#include "trace.h"
+#include "taskpool.h"
+#include <PMM/pmm.h>
+#include <Serial/serial.h>
+#include <KiSimple.h>
+#include <smp/smp.h>
+#include <time/clocksource.h>
+
+_Static_assert(sizeof(TraceEvent) * TRACE_EVENTS_PER_PAGE == 4096, "trace events must fill a page exactly");
+_Static_assert((TRACE_RING_EVENTS & (TRACE_RING_EVENTS - 1)) == 0, "TRACE_RING_EVENTS must be a power of two");
+
+volatile bool trace_enabled = true;
+
+/* Pages need not be contiguous; a CPU without all of them records nothing */
+void trace_init_cpu(PerCpu *cpu) {
+    TraceRing *ring = &cpu->trace;
+    ring->head = 0;
+    ring->ready = false;
+    for (uint32_t i = 0; i < TRACE_RING_PAGES; i++) {
+        if (!ring->pages[i]) ring->pages[i] = (TraceEvent*)palloc();
+        if (!ring->pages[i]) return;
+    }
+    ring->ready = true;
+}
+
+void __trace_record(uint32_t type, uint32_t pid, uint32_t arg0, uint32_t arg1, uint64_t arg2) {
+    uint64_t flags = irq_save();
+    TraceRing *ring = &this_cpu()->trace;
+    if (ring->ready) {
+        uint64_t i = ring->head++ & (TRACE_RING_EVENTS - 1);
+        TraceEvent *e = &ring->pages[i / TRACE_EVENTS_PER_PAGE][i % TRACE_EVENTS_PER_PAGE];
+        e->tsc = rdtsc();
+        e->type = type;
+        e->pid = pid;
+        e->arg0 = arg0;
+        e->arg1 = arg1;
+        e->arg2 = arg2;
+    }
+    irq_restore(flags);
+}
+
+/*
+ * Format read by tools/sched_trace.py:
+ *   TRACE BEGIN <cpus> <tsc per us>
+ *   TRACE CPU <cpu> <events recorded> <events overwritten>
+ *   E <cpu> <tsc> <type> <pid> <arg0> <arg1> <arg2>     oldest first
+ *   TRACE END
+ */
+void trace_dump(void) {
+    bool was = trace_enabled;
+    trace_enabled = false;
+
+    uint64_t tsc_per_us = clocksource_tsc_hz() / 1000000;
+    serial_fwrite("TRACE BEGIN %u %llu", smp_cpu_count(), tsc_per_us);
+    for (uint32_t c = 0; c < smp_cpu_count(); c++) {
+        PerCpu *cpu = smp_get_cpu(c);
+        if (!cpu || !cpu->trace.ready) continue;
+        TraceRing *ring = &cpu->trace;
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+        serial_fwrite("TRACE CPU %u %llu %llu", c, head, first);
+        for (uint64_t n = first; n < head; n++) {
+            uint64_t i = n & (TRACE_RING_EVENTS - 1);
+            TraceEvent *e = &ring->pages[i / TRACE_EVENTS_PER_PAGE][i % TRACE_EVENTS_PER_PAGE];
+            serial_fwrite("E %u %llu %u %u %u %u %llu", c, e->tsc, e->type, e->pid, e->arg0, e->arg1, e->arg2);
+        }
+    }
+    serial_fwrite("TRACE END");
+
+    trace_enabled = was;
+}
+
+/* Dumping takes seconds at serial speed: not something to do inside an interrupt */
+static volatile bool trace_dump_queued = false;
+
+static void trace_dump_task(void *arg) {
+    (void)arg;
+    trace_dump();
+    __atomic_store_n(&trace_dump_queued, false, __ATOMIC_RELEASE);
+}
+
+static Task trace_task = { trace_dump_task, NULL, NULL, NULL };
+
+void trace_dump_async(void) {
+    if (__atomic_exchange_n(&trace_dump_queued, true, __ATOMIC_ACQ_REL)) return;
+    taskpool_submit(&trace_task);
+}
@@ -0,0 +1,59 @@
+#ifndef TRACE_H
+#define TRACE_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Scheduler event tracing. Each CPU records into a ring of its own with
+ * interrupts held off for the few stores an event takes, so recording
+ * needs neither a lock nor an atomic instruction. A ring keeps the newest
+ * TRACE_RING_EVENTS events and overwrites older ones. 'r' on the serial
+ * console dumps every ring as text, which ASNU/tools/sched_trace.py turns
+ * into a timeline and per-task latencies.
+ */
+
+#define TRACE_RING_PAGES        16
+#define TRACE_EVENTS_PER_PAGE   128
+#define TRACE_RING_EVENTS       (TRACE_RING_PAGES * TRACE_EVENTS_PER_PAGE)
+
+typedef enum {
+    TRACE_SWITCH = 1,           /* pid: next, arg0: prev pid, arg1: prev state */
+    TRACE_WAKEUP = 2,           /* pid: woken, arg0: target CPU, arg1: waker pid, arg2: state it left */
+    TRACE_MIGRATE = 3,          /* pid: moved, arg0: from CPU, arg1: to CPU */
+    TRACE_BLOCK = 4,            /* pid: blocking, arg0: state */
+    TRACE_TICK = 5,             /* pid: current, arg0: tick periods, arg1: ready procedures */
+} TraceType;
+
+typedef struct {
+    uint64_t tsc;
+    uint32_t type;
+    uint32_t pid;
+    uint32_t arg0;
+    uint32_t arg1;
+    uint64_t arg2;
+} TraceEvent;
+
+typedef struct TraceRing {
+    TraceEvent *pages[TRACE_RING_PAGES];
+    uint64_t head;              /* events ever recorded; the next goes at head % TRACE_RING_EVENTS */
+    bool ready;
+} TraceRing;
+
+struct PerCpu;
+
+extern volatile bool trace_enabled;
+
+void trace_init_cpu(struct PerCpu *cpu);
+void __trace_record(uint32_t type, uint32_t pid, uint32_t arg0, uint32_t arg1, uint64_t arg2);
+
+static inline void trace_sched(TraceType type, uint32_t pid, uint32_t arg0, uint32_t arg1, uint64_t arg2) {
+    if (__builtin_expect(trace_enabled, 1))
+        __trace_record(type, pid, arg0, arg1, arg2);
+}
+
+/* Print every ring over serial; recording pauses meanwhile. trace_dump_async() is for interrupt handlers */
+void trace_dump(void);
+void trace_dump_async(void);
+
+#endif /* TRACE_H */
@@ -0,0 +1,26 @@
+#include "cpumask.h"
+
+/* "1,3-5" style lists; stops at the first space or the end of the string */
+bool cpumask_parse(const char *s, CpuMask *out) {
+    CpuMask mask = CPUMASK_NONE;
+    while (*s && *s != ' ') {
+        if (*s < '0' || *s > '9') return false;
+        uint32_t lo = 0;
+        while (*s >= '0' && *s <= '9') lo = lo * 10 + (uint32_t)(*s++ - '0');
+
+        uint32_t hi = lo;
+        if (*s == '-') {
+            s++;
+            if (*s < '0' || *s > '9') return false;
+            hi = 0;
+            while (*s >= '0' && *s <= '9') hi = hi * 10 + (uint32_t)(*s++ - '0');
+        }
+        if (hi < lo || hi >= 64) return false;
+        for (uint32_t cpu = lo; cpu <= hi; cpu++) mask |= cpumask_of(cpu);
+
+        if (*s == ',') s++;
+        else if (*s && *s != ' ') return false;
+    }
+    *out = mask;
+    return true;
+}
@@ -0,0 +1,23 @@
+#ifndef CPUMASK_H
+#define CPUMASK_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* One bit per dense CPU index, enough for SMP_MAX_CPUS */
+typedef uint64_t CpuMask;
+
+#define CPUMASK_NONE    0ULL
+#define CPUMASK_ALL     (~0ULL)
+
+static inline CpuMask cpumask_of(uint32_t cpu) {
+    return cpu < 64 ? (1ULL << cpu) : 0;
+}
+
+static inline bool cpumask_test(CpuMask mask, uint32_t cpu) {
+    return (mask & cpumask_of(cpu)) != 0;
+}
+
+bool cpumask_parse(const char *s, CpuMask *out);
+
+#endif /* CPUMASK_H */
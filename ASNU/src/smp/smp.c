@@ -0,0 +1,163 @@
+#include "smp.h"
+#include <string.h>
+#include <PMM/pmm.h>
+#include <VMM/vmm.h>
+#include <IDT/idt.h>
+#include <Drivers/LAPIC.h>
+#include <time/tick.h>
+#include <time/clocksource.h>
+#include <fpu/fpu.h>
+#include <Serial/serial.h>
+
+_Static_assert(sizeof(PerCpu) <= 4096, "PerCpu must fit in one page");
+
+static PerCpu *cpus[SMP_MAX_CPUS];
+static uint32_t cpu_count = 0;
+static volatile uint32_t cpus_online = 0;
+
+static PerCpu *smp_alloc_cpu(uint32_t lapic_id) {
+    if (cpu_count >= SMP_MAX_CPUS) return NULL;
+
+    PerCpu *cpu = (PerCpu*)palloc();
+    void *gdt_page = palloc();
+    if (!cpu || !gdt_page) return NULL;
+    memset(cpu, 0, 4096);
+    memset(gdt_page, 0, 4096);
+
+    cpu->self = cpu;
+    cpu->cpu_id = cpu_count;
+    cpu->lapic_id = lapic_id;
+    /* GDT and TSS share a page, the GDT at its aligned start */
+    cpu->gdt = (GDT*)gdt_page;
+    cpu->tss = (TSS*)((uintptr_t)gdt_page + 0x800);
+
+    cpus[cpu_count] = cpu;
+    __atomic_store_n(&cpu_count, cpu_count + 1, __ATOMIC_RELEASE);
+    return cpu;
+}
+
+static void smp_load_cpu(PerCpu *cpu) {
+    gdt_init_cpu(cpu->gdt, cpu->tss);
+    wrmsr(MSR_GS_BASE, (uint64_t)cpu);
+}
+
+/* Give the boot CPU its per-CPU block; everything using this_cpu() depends on it */
+void smp_init_bsp(void) {
+    PerCpu *cpu = smp_alloc_cpu(0);
+    if (!cpu) KiPanic("SMP: cannot allocate the boot CPU block", 1);
+
+    smp_load_cpu(cpu);
+    cpu->online = true;
+    cpus_online = 1;
+}
+
+/* TSC of the boot CPU just before it let the application processors go */
+static uint64_t ap_launch_tsc = 0;
+
+static void ap_entry(struct limine_mp_info *info) {
+    PerCpu *cpu = (PerCpu*)info->extra_argument;
+
+    /* Limine starts us on its own page tables */
+    asm volatile ("mov %0, %%cr3" : : "r"(VA2PA(PML4)) : "memory");
+
+    smp_load_cpu(cpu);
+    clocksource_check_tsc_sync(ap_launch_tsc);
+    idt_load();
+    fpu_init_cpu();
+    lapic_init_ap();
+    topology_init_cpu(cpu);
+    scheduler_init_cpu(cpu);
+
+    __atomic_store_n(&cpu->online, true, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&cpus_online, 1, __ATOMIC_RELEASE);
+
+    tick_init_cpu();
+    asm volatile ("sti");
+
+    /* This context is now the CPU's idle procedure */
+    cpu_idle_loop();
+}
+
+/* Start every application processor reported by the bootloader and wait for them */
+void smp_init(struct limine_mp_response *mp) {
+    PerCpu *bsp = this_cpu();
+    bsp->lapic_id = lapic_get_id();
+    topology_init_cpu(bsp);
+
+    if (!mp) {
+        serial_fwrite("SMP: no MP response, running on the boot CPU only");
+        topology_build();
+        return;
+    }
+
+    ap_launch_tsc = rdtsc();
+    for (uint64_t i = 0; i < mp->cpu_count; i++) {
+        struct limine_mp_info *info = mp->cpus[i];
+        if (info->lapic_id == mp->bsp_lapic_id) continue;
+
+        PerCpu *cpu = smp_alloc_cpu(info->lapic_id);
+        if (!cpu) break;
+
+        info->extra_argument = (uint64_t)cpu;
+        __atomic_store_n(&info->goto_address, ap_entry, __ATOMIC_SEQ_CST);
+    }
+
+    /* A core that does not come up within a second is left out */
+    uint64_t start = tick_get_jiffies();
+    while (__atomic_load_n(&cpus_online, __ATOMIC_ACQUIRE) < cpu_count
+        && tick_get_jiffies() - start < tick_get_hz())
+        asm volatile ("pause");
+
+    serial_fwrite("SMP: %u of %u CPUs online", cpus_online, cpu_count);
+    topology_build();
+    topology_dump();
+}
+
+/*
+ * CPUs named by isolcpus= on the command line run only procedures pinned
+ * to them: nothing is placed there by default, and with a single procedure
+ * and no timers their tick stays stopped. The boot CPU keeps housekeeping.
+ */
+static CpuMask isolated_mask = CPUMASK_NONE;
+
+void smp_isolate_cpus(const char *cmdline) {
+    if (!cmdline) return;
+    for (const char *s = cmdline; *s; s++) {
+        if ((s != cmdline && s[-1] != ' ') || strncmp(s, "isolcpus=", 9) != 0) continue;
+
+        CpuMask mask;
+        if (!cpumask_parse(s + 9, &mask)) {
+            serial_fwrite("SMP: bad isolcpus= list, ignored");
+            return;
+        }
+        isolated_mask = mask & ~cpumask_of(0);
+        serial_fwrite("SMP: isolated CPU mask 0x%llx", isolated_mask);
+        return;
+    }
+}
+
+CpuMask smp_isolated_mask(void) {
+    return isolated_mask;
+}
+
+CpuMask smp_housekeeping_mask(void) {
+    return ~isolated_mask;
+}
+
+uint32_t smp_cpu_count(void) {
+    return __atomic_load_n(&cpu_count, __ATOMIC_ACQUIRE);
+}
+
+PerCpu *smp_get_cpu(uint32_t cpu_id) {
+    return cpu_id < cpu_count ? cpus[cpu_id] : NULL;
+}
+
+void smp_send_resched(uint32_t cpu_id) {
+    PerCpu *cpu = smp_get_cpu(cpu_id);
+    if (!cpu || !cpu->online || cpu == this_cpu()) return;
+
+    /* Pairs with the idle loop's fence: it either sees need_resched or is seen polling */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (idle_polling(cpu)) return;
+    lapic_send_ipi(cpu->lapic_id, LAPIC_RESCHED_VECTOR);
+}
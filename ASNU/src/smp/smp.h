@@ -0,0 +1,63 @@
+#ifndef SMP_H
+#define SMP_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <limine.h>
+#include <GDT/GDT.h>
+#include <sched/runqueue.h>
+#include <time/tick.h>
+#include <time/timer.h>
+#include <smp/cpumask.h>
+#include <smp/topology.h>
+#include <sched/idle.h>
+#include <sched/trace.h>
+
+#define SMP_MAX_CPUS 64
+
+/*
+ * Per-CPU data block. Each one fills a page of its own, so no two CPUs ever
+ * write the same cache line, and GS base points at it. The first field
+ * points back at the block, making this_cpu() a single gs-relative load.
+ */
+typedef struct PerCpu {
+    struct PerCpu *self;
+    uint32_t cpu_id;            /* dense index, 0 is the boot CPU */
+    uint32_t lapic_id;
+    volatile bool online;
+    CpuTopology topo;
+
+    Procedure *current;
+    uint64_t ticks;
+    TickState tick;
+    TimerBase timers;
+
+    Procedure *fpu_owner;       /* whose state the FPU registers were last loaded with */
+    bool fpu_live;              /* CR0.TS clear: the registers are current's state */
+
+    GDT *gdt;
+    TSS *tss;
+
+    IdleState idle_state;
+    TraceRing trace;
+
+    RunQueue rq;
+    Procedure idle;             /* the CPU's boot context, ends in cpu_idle_loop() */
+} PerCpu;
+
+static inline PerCpu *this_cpu(void) {
+    PerCpu *cpu;
+    asm volatile ("movq %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+void smp_init_bsp(void);
+void smp_init(struct limine_mp_response *mp);
+uint32_t smp_cpu_count(void);
+PerCpu *smp_get_cpu(uint32_t cpu_id);
+void smp_send_resched(uint32_t cpu_id);
+void smp_isolate_cpus(const char *cmdline);
+CpuMask smp_isolated_mask(void);
+CpuMask smp_housekeeping_mask(void);
+
+#endif /* SMP_H */
@@ -0,0 +1,139 @@
+#include "topology.h"
+#include "smp.h"
+#include <KiSimple.h>
+#include <Serial/serial.h>
+
+#define TOPO_TYPE_SMT   1
+#define TOPO_TYPE_CORE  2
+
+static const char *topo_level_names[TOPO_LEVELS] = { "SMT", "L2", "LLC", "PKG", "SYSTEM" };
+
+static uint8_t count_to_shift(uint32_t count) {
+    uint8_t shift = 0;
+    while ((1U << shift) < count) shift++;
+    return shift;
+}
+
+/* Leaf 0x1F or 0xB: SMT and package shifts, and the x2APIC ID */
+static bool topology_extended(uint32_t leaf, CpuTopology *t) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(leaf, 0, &eax, &ebx, &ecx, &edx);
+    if (!ebx) return false;
+
+    t->apic_id = edx;
+    uint8_t smt = 0, pkg = 0;
+    for (uint32_t sub = 0; sub < 8; sub++) {
+        cpuid(leaf, sub, &eax, &ebx, &ecx, &edx);
+        uint32_t type = (ecx >> 8) & 0xFF;
+        if (!type) break;
+        if (type == TOPO_TYPE_SMT) smt = eax & 0x1F;
+        pkg = eax & 0x1F;       /* the last level's shift covers the whole package */
+    }
+    t->shift[TOPO_SMT] = smt;
+    t->shift[TOPO_PKG] = pkg;
+    return true;
+}
+
+/* Deterministic cache parameters: leaf 4 or 0x8000001D, same layout */
+static void topology_caches(uint32_t leaf, CpuTopology *t) {
+    uint32_t eax, ebx, ecx, edx;
+    uint32_t llc_level = 0;
+    for (uint32_t sub = 0; sub < 16; sub++) {
+        cpuid(leaf, sub, &eax, &ebx, &ecx, &edx);
+        uint32_t type = eax & 0x1F;
+        if (!type) break;
+        if (type == 2) continue;                /* instruction cache */
+
+        uint32_t level = (eax >> 5) & 0x7;
+        uint8_t shift = count_to_shift(((eax >> 14) & 0xFFF) + 1);
+        if (level == 2) t->shift[TOPO_L2] = shift;
+        if (level >= llc_level) {
+            llc_level = level;
+            t->shift[TOPO_LLC] = shift;
+        }
+    }
+}
+
+void topology_init_cpu(PerCpu *cpu) {
+    CpuTopology *t = &cpu->topo;
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    uint32_t max_leaf = eax;
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    uint32_t max_ext = eax;
+
+    for (int l = 0; l < TOPO_SYSTEM; l++) t->shift[l] = 0xFF;
+
+    bool ext = (max_leaf >= 0x1F && topology_extended(0x1F, t))
+            || (max_leaf >= 0xB && topology_extended(0xB, t));
+    if (!ext) {
+        cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+        t->apic_id = ebx >> 24;
+        uint32_t logical = (edx & (1U << 28)) ? (ebx >> 16) & 0xFF : 1;
+        uint32_t cores = 1;
+        if (max_leaf >= 4) {
+            cpuid(4, 0, &eax, &ebx, &ecx, &edx);
+            if (eax & 0x1F) cores = (eax >> 26) + 1;
+        }
+        t->shift[TOPO_SMT] = count_to_shift(logical > cores ? logical / cores : 1);
+        t->shift[TOPO_PKG] = count_to_shift(logical);
+    }
+
+    if (max_leaf >= 4) topology_caches(4, t);
+    if (t->shift[TOPO_LLC] == 0xFF && max_ext >= 0x8000001D) topology_caches(0x8000001D, t);
+
+    /* Missing cache information: L2 per core, LLC per package */
+    if (t->shift[TOPO_L2] == 0xFF) t->shift[TOPO_L2] = t->shift[TOPO_SMT];
+    if (t->shift[TOPO_LLC] == 0xFF) t->shift[TOPO_LLC] = t->shift[TOPO_PKG];
+
+    /* Keep the levels nested whatever the CPU reports */
+    for (int l = TOPO_L2; l < TOPO_SYSTEM; l++)
+        if (t->shift[l] < t->shift[l - 1]) t->shift[l] = t->shift[l - 1];
+}
+
+static inline bool topology_shares(const CpuTopology *a, const CpuTopology *b, TopoLevel level) {
+    if (level == TOPO_SYSTEM) return true;
+    uint8_t shift = a->shift[level];
+    if (shift >= 32) return true;
+    return (a->apic_id >> shift) == (b->apic_id >> shift);
+}
+
+void topology_build(void) {
+    uint32_t n = smp_cpu_count();
+    for (uint32_t i = 0; i < n; i++) {
+        PerCpu *a = smp_get_cpu(i);
+        if (!a->online) continue;
+        for (int l = 0; l < TOPO_LEVELS; l++) a->topo.domain[l] = CPUMASK_NONE;
+
+        for (uint32_t j = 0; j < n; j++) {
+            PerCpu *b = smp_get_cpu(j);
+            if (!b->online) continue;
+            for (int l = 0; l < TOPO_LEVELS; l++)
+                if (topology_shares(&a->topo, &b->topo, (TopoLevel)l)) a->topo.domain[l] |= cpumask_of(j);
+        }
+    }
+}
+
+TopoLevel topology_distance(uint32_t a, uint32_t b) {
+    PerCpu *cpu = smp_get_cpu(a);
+    if (!cpu) return TOPO_SYSTEM;
+    for (int l = 0; l < TOPO_SYSTEM; l++)
+        if (cpumask_test(cpu->topo.domain[l], b)) return (TopoLevel)l;
+    return TOPO_SYSTEM;
+}
+
+CpuMask topology_domain(uint32_t cpu, TopoLevel level) {
+    PerCpu *c = smp_get_cpu(cpu);
+    return c ? c->topo.domain[level] : CPUMASK_NONE;
+}
+
+void topology_dump(void) {
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        PerCpu *cpu = smp_get_cpu(i);
+        if (!cpu->online) continue;
+        CpuTopology *t = &cpu->topo;
+        serial_fwrite("Topology CPU %u: apic %u, %s 0x%llx %s 0x%llx %s 0x%llx %s 0x%llx", i, t->apic_id,
+                      topo_level_names[TOPO_SMT], t->domain[TOPO_SMT], topo_level_names[TOPO_L2], t->domain[TOPO_L2],
+                      topo_level_names[TOPO_LLC], t->domain[TOPO_LLC], topo_level_names[TOPO_PKG], t->domain[TOPO_PKG]);
+    }
+}
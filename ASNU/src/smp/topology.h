@@ -0,0 +1,42 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <smp/cpumask.h>
+
+/*
+ * CPU topology from CPUID: x2APIC ID fields (leaf 0x1F, else 0xB, else
+ * the legacy leaves 1 and 4) give SMT siblings and packages, the cache
+ * leaves (4 on Intel, 0x8000001D on AMD) which CPUs share L2 and the last
+ * level cache. Each CPU gets one mask per level, its scheduling domains,
+ * nested from SMT siblings out to the whole system.
+ */
+typedef enum {
+    TOPO_SMT = 0,               /* threads of one core */
+    TOPO_L2,                    /* cores sharing an L2 */
+    TOPO_LLC,                   /* cores sharing the last level cache */
+    TOPO_PKG,
+    TOPO_SYSTEM,
+    TOPO_LEVELS
+} TopoLevel;
+
+typedef struct CpuTopology {
+    uint32_t apic_id;           /* x2APIC ID where available */
+    uint8_t shift[TOPO_SYSTEM]; /* apic_id >> shift[level] is the ID of the level's instance */
+    CpuMask domain[TOPO_LEVELS];    /* online CPUs sharing each level with this one, itself included */
+} CpuTopology;
+
+struct PerCpu;
+
+/* On each CPU as it comes up */
+void topology_init_cpu(struct PerCpu *cpu);
+/* Once every CPU is up: build the domain masks */
+void topology_build(void);
+
+/* Innermost level CPUs a and b share, TOPO_SYSTEM if nothing closer */
+TopoLevel topology_distance(uint32_t a, uint32_t b);
+CpuMask topology_domain(uint32_t cpu, TopoLevel level);
+void topology_dump(void);
+
+#endif /* TOPOLOGY_H */
@@ -0,0 +1,70 @@
+#include "mutex.h"
+#include <smp/smp.h>
+
+/* Spin this many rounds while the owner is running on another CPU before sleeping */
+#define MUTEX_SPIN_LIMIT 1000
+
+void mutex_init(Mutex *m) {
+    m->locked = 0;
+    m->owner = NULL;
+    waitqueue_init(&m->wq);
+}
+
+bool mutex_trylock(Mutex *m) {
+    if (__atomic_exchange_n(&m->locked, 1, __ATOMIC_ACQUIRE) != 0) return false;
+    m->owner = this_cpu()->current;
+    return true;
+}
+
+void mutex_lock(Mutex *m) {
+    if (mutex_trylock(m)) return;
+
+    /* Short critical sections usually end before a sleep would even finish */
+    for (int i = 0; i < MUTEX_SPIN_LIMIT; i++) {
+        Procedure *owner = __atomic_load_n(&m->owner, __ATOMIC_RELAXED);
+        if (!owner || !__atomic_load_n(&owner->on_cpu, __ATOMIC_RELAXED)) break;
+        asm volatile ("pause");
+        if (!m->locked && mutex_trylock(m)) return;
+    }
+
+    wait_event_exclusive(&m->wq, mutex_trylock(m));
+}
+
+void mutex_unlock(Mutex *m) {
+    m->owner = NULL;
+    __atomic_store_n(&m->locked, 0, __ATOMIC_RELEASE);
+    wake_up_one(&m->wq);
+}
+
+void cond_init(CondVar *cv) {
+    waitqueue_init(&cv->wq);
+}
+
+/* Queued before m is dropped, so a signal sent right after the unlock still finds us */
+void cond_wait(CondVar *cv, Mutex *m) {
+    WaitQueueEntry e = { 0 };
+    wait_prepare(&cv->wq, &e, PROC_WAITING, true);
+    mutex_unlock(m);
+    wait_schedule();
+    wait_finish(&cv->wq, &e);
+    mutex_lock(m);
+}
+
+/* False if ns passed without a signal */
+bool cond_wait_timeout(CondVar *cv, Mutex *m, uint64_t ns) {
+    WaitQueueEntry e = { 0 };
+    wait_prepare(&cv->wq, &e, PROC_WAITING, true);
+    mutex_unlock(m);
+    uint64_t left = wait_schedule_timeout(ns);
+    wait_finish(&cv->wq, &e);
+    mutex_lock(m);
+    return left != 0;
+}
+
+void cond_signal(CondVar *cv) {
+    wake_up_one(&cv->wq);
+}
+
+void cond_broadcast(CondVar *cv) {
+    wake_up_all(&cv->wq);
+}
@@ -0,0 +1,35 @@
+#ifndef MUTEX_H
+#define MUTEX_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sync/waitqueue.h>
+
+/* Sleeping locks; only for procedure context, never from interrupt handlers */
+
+typedef struct {
+    volatile uint32_t locked;
+    Procedure *owner;
+    WaitQueue wq;
+} Mutex;
+
+#define MUTEX_INIT { 0, NULL, WAITQUEUE_INIT }
+
+typedef struct {
+    WaitQueue wq;
+} CondVar;
+
+#define CONDVAR_INIT { WAITQUEUE_INIT }
+
+void mutex_init(Mutex *m);
+bool mutex_trylock(Mutex *m);
+void mutex_lock(Mutex *m);
+void mutex_unlock(Mutex *m);
+
+void cond_init(CondVar *cv);
+void cond_wait(CondVar *cv, Mutex *m);
+bool cond_wait_timeout(CondVar *cv, Mutex *m, uint64_t ns);
+void cond_signal(CondVar *cv);
+void cond_broadcast(CondVar *cv);
+
+#endif /* MUTEX_H */
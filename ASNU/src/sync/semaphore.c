@@ -0,0 +1,30 @@
+#include "semaphore.h"
+
+void sem_init(Semaphore *s, int64_t count) {
+    s->count = count;
+    waitqueue_init(&s->wq);
+}
+
+bool sem_trywait(Semaphore *s) {
+    int64_t c = __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+    while (c > 0) {
+        if (__atomic_compare_exchange_n(&s->count, &c, c - 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return true;
+    }
+    return false;
+}
+
+void sem_wait(Semaphore *s) {
+    if (sem_trywait(s)) return;
+    wait_event_exclusive(&s->wq, sem_trywait(s));
+}
+
+bool sem_wait_timeout(Semaphore *s, uint64_t ns) {
+    if (sem_trywait(s)) return true;
+    return wait_event_timeout(&s->wq, sem_trywait(s), ns);
+}
+
+void sem_post(Semaphore *s) {
+    __atomic_fetch_add(&s->count, 1, __ATOMIC_RELEASE);
+    wake_up_one(&s->wq);
+}
@@ -0,0 +1,23 @@
+#ifndef SEMAPHORE_H
+#define SEMAPHORE_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sync/waitqueue.h>
+
+/* Counting semaphore; sem_post() may be called from interrupt handlers */
+
+typedef struct {
+    volatile int64_t count;
+    WaitQueue wq;
+} Semaphore;
+
+#define SEMAPHORE_INIT(n) { (n), WAITQUEUE_INIT }
+
+void sem_init(Semaphore *s, int64_t count);
+bool sem_trywait(Semaphore *s);
+void sem_wait(Semaphore *s);
+bool sem_wait_timeout(Semaphore *s, uint64_t ns);
+void sem_post(Semaphore *s);
+
+#endif /* SEMAPHORE_H */
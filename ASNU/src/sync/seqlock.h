@@ -0,0 +1,47 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sync/spinlock.h>
+
+/*
+ * Sequence lock for small, read-mostly data. Writers serialize on the
+ * spinlock and make the count odd while they update; readers take no lock
+ * and retry if the count was odd or moved under them. Readers must only
+ * copy the data out, since they can see it half written.
+ */
+
+typedef struct {
+    volatile uint32_t seq;
+    Spinlock lock;
+} Seqlock;
+
+#define SEQLOCK_INIT { 0, SPINLOCK_INIT }
+
+static inline uint32_t read_seqbegin(const Seqlock *s) {
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE)) & 1)
+        asm volatile ("pause");
+    return seq;
+}
+
+static inline bool read_seqretry(const Seqlock *s, uint32_t start) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&s->seq, __ATOMIC_RELAXED) != start;
+}
+
+/* Interrupts stay off while writing, or a reader in a handler on this CPU would spin forever */
+static inline uint64_t write_seqlock_irqsave(Seqlock *s) {
+    uint64_t flags = spin_lock_irqsave(&s->lock);
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return flags;
+}
+
+static inline void write_sequnlock_irqrestore(Seqlock *s, uint64_t flags) {
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+    spin_unlock_irqrestore(&s->lock, flags);
+}
+
+#endif /* SEQLOCK_H */
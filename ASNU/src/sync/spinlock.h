@@ -0,0 +1,46 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <KiSimple.h>
+
+/* Test-and-test-and-set lock; waiters spin on a plain load so the line stays shared */
+typedef struct {
+    volatile uint32_t locked;
+} Spinlock;
+
+#define SPINLOCK_INIT { 0 }
+
+static inline void spin_lock_init(Spinlock *lock) {
+    lock->locked = 0;
+}
+
+static inline bool spin_trylock(Spinlock *lock) {
+    return __atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+static inline void spin_lock(Spinlock *lock) {
+    while (!spin_trylock(lock)) {
+        while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED))
+            asm volatile ("pause");
+    }
+}
+
+static inline void spin_unlock(Spinlock *lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+/* For locks also taken from interrupt handlers */
+static inline uint64_t spin_lock_irqsave(Spinlock *lock) {
+    uint64_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(Spinlock *lock, uint64_t flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+#endif /* SPINLOCK_H */
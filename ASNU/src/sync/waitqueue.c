@@ -0,0 +1,116 @@
+#include "waitqueue.h"
+#include <KiSimple.h>
+#include <smp/smp.h>
+#include <time/tick.h>
+#include <time/timer.h>
+
+void waitqueue_init(WaitQueue *wq) {
+    spin_lock_init(&wq->lock);
+    wq->head = wq->tail = NULL;
+}
+
+static void wq_del(WaitQueue *wq, WaitQueueEntry *e) {
+    if (e->prev) e->prev->next = e->next;
+    else wq->head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else wq->tail = e->prev;
+    e->next = e->prev = NULL;
+    /* Last touch: the waiter may return and reuse its stack after this */
+    __atomic_store_n(&e->queued, false, __ATOMIC_RELEASE);
+}
+
+/* Queue the caller (if a wakeup removed it) and announce it is about to block */
+void wait_prepare(WaitQueue *wq, WaitQueueEntry *e, SchedulerState state, bool exclusive) {
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    if (!e->queued) {
+        e->proc = this_cpu()->current;
+        e->exclusive = exclusive;
+        e->queued = true;
+        e->next = NULL;
+        e->prev = wq->tail;
+        if (wq->tail) wq->tail->next = e;
+        else wq->head = e;
+        wq->tail = e;
+    }
+    spin_unlock(&wq->lock);
+
+    /* Full barrier: the condition is read only after this is visible */
+    sched_set_state(state);
+    irq_restore(flags);
+}
+
+void wait_finish(WaitQueue *wq, WaitQueueEntry *e) {
+    uint64_t flags = irq_save();
+    sched_set_state(PROC_RUNNING);
+    irq_restore(flags);
+
+    if (__atomic_load_n(&e->queued, __ATOMIC_ACQUIRE)) {
+        flags = spin_lock_irqsave(&wq->lock);
+        if (e->queued) wq_del(wq, e);
+        spin_unlock_irqrestore(&wq->lock, flags);
+    }
+}
+
+/* The idle context (boot code included) cannot block and polls instead */
+static bool wait_can_block(void) {
+    PerCpu *cpu = this_cpu();
+    return cpu->current && cpu->current != &cpu->idle;
+}
+
+void wait_schedule(void) {
+    if (!wait_can_block()) {
+        asm volatile ("pause");
+        return;
+    }
+    uint64_t flags = irq_save();
+    context_switch();
+    irq_restore(flags);
+}
+
+static void wait_timeout_fn(void *arg) {
+    sched_wakeup((Procedure*)arg);
+}
+
+/* wait_schedule() with a deadline; returns the time left, 0 once it passed */
+uint64_t wait_schedule_timeout(uint64_t ns) {
+    uint64_t start = tick_get_ns();
+    if (wait_can_block()) {
+        Timer t;
+        timer_init(&t, wait_timeout_fn, this_cpu()->current);
+
+        uint64_t flags = irq_save();
+        add_timer(&t, ns, 0);
+        context_switch();
+        irq_restore(flags);
+        del_timer(&t);
+    } else {
+        asm volatile ("pause");
+    }
+
+    uint64_t spent = tick_get_ns() - start;
+    return spent >= ns ? 0 : ns - spent;
+}
+
+/* Wake every non-exclusive waiter and up to nr exclusive ones (0: all); returns how many woke */
+size_t wake_up_nr(WaitQueue *wq, size_t nr) {
+    /* Pairs with the barrier in wait_prepare(): the caller's condition update is visible first */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&wq->head, __ATOMIC_RELAXED)) return 0;
+
+    size_t woken = 0;
+    size_t excl = 0;
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    WaitQueueEntry *e = wq->head;
+    while (e) {
+        WaitQueueEntry *next = e->next;
+        Procedure *proc = e->proc;
+        bool exclusive = e->exclusive;
+        wq_del(wq, e);
+        sched_wakeup(proc);
+        woken++;
+        if (exclusive && nr && ++excl >= nr) break;
+        e = next;
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+    return woken;
+}
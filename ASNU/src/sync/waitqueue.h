@@ -0,0 +1,71 @@
+#ifndef WAITQUEUE_H
+#define WAITQUEUE_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sync/spinlock.h>
+#include <sched/scheduler.h>
+
+/*
+ * A list of procedures blocked until some condition holds. Waiters queue
+ * themselves, set their state and recheck the condition before switching
+ * away, so a wake_up() that lands in between is never lost. A waker
+ * removes the entries it wakes; waking an empty queue is one load, cheap
+ * enough for interrupt handlers.
+ */
+
+typedef struct WaitQueueEntry {
+    struct WaitQueueEntry *next, *prev;
+    Procedure *proc;
+    bool exclusive;             /* wake_up_one() stops after the first of these */
+    bool queued;
+} WaitQueueEntry;
+
+typedef struct WaitQueue {
+    Spinlock lock;
+    WaitQueueEntry *head, *tail;
+} WaitQueue;
+
+#define WAITQUEUE_INIT { SPINLOCK_INIT, NULL, NULL }
+
+void waitqueue_init(WaitQueue *wq);
+
+void wait_prepare(WaitQueue *wq, WaitQueueEntry *e, SchedulerState state, bool exclusive);
+void wait_finish(WaitQueue *wq, WaitQueueEntry *e);
+void wait_schedule(void);
+uint64_t wait_schedule_timeout(uint64_t ns);
+
+size_t wake_up_nr(WaitQueue *wq, size_t nr);
+#define wake_up_one(wq) wake_up_nr((wq), 1)
+#define wake_up_all(wq) wake_up_nr((wq), 0)
+
+#define __wait_event(wq, cond, excl) do {                       \
+    WaitQueueEntry __wqe = { 0 };                               \
+    for (;;) {                                                  \
+        wait_prepare((wq), &__wqe, PROC_WAITING, (excl));       \
+        if (cond) break;                                        \
+        wait_schedule();                                        \
+    }                                                           \
+    wait_finish((wq), &__wqe);                                  \
+} while (0)
+
+/* Block until cond is true; cond is re-evaluated after every wakeup */
+#define wait_event(wq, cond) __wait_event((wq), (cond), false)
+#define wait_event_exclusive(wq, cond) __wait_event((wq), (cond), true)
+
+/* As wait_event, giving up after ns; evaluates to whether cond became true */
+#define wait_event_timeout(wq, cond, ns) ({                     \
+    WaitQueueEntry __wqe = { 0 };                               \
+    uint64_t __left = (ns);                                     \
+    bool __ok;                                                  \
+    for (;;) {                                                  \
+        wait_prepare((wq), &__wqe, PROC_WAITING, false);        \
+        if ((__ok = (cond)) || !__left) break;                  \
+        __left = wait_schedule_timeout(__left);                 \
+    }                                                           \
+    wait_finish((wq), &__wqe);                                  \
+    __ok;                                                       \
+})
+
+#endif /* WAITQUEUE_H */
@@ -0,0 +1,16 @@
+#ifndef CLOCKEVENT_H
+#define CLOCKEVENT_H 1
+
+#include <stdint.h>
+
+/* A per-CPU timer interrupt source the tick code can program */
+typedef struct ClockEvent {
+    const char *name;
+    uint32_t rating;            /* higher is better, 0 is unusable */
+    uint64_t max_delta_ns;      /* longest one-shot the device can be armed for */
+    void (*set_periodic)(uint32_t freq);    /* NULL for one-shot only devices: the tick re-arms them each period */
+    void (*set_oneshot)(uint64_t delta_ns);
+    void (*shutdown)(void);
+} ClockEvent;
+
+#endif /* CLOCKEVENT_H */
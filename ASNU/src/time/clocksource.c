@@ -0,0 +1,199 @@
+#include "clocksource.h"
+#include <KiSimple.h>
+#include <Serial/serial.h>
+#include <sync/seqlock.h>
+#include <time/timer.h>
+
+/* ns = base_ns + (cycles - base_cycles) * mult >> CLOCK_SHIFT */
+#define CLOCK_SHIFT         24
+#define TSC_CALIBRATE_MS    50
+
+#define TSC_RATING          300
+
+static Spinlock cs_list_lock = SPINLOCK_INIT;
+static ClockSource *cs_list = NULL;
+
+static Seqlock clock_seq = SEQLOCK_INIT;
+static const ClockSource *clock_cs = NULL;
+static uint64_t clock_base_cycles = 0;
+static uint64_t clock_base_ns = 0;
+static uint64_t clock_mult = 0;
+
+static volatile bool tsc_stable = false;
+
+/*
+ * Counters narrower than 64 bits are re-based every half wrap, so a delta never wraps.
+ * The timer stays on the boot CPU and re-checks at least this often, so a switch made
+ * anywhere (even on an AP that has no timers yet) is picked up in time.
+ */
+#define CLOCK_REBASE_CHECK_NS   1000000000ULL
+
+static Timer clock_rebase_timer;
+
+static inline uint64_t clock_delta_ns(const ClockSource *cs, uint64_t cycles) {
+    uint64_t delta = (cycles - clock_base_cycles) & cs->mask;
+    return (uint64_t)(((unsigned __int128)delta * clock_mult) >> CLOCK_SHIFT);
+}
+
+uint64_t ktime_get_ns(void) {
+    uint32_t seq;
+    uint64_t ns;
+    do {
+        seq = read_seqbegin(&clock_seq);
+        const ClockSource *cs = clock_cs;
+        ns = cs ? clock_base_ns + clock_delta_ns(cs, cs->read()) : 0;
+    } while (read_seqretry(&clock_seq, seq));
+    return ns;
+}
+
+const ClockSource *clocksource_current(void) {
+    return clock_cs;
+}
+
+/* Hand the clock to cs, carrying on from the time the old source reads now */
+static void clocksource_switch(const ClockSource *cs) {
+    if (cs->enable) cs->enable();
+
+    uint64_t flags = write_seqlock_irqsave(&clock_seq);
+    if (clock_cs) clock_base_ns += clock_delta_ns(clock_cs, clock_cs->read());
+    clock_base_cycles = cs->read();
+    clock_mult = (1000000000ULL << CLOCK_SHIFT) / cs->freq_hz;
+    clock_cs = cs;
+    write_sequnlock_irqrestore(&clock_seq, flags);
+}
+
+static uint64_t clock_rebase_ns(const ClockSource *cs) {
+    if (!cs || cs->mask == ~0ULL) return CLOCK_REBASE_CHECK_NS;
+    uint64_t ns = (uint64_t)((unsigned __int128)(cs->mask >> 1) * 1000000000ULL / cs->freq_hz);
+    return ns < CLOCK_REBASE_CHECK_NS ? ns : CLOCK_REBASE_CHECK_NS;
+}
+
+static void clock_rebase(void *arg) {
+    (void)arg;
+    uint64_t flags = write_seqlock_irqsave(&clock_seq);
+    const ClockSource *cs = clock_cs;
+    if (cs && cs->mask != ~0ULL) {
+        uint64_t cycles = cs->read();
+        clock_base_ns += clock_delta_ns(cs, cycles);
+        clock_base_cycles = cycles;
+    }
+    write_sequnlock_irqrestore(&clock_seq, flags);
+    add_timer(&clock_rebase_timer, clock_rebase_ns(cs), 0);
+}
+
+/* Called on the boot CPU once it has timers; the rebase timer lives there from now on */
+void clocksource_start_rebase(void) {
+    timer_init(&clock_rebase_timer, clock_rebase, NULL);
+    add_timer(&clock_rebase_timer, clock_rebase_ns(clock_cs), 0);
+    if (!timer_pending(&clock_rebase_timer))
+        serial_fwrite("Clocksource: rebase timer not armed, narrow clocks will wrap");
+}
+
+static ClockSource *clocksource_best(void) {
+    ClockSource *best = NULL;
+    for (ClockSource *cs = cs_list; cs; cs = cs->next)
+        if (cs->rating && cs->freq_hz && (!best || cs->rating > best->rating)) best = cs;
+    return best;
+}
+
+static void clocksource_select(void) {
+    uint64_t flags = spin_lock_irqsave(&cs_list_lock);
+    ClockSource *best = clocksource_best();
+    if (best && best != clock_cs) clocksource_switch(best);
+    spin_unlock_irqrestore(&cs_list_lock, flags);
+}
+
+void clocksource_register(ClockSource *cs) {
+    uint64_t flags = spin_lock_irqsave(&cs_list_lock);
+    cs->next = cs_list;
+    cs_list = cs;
+    spin_unlock_irqrestore(&cs_list_lock, flags);
+    clocksource_select();
+}
+
+static uint64_t tsc_read(void) {
+    return rdtsc();
+}
+
+static ClockSource tsc_clocksource = {
+    .name = "tsc",
+    .rating = TSC_RATING,
+    .read = tsc_read,
+    .mask = ~0ULL,
+    .freq_hz = 0,
+};
+
+/* Crystal clock times the TSC/crystal ratio; 0 where the CPU leaves either out */
+static uint64_t tsc_freq_cpuid(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 0x15) return 0;
+    cpuid(0x15, 0, &eax, &ebx, &ecx, &edx);
+    if (!eax || !ebx || !ecx) return 0;
+    return (uint64_t)ecx * ebx / eax;
+}
+
+/* Count TSC cycles over TSC_CALIBRATE_MS of ref, starting on an edge of ref */
+static uint64_t tsc_freq_measure(const ClockSource *ref) {
+    uint64_t span = ref->freq_hz * TSC_CALIBRATE_MS / 1000;
+    uint64_t r0 = ref->read();
+    while (ref->read() == r0)
+        asm volatile ("pause");
+    r0 = ref->read();
+    uint64_t t0 = rdtsc();
+
+    uint64_t r1;
+    while ((((r1 = ref->read()) - r0) & ref->mask) < span)
+        asm volatile ("pause");
+    uint64_t t1 = rdtsc();
+    return (uint64_t)((unsigned __int128)(t1 - t0) * ref->freq_hz / ((r1 - r0) & ref->mask));
+}
+
+/*
+ * Invariant TSC ticks at a constant rate through P- and C-states. Guests get the same
+ * bit only when the hypervisor keeps the TSC steady across vCPU migration.
+ */
+static bool tsc_invariant(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 0x80000007) return false;
+    cpuid(0x80000007, 0, &eax, &ebx, &ecx, &edx);
+    return (edx >> 8) & 1;
+}
+
+void clocksource_init(void) {
+    const char *how = "CPUID 0x15";
+    uint64_t hz = tsc_freq_cpuid();
+    const ClockSource *ref = clock_cs;
+    if (!hz && ref) {
+        hz = tsc_freq_measure(ref);
+        how = ref->name;
+    }
+
+    tsc_clocksource.freq_hz = hz;
+    tsc_stable = hz && tsc_invariant();
+    if (!tsc_stable) tsc_clocksource.rating = 0;
+    serial_fwrite("TSC: %llu kHz from %s%s", hz / 1000, how, tsc_stable ? "" : ", not used: not invariant");
+
+    clocksource_register(&tsc_clocksource);
+    if (clock_cs) serial_fwrite("Clocksource: %s", clock_cs->name);
+}
+
+uint64_t clocksource_tsc_hz(void) {
+    return tsc_clocksource.freq_hz;
+}
+
+bool clocksource_tsc_stable(void) {
+    return tsc_stable;
+}
+
+void clocksource_mark_tsc_unstable(const char *reason) {
+    if (!__atomic_exchange_n(&tsc_stable, false, __ATOMIC_ACQ_REL)) return;
+    tsc_clocksource.rating = 0;
+    clocksource_select();
+    serial_fwrite("TSC unstable: %s; clocksource: %s", reason, clock_cs ? clock_cs->name : "none");
+}
+
+void clocksource_check_tsc_sync(uint64_t launch_tsc) {
+    if (rdtsc() < launch_tsc) clocksource_mark_tsc_unstable("an application processor is behind the boot CPU");
+}
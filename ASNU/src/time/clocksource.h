@@ -0,0 +1,49 @@
+#ifndef CLOCKSOURCE_H
+#define CLOCKSOURCE_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Monotonic time. A clock source is a free-running counter. The best one
+ * registered becomes the kernel clock, and ktime_get_ns() turns its
+ * counter into nanoseconds since boot. The conversion parameters sit
+ * behind a seqlock, so readers take no lock and the clock can switch
+ * sources without jumping.
+ *
+ * The TSC is preferred. Its rate comes from CPUID leaf 0x15 when the CPU
+ * reports it, and is otherwise measured against the best other source.
+ * It is only used if it is invariant. It is dropped if an
+ * application processor's TSC turns out to be behind the boot CPU's.
+ */
+
+typedef struct ClockSource {
+    const char *name;
+    uint32_t rating;            /* higher is better, 0 is unusable */
+    uint64_t (*read)(void);
+    uint64_t mask;              /* counter width */
+    uint64_t freq_hz;
+    void (*enable)(void);       /* optional, run before it becomes the kernel clock */
+    struct ClockSource *next;
+} ClockSource;
+
+void clocksource_register(ClockSource *cs);
+/* Calibrate and register the TSC, then pick the kernel clock; needs the PIT interrupt running */
+void clocksource_init(void);
+
+/* Boot CPU, once its timers run: re-base clocks narrower than 64 bits before they wrap */
+void clocksource_start_rebase(void);
+
+/* Nanoseconds since the first clock source was registered; 0 before that */
+uint64_t ktime_get_ns(void);
+const ClockSource *clocksource_current(void);
+
+/* TSC rate, 0 if unknown, and whether it is safe to use as time across CPUs */
+uint64_t clocksource_tsc_hz(void);
+bool clocksource_tsc_stable(void);
+void clocksource_mark_tsc_unstable(const char *reason);
+
+/* On an application processor as it starts: is its TSC at least the boot CPU's launch_tsc? */
+void clocksource_check_tsc_sync(uint64_t launch_tsc);
+
+#endif /* CLOCKSOURCE_H */
@@ -0,0 +1,209 @@
+#include "tick.h"
+#include <KiSimple.h>
+#include <Serial/serial.h>
+#include <Drivers/PIT.h>
+#include <Drivers/LAPIC.h>
+#include <Drivers/HPET.h>
+#include <sched/scheduler.h>
+#include <sync/spinlock.h>
+#include <smp/smp.h>
+#include <time/timer.h>
+#include <time/clocksource.h>
+
+static uint32_t tick_hz = 0;
+static uint64_t ns_per_tick = 0;
+
+/*
+ * jiffies and tick catch-up follow the kernel clock, so they stay right
+ * while every tick is stopped. Not the raw TSC: it may be behind on some
+ * CPUs, which is what marks it unstable, and then it is not the clock.
+ */
+static Spinlock jiffies_lock = SPINLOCK_INIT;
+static uint64_t jiffies = 0;
+static uint64_t jiffies_ns = 0;
+
+uint32_t tick_get_hz(void) {
+    return tick_hz;
+}
+
+uint64_t tick_period_ns(void) {
+    return ns_per_tick;
+}
+
+/* TSC cycles in ns, for clock events armed in TSC time */
+uint64_t tick_ns_to_tsc(uint64_t ns) {
+    return (uint64_t)((unsigned __int128)ns * clocksource_tsc_hz() / 1000000000ULL);
+}
+
+/* The kernel clock, whichever source drives it */
+uint64_t tick_get_ns(void) {
+    return ktime_get_ns();
+}
+
+uint64_t tick_get_jiffies(void) {
+    if (!ns_per_tick) return pit_get_ticks();
+
+    uint64_t flags = spin_lock_irqsave(&jiffies_lock);
+    uint64_t now_ns = ktime_get_ns();
+    uint64_t n = now_ns > jiffies_ns ? (now_ns - jiffies_ns) / ns_per_tick : 0;
+    jiffies += n;
+    jiffies_ns += n * ns_per_tick;
+    uint64_t now = jiffies;
+    spin_unlock_irqrestore(&jiffies_lock, flags);
+    return now;
+}
+
+/* Whole tick periods since the last accounted boundary; the remainder carries over */
+static uint64_t tick_catch_up(TickState *ts) {
+    uint64_t now = ktime_get_ns();
+    uint64_t n = now > ts->last_tick_ns ? (now - ts->last_tick_ns) / ns_per_tick : 0;
+    ts->last_tick_ns += n * ns_per_tick;
+    return n;
+}
+
+/* Earliest deadline this CPU has to wake up for, in ns from now */
+static uint64_t tick_next_event_ns(void) {
+    return timer_next_event_ns();
+}
+
+static void tick_program_oneshot(TickState *ts) {
+    uint64_t delta = tick_next_event_ns();
+    if (delta > ts->dev->max_delta_ns) delta = ts->dev->max_delta_ns;
+    ts->dev->set_oneshot(delta);
+}
+
+static void tick_stop(TickState *ts) {
+    ts->stopped = true;
+    ts->stops++;
+    tick_program_oneshot(ts);
+}
+
+/* A timer was added: re-arm a stopped tick in case it is due earlier */
+void tick_nohz_reprogram(void) {
+    uint64_t flags = irq_save();
+    TickState *ts = &this_cpu()->tick;
+    if (ts->dev && ts->stopped) tick_program_oneshot(ts);
+    irq_restore(flags);
+}
+
+/*
+ * Periodic mode, or a one-shot that tick_handle() keeps re-arming. The
+ * one-shot aims at the next period boundary after the last accounted one,
+ * not a period from now, so interrupt latency does not stretch the tick.
+ */
+static void tick_set_periodic(TickState *ts) {
+    if (ts->dev->set_periodic) {
+        ts->dev->set_periodic(tick_hz);
+        return;
+    }
+    uint64_t now = ktime_get_ns();
+    uint64_t next = ts->last_tick_ns + ns_per_tick;
+    while (next <= now) next += ns_per_tick;
+    ts->dev->set_oneshot(next - now);
+}
+
+static void tick_restart(TickState *ts) {
+    uint64_t n = tick_catch_up(ts);
+    ts->pending_ticks += n;
+    ts->ticks_avoided += n;
+    ts->stopped = false;
+    tick_set_periodic(ts);
+}
+
+/*
+ * Bring up the clock sources, then move the boot CPU to its local APIC
+ * timer. The PIT stays on only while it is the kernel clock.
+ */
+void tick_init(void) {
+    tick_hz = pit_get_frequency();
+    if (!tick_hz) return;
+
+    clocksource_init();
+    jiffies = pit_get_ticks();
+    jiffies_ns = ktime_get_ns();
+    ns_per_tick = 1000000000ULL / tick_hz;
+    serial_fwrite("Tick: %u Hz, %llu ns per tick", tick_hz, ns_per_tick);
+
+    tick_init_cpu();
+    clocksource_start_rebase();
+    if (clocksource_current() != &PitClockSource) pit_stop();
+}
+
+/* The calling CPU's best timer: its local APIC's, unless an HPET comparator rates higher */
+static const ClockEvent *tick_pick_device(void) {
+    const ClockEvent *dev = lapic_clock_event();
+    const ClockEvent *hpet = hpet_claim_clock_event(dev->rating);
+    return hpet ? hpet : dev;
+}
+
+void tick_init_cpu(void) {
+    const ClockEvent *dev = tick_pick_device();
+    serial_fwrite("Tick: CPU %u on %s", this_cpu()->cpu_id, dev->name);
+    timer_init_cpu(this_cpu());
+
+    TickState *ts = &this_cpu()->tick;
+    ts->dev = dev;
+    ts->stopped = false;
+    ts->last_tick_ns = ktime_get_ns();
+    tick_set_periodic(ts);
+}
+
+/* Timer interrupt, periodic or one-shot */
+void tick_handle(void) {
+    PerCpu *cpu = this_cpu();
+    TickState *ts = &cpu->tick;
+    if (!ts->dev) return;
+
+    uint64_t ticks;
+    if (ts->stopped) {
+        ticks = tick_catch_up(ts);
+        if (ticks > 1) ts->ticks_avoided += ticks - 1;
+        tick_program_oneshot(ts);
+    } else if (ts->dev->set_periodic) {
+        ticks = 1;
+        ts->last_tick_ns = ktime_get_ns();
+    } else {
+        ticks = tick_catch_up(ts);
+        tick_set_periodic(ts);
+    }
+
+    timer_run();
+
+    ticks += ts->pending_ticks;
+    ts->pending_ticks = 0;
+    if (ticks) scheduler_tick(ticks);
+}
+
+/*
+ * Stop or restart the tick to match the run queue. Called with the run
+ * queue lock held, so a remote wakeup either sees the tick stopped and
+ * sends a reschedule IPI, or enqueued before we looked. A deadline
+ * procedure keeps the tick even alone: the tick is what charges its
+ * runtime and throttles it when the budget is spent.
+ */
+void tick_nohz_update_locked(PerCpu *cpu) {
+    TickState *ts = &cpu->tick;
+    if (!ts->dev || !ns_per_tick) return;
+
+    bool can_stop = cpu->rq.nr_ready == 0 && cpu->current->sched_class != SCHED_CLASS_DL;
+    if (can_stop && !ts->stopped) tick_stop(ts);
+    else if (!can_stop && ts->stopped) tick_restart(ts);
+}
+
+void tick_nohz_update(void) {
+    uint64_t flags = irq_save();
+    PerCpu *cpu = this_cpu();
+    spin_lock(&cpu->rq.lock);
+    tick_nohz_update_locked(cpu);
+    spin_unlock(&cpu->rq.lock);
+    irq_restore(flags);
+}
+
+void tick_dump_stats(void) {
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        PerCpu *cpu = smp_get_cpu(i);
+        if (!cpu->online) continue;
+        serial_fwrite("Tick CPU %u: %llu ticks, stopped %llu times, %llu ticks avoided%s",
+            i, cpu->ticks, cpu->tick.stops, cpu->tick.ticks_avoided, cpu->tick.stopped ? " (stopped)" : "");
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef TICK_H
+#define TICK_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time/clockevent.h>
+
+/*
+ * Dynamic ticks. A CPU runs a periodic tick only while something could be
+ * preempted, i.e. while tasks are queued behind the running one. An idle
+ * CPU, or one with a single runnable task, switches its clock event to
+ * one-shot mode armed for the next pending deadline, and the tick periods
+ * that pass meanwhile are accounted when it fires or the tick restarts.
+ */
+typedef struct TickState {
+    const ClockEvent *dev;
+    bool stopped;
+    uint64_t last_tick_ns;      /* kernel clock at the last accounted tick boundary */
+    uint64_t pending_ticks;     /* elapsed while stopped, charged on the next tick */
+    uint64_t stops;
+    uint64_t ticks_avoided;     /* tick periods that passed without an interrupt */
+} TickState;
+
+struct PerCpu;
+
+void tick_init(void);
+void tick_init_cpu(void);
+void tick_handle(void);
+void tick_nohz_update(void);
+void tick_nohz_update_locked(struct PerCpu *cpu);
+void tick_nohz_reprogram(void);
+uint32_t tick_get_hz(void);
+uint64_t tick_get_jiffies(void);
+uint64_t tick_get_ns(void);
+uint64_t tick_period_ns(void);
+uint64_t tick_ns_to_tsc(uint64_t ns);
+void tick_dump_stats(void);
+
+#endif /* TICK_H */
@@ -0,0 +1,264 @@
+#include "timer.h"
+#include <string.h>
+#include <KiSimple.h>
+#include <PMM/pmm.h>
+#include <sched/scheduler.h>
+#include <smp/smp.h>
+#include <time/tick.h>
+
+_Static_assert(TIMER_SLOTS * sizeof(Timer*) <= 4096, "timer wheel must fit in one page");
+
+static inline Timer **tv(TimerBase *base, int level, uint64_t idx) {
+    if (level == 0) return &base->vec[idx];
+    return &base->vec[TIMER_TV1_SIZE + (level - 1) * TIMER_TVN_SIZE + idx];
+}
+
+static inline uint64_t tvn_index(uint64_t expires, int level) {
+    return (expires >> (TIMER_TV1_BITS + (level - 1) * TIMER_TVN_BITS)) & (TIMER_TVN_SIZE - 1);
+}
+
+static inline uint64_t timer_now_units(void) {
+    return tick_get_ns() >> TIMER_UNIT_SHIFT;
+}
+
+static void timer_list_add(Timer **head, Timer *t) {
+    t->prev = NULL;
+    t->next = *head;
+    if (*head) (*head)->prev = t;
+    *head = t;
+    t->slot = head;
+}
+
+static void timer_list_del(Timer *t) {
+    if (t->prev) t->prev->next = t->next;
+    else *t->slot = t->next;
+    if (t->next) t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+    t->slot = NULL;
+}
+
+/* The slot t belongs in at the current wheel position */
+static Timer **timer_slot(TimerBase *base, Timer *t) {
+    uint64_t expires = t->expires;
+    uint64_t idx = expires - base->clk;
+
+    if ((int64_t)idx < 0) return tv(base, 0, base->clk & (TIMER_TV1_SIZE - 1));
+    if (idx < TIMER_TV1_SIZE) return tv(base, 0, expires & (TIMER_TV1_SIZE - 1));
+
+    for (int level = 1; level < TIMER_LEVELS; level++) {
+        if (idx < (1ULL << (TIMER_TV1_BITS + level * TIMER_TVN_BITS)) || level == TIMER_LEVELS - 1)
+            return tv(base, level, tvn_index(expires, level));
+    }
+    return NULL;
+}
+
+/*
+ * Round the expiry up to the coarsest boundary inside [expires, expires + slack]:
+ * timers that tolerate some lateness then share slots and interrupts.
+ */
+static uint64_t timer_apply_slack(uint64_t expires, uint64_t slack) {
+    if (slack == 0) return expires;
+    uint64_t limit = expires + slack;
+    int bit = 63 - __builtin_clzll(limit ^ expires);
+    return limit & ~((1ULL << bit) - 1);
+}
+
+void timer_init_cpu(PerCpu *cpu) {
+    TimerBase *base = &cpu->timers;
+    spin_lock_init(&base->lock);
+    base->vec = (Timer**)palloc();
+    if (base->vec) memset(base->vec, 0, 4096);
+    base->count = 0;
+    base->running = NULL;
+    base->clk = tick_get_ns() >> TIMER_UNIT_SHIFT;
+}
+
+void timer_init(Timer *t, void (*fn)(void *arg), void *arg) {
+    memset(t, 0, sizeof(Timer));
+    t->fn = fn;
+    t->arg = arg;
+}
+
+bool timer_pending(Timer *t) {
+    return __atomic_load_n(&t->base, __ATOMIC_ACQUIRE) != NULL;
+}
+
+/* Arm t on the calling CPU's wheel; a pending t is moved */
+void add_timer(Timer *t, uint64_t delay_ns, uint64_t slack_ns) {
+    del_timer(t);
+
+    uint64_t flags = irq_save();
+    TimerBase *base = &this_cpu()->timers;
+    if (!base->vec) {
+        irq_restore(flags);
+        return;
+    }
+
+    uint64_t now = tick_get_ns();
+    uint64_t expires = (now + delay_ns + (1ULL << TIMER_UNIT_SHIFT) - 1) >> TIMER_UNIT_SHIFT;
+    expires = timer_apply_slack(expires, slack_ns >> TIMER_UNIT_SHIFT);
+
+    spin_lock(&base->lock);
+    if (expires - base->clk > 0xFFFFFFFFULL && (int64_t)(expires - base->clk) > 0)
+        expires = base->clk + 0xFFFFFFFFULL;    /* about 49 days */
+    t->expires = expires;
+    timer_list_add(timer_slot(base, t), t);
+    __atomic_store_n(&t->base, base, __ATOMIC_RELEASE);
+    base->count++;
+    spin_unlock(&base->lock);
+
+    /* A stopped tick may be armed for later than this */
+    tick_nohz_reprogram();
+    irq_restore(flags);
+}
+
+/* Cancel t; waits for its callback if it is running on another CPU. True if it was pending */
+bool del_timer(Timer *t) {
+    for (;;) {
+        TimerBase *base = __atomic_load_n(&t->base, __ATOMIC_ACQUIRE);
+        if (!base) {
+            /* Not queued, but possibly being run right now */
+            for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+                TimerBase *b = &smp_get_cpu(i)->timers;
+                while (__atomic_load_n(&b->running, __ATOMIC_ACQUIRE) == t && b != &this_cpu()->timers)
+                    asm volatile ("pause");
+            }
+            return false;
+        }
+
+        uint64_t flags = spin_lock_irqsave(&base->lock);
+        if (t->base == base) {
+            timer_list_del(t);
+            base->count--;
+            __atomic_store_n(&t->base, NULL, __ATOMIC_RELEASE);
+            spin_unlock_irqrestore(&base->lock, flags);
+            return true;
+        }
+        spin_unlock_irqrestore(&base->lock, flags);
+    }
+}
+
+/* Re-file every timer of a coarse slot one level down; returns the slot index */
+static uint64_t timer_cascade(TimerBase *base, int level, uint64_t idx) {
+    Timer **slot = tv(base, level, idx);
+    Timer *t = *slot;
+    *slot = NULL;
+    while (t) {
+        Timer *next = t->next;
+        timer_list_add(timer_slot(base, t), t);
+        t = next;
+    }
+    return idx;
+}
+
+/* Expire everything due on this CPU; called from the tick with interrupts off */
+void timer_run(void) {
+    TimerBase *base = &this_cpu()->timers;
+    if (!base->vec) return;
+
+    uint64_t now = timer_now_units();
+    spin_lock(&base->lock);
+
+    while ((int64_t)(now - base->clk) >= 0) {
+        if (base->count == 0) {
+            base->clk = now + 1;
+            break;
+        }
+
+        uint64_t index = base->clk & (TIMER_TV1_SIZE - 1);
+        if (index == 0) {
+            for (int level = 1; level < TIMER_LEVELS; level++)
+                if (timer_cascade(base, level, tvn_index(base->clk, level)) != 0) break;
+        }
+        base->clk++;
+
+        Timer **slot = tv(base, 0, index);
+        while (*slot) {
+            Timer *t = *slot;
+            timer_list_del(t);
+            base->count--;
+            void (*fn)(void *arg) = t->fn;
+            void *arg = t->arg;
+            __atomic_store_n(&base->running, t, __ATOMIC_RELEASE);
+            __atomic_store_n(&t->base, NULL, __ATOMIC_RELEASE);
+
+            spin_unlock(&base->lock);
+            fn(arg);
+            spin_lock(&base->lock);
+            __atomic_store_n(&base->running, NULL, __ATOMIC_RELEASE);
+        }
+    }
+
+    spin_unlock(&base->lock);
+}
+
+/*
+ * Time until the earliest timer on this CPU, for the dynamic tick. Up to
+ * the next cascade the first level is exact; past it every pending timer
+ * is looked at, which is cheap while few timers are armed that far out.
+ */
+uint64_t timer_next_event_ns(void) {
+    TimerBase *base = &this_cpu()->timers;
+    if (!base->vec || base->count == 0) return UINT64_MAX;
+
+    uint64_t flags = spin_lock_irqsave(&base->lock);
+    uint64_t next = UINT64_MAX;
+    uint64_t clk = base->clk;
+    do {
+        if (*tv(base, 0, clk & (TIMER_TV1_SIZE - 1))) {
+            next = clk;
+            break;
+        }
+        clk++;
+    } while (clk & (TIMER_TV1_SIZE - 1));
+
+    if (next == UINT64_MAX) {
+        for (int level = 0; level < TIMER_LEVELS; level++) {
+            uint64_t n = level ? TIMER_TVN_SIZE : TIMER_TV1_SIZE;
+            for (uint64_t i = 0; i < n; i++)
+                for (Timer *t = *tv(base, level, i); t; t = t->next)
+                    if ((int64_t)(t->expires - next) < 0 || next == UINT64_MAX) next = t->expires;
+        }
+    }
+    spin_unlock_irqrestore(&base->lock, flags);
+
+    if (next == UINT64_MAX) return UINT64_MAX;
+    uint64_t when = next << TIMER_UNIT_SHIFT;
+    uint64_t now = tick_get_ns();
+    return when > now ? when - now : 0;
+}
+
+static void sleep_timer_fn(void *arg) {
+    sched_wakeup((Procedure*)arg);
+}
+
+/*
+ * Block the calling procedure for at least ns. The idle context (boot code
+ * included) has nothing to switch to and spins instead.
+ */
+void sleep_ns(uint64_t ns) {
+    uint64_t end = tick_get_ns() + ns;
+    PerCpu *cpu = this_cpu();
+    if (!cpu->current || cpu->current == &cpu->idle) {
+        while (tick_get_ns() < end)
+            asm volatile ("pause");
+        return;
+    }
+
+    Timer t;
+    timer_init(&t, sleep_timer_fn, cpu->current);
+
+    for (;;) {
+        uint64_t now = tick_get_ns();
+        if (now >= end) break;
+
+        uint64_t flags = irq_save();
+        sched_set_state(PROC_SLEEPING);
+        add_timer(&t, end - now, (end - now) >> TIMER_SLACK_SHIFT);
+        context_switch();
+        irq_restore(flags);
+
+        /* Woken early by someone else */
+        del_timer(&t);
+    }
+}
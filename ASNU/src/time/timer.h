@@ -0,0 +1,58 @@
+#ifndef TIMER_H
+#define TIMER_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sync/spinlock.h>
+
+/*
+ * Per-CPU hierarchical timer wheel. Time is counted in units of 2^20 ns
+ * (about 1 ms). The first level has 256 one-unit slots, the four above it
+ * 64 slots each, every slot covering 64 slots of the level below; timers
+ * far out sit in a coarse slot and are cascaded down as the wheel turns.
+ * Insert and cancel are O(1).
+ */
+
+#define TIMER_UNIT_SHIFT    20
+#define TIMER_TV1_BITS      8
+#define TIMER_TVN_BITS      6
+#define TIMER_TV1_SIZE      (1 << TIMER_TV1_BITS)
+#define TIMER_TVN_SIZE      (1 << TIMER_TVN_BITS)
+#define TIMER_LEVELS        5
+#define TIMER_SLOTS         (TIMER_TV1_SIZE + (TIMER_LEVELS - 1) * TIMER_TVN_SIZE)
+
+/* Default slack of sleep_ns(): 1/256 of the delay, like other kernels */
+#define TIMER_SLACK_SHIFT   8
+
+struct TimerBase;
+
+typedef struct Timer {
+    struct Timer *next, *prev;
+    struct Timer **slot;        /* list head it is on, moves when cascaded */
+    uint64_t expires;           /* wheel units */
+    void (*fn)(void *arg);      /* runs from the tick, interrupts off */
+    void *arg;
+    struct TimerBase *base;
+} Timer;
+
+typedef struct TimerBase {
+    Spinlock lock;
+    uint64_t clk;               /* next unit to process */
+    uint32_t count;
+    Timer *running;
+    Timer **vec;                /* TIMER_SLOTS list heads, one page */
+} TimerBase;
+
+struct PerCpu;
+
+void timer_init_cpu(struct PerCpu *cpu);
+void timer_init(Timer *t, void (*fn)(void *arg), void *arg);
+void add_timer(Timer *t, uint64_t delay_ns, uint64_t slack_ns);
+bool del_timer(Timer *t);
+bool timer_pending(Timer *t);
+void timer_run(void);
+uint64_t timer_next_event_ns(void);
+
+void sleep_ns(uint64_t ns);
+
+#endif /* TIMER_H */
@@ -0,0 +1,150 @@
+#!/usr/bin/env python3
+"""Decode a scheduler trace dump captured from the serial console.
+
+Press 'r' on the kernel's serial console and save the output, e.g. from
+`make run-x86_64 | tee serial.log`. Everything outside the TRACE BEGIN /
+TRACE END block is ignored, so the whole log can be passed in.
+
+    sched_trace.py serial.log                 timeline and per-task report
+    sched_trace.py --no-timeline serial.log   report only
+"""
+
+import argparse
+import sys
+from collections import defaultdict
+
+SWITCH, WAKEUP, MIGRATE, BLOCK, TICK = 1, 2, 3, 4, 5
+
+TYPE_NAMES = {SWITCH: "switch", WAKEUP: "wakeup", MIGRATE: "migrate", BLOCK: "block", TICK: "tick"}
+
+STATE_NAMES = {0: "NEW", 1: "READY", 2: "RUNNING", 3: "WAITING", 4: "SLEEPING",
+               5: "TERMINATED", 6: "SUSPENDED", 7: "IDLE"}
+
+
+class Event:
+    __slots__ = ("cpu", "tsc", "type", "pid", "arg0", "arg1", "arg2")
+
+    def __init__(self, fields):
+        self.cpu, self.tsc, self.type, self.pid, self.arg0, self.arg1, self.arg2 = map(int, fields)
+
+
+def parse(lines):
+    """Events of the last complete dump in the log, oldest first, and the TSC rate."""
+    dumps = []
+    events = None
+    tsc_per_us = 1
+    lost = 0
+    for line in lines:
+        words = line.strip().split()
+        if words[:2] == ["TRACE", "BEGIN"] and len(words) == 4:
+            events, tsc_per_us, lost = [], max(int(words[3]), 1), 0
+        elif events is None:
+            continue
+        elif words[:2] == ["TRACE", "CPU"] and len(words) == 5:
+            lost += int(words[4])
+        elif words[:1] == ["E"] and len(words) == 8:
+            events.append(Event(words[1:]))
+        elif words[:2] == ["TRACE", "END"]:
+            dumps.append((events, tsc_per_us, lost))
+            events = None
+    if not dumps:
+        sys.exit("no complete TRACE BEGIN .. TRACE END block found")
+    events, tsc_per_us, lost = dumps[-1]
+    events.sort(key=lambda e: e.tsc)
+    return events, tsc_per_us, lost
+
+
+def describe(e):
+    if e.type == SWITCH:
+        return "%u -> %u (prev %s)" % (e.arg0, e.pid, STATE_NAMES.get(e.arg1, e.arg1))
+    if e.type == WAKEUP:
+        return "%u on CPU %u by %u (was %s)" % (e.pid, e.arg0, e.arg1, STATE_NAMES.get(e.arg2, e.arg2))
+    if e.type == MIGRATE:
+        return "%u CPU %u -> %u" % (e.pid, e.arg0, e.arg1)
+    if e.type == BLOCK:
+        return "%u %s" % (e.pid, STATE_NAMES.get(e.arg0, e.arg0))
+    if e.type == TICK:
+        return "%u running, %u periods, %u ready" % (e.pid, e.arg0, e.arg1)
+    return "pid %u %u %u %u" % (e.pid, e.arg0, e.arg1, e.arg2)
+
+
+def timeline(events, tsc_per_us, out):
+    base = events[0].tsc
+    for e in events:
+        us = (e.tsc - base) / tsc_per_us
+        out.write("%14.3f  CPU %-3u %-8s %s\n" % (us, e.cpu, TYPE_NAMES.get(e.type, e.type), describe(e)))
+
+
+class TaskStats:
+    def __init__(self):
+        self.run_us = 0.0
+        self.switches = 0
+        self.wakeups = 0
+        self.blocks = 0
+        self.migrations = 0
+        self.latencies = []
+
+
+def percentile(values, p):
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(len(ordered) * p))]
+
+
+def report(events, tsc_per_us, out):
+    tasks = defaultdict(TaskStats)
+    running = {}            # cpu -> (pid, tsc it was switched in)
+    woken = {}              # pid -> tsc of the wakeup not yet followed by a switch in
+
+    for e in events:
+        if e.type == SWITCH:
+            prev = running.get(e.cpu)
+            if prev and prev[0]:
+                tasks[prev[0]].run_us += (e.tsc - prev[1]) / tsc_per_us
+            running[e.cpu] = (e.pid, e.tsc)
+            if e.pid:
+                tasks[e.pid].switches += 1
+                if e.pid in woken:
+                    tasks[e.pid].latencies.append((e.tsc - woken.pop(e.pid)) / tsc_per_us)
+        elif e.type == WAKEUP:
+            tasks[e.pid].wakeups += 1
+            woken.setdefault(e.pid, e.tsc)
+        elif e.type == BLOCK:
+            tasks[e.pid].blocks += 1
+        elif e.type == MIGRATE:
+            tasks[e.pid].migrations += 1
+
+    out.write("%8s %12s %9s %8s %7s %7s %12s %12s %12s\n" % (
+        "pid", "run_us", "switches", "wakeups", "blocks", "migr", "lat_avg_us", "lat_p99_us", "lat_max_us"))
+    for pid in sorted(tasks):
+        t = tasks[pid]
+        if t.latencies:
+            lat = (sum(t.latencies) / len(t.latencies), percentile(t.latencies, 0.99), max(t.latencies))
+            lat_text = "%12.3f %12.3f %12.3f" % lat
+        else:
+            lat_text = "%12s %12s %12s" % ("-", "-", "-")
+        out.write("%8u %12.1f %9u %8u %7u %7u %s\n" % (
+            pid, t.run_us, t.switches, t.wakeups, t.blocks, t.migrations, lat_text))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("log", nargs="?", help="serial log, standard input if omitted")
+    parser.add_argument("--no-timeline", action="store_true", help="print only the per-task report")
+    args = parser.parse_args()
+
+    source = open(args.log, errors="replace") if args.log else sys.stdin
+    with source:
+        events, tsc_per_us, lost = parse(source)
+
+    if not events:
+        sys.exit("the dump holds no events")
+    span_us = (events[-1].tsc - events[0].tsc) / tsc_per_us
+    sys.stdout.write("%u events over %.1f us, %u overwritten before the dump\n\n" % (len(events), span_us, lost))
+    if not args.no_timeline:
+        timeline(events, tsc_per_us, sys.stdout)
+        sys.stdout.write("\n")
+    report(events, tsc_per_us, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()